@@ -1,5 +1,4 @@
 #include <stdlib.h>
-#include <map>
 #include <iostream>
 #include "udp_discovery_peer.hpp"
 
@@ -10,6 +9,21 @@
 #include <unistd.h>
 #endif
 
+class PrintingObserver : public udpdiscovery::PeerObserver {
+ public:
+  void OnPeerJoined(const udpdiscovery::DiscoveredPeer& peer) {
+    std::cout << "Peer joined: " << udpdiscovery::IpToString(peer.ip_port().ip()) << ", " << peer.user_data() << std::endl;
+  }
+
+  void OnPeerUserDataChanged(const udpdiscovery::DiscoveredPeer& peer) {
+    std::cout << "Peer changed user data: " << udpdiscovery::IpToString(peer.ip_port().ip()) << ", " << peer.user_data() << std::endl;
+  }
+
+  void OnPeerLeft(const udpdiscovery::DiscoveredPeer& peer) {
+    std::cout << "Peer left: " << udpdiscovery::IpToString(peer.ip_port().ip()) << ", " << peer.user_data() << std::endl;
+  }
+};
+
 void Usage(int argc, char* argv[]) {
   std::cout << "Usage: " << argv[0] << " application_id port" << std::endl;
   std::cout << "  application_id - integer id of application to discover" << std::endl;
@@ -40,61 +54,17 @@ int main(int argc, char* argv[]) {
   parameters.set_application_id(application_id);
 
   udpdiscovery::Peer peer;
+  PrintingObserver observer;
 
-  if (!peer.Start(parameters, ""))
+  if (!peer.Start(parameters, "", &observer))
     return 1;
 
-  std::list<udpdiscovery::DiscoveredPeer> discovered_peers;
-  std::map<udpdiscovery::IpPort, std::string> last_seen_user_datas;
-
   while (true) {
-    std::list<udpdiscovery::DiscoveredPeer> new_discovered_peers = peer.ListDiscovered();
-    if (!udpdiscovery::Same(parameters.same_peer_mode(), discovered_peers, new_discovered_peers)) {
-      discovered_peers = new_discovered_peers;
-
-      last_seen_user_datas.clear();
-      for (std::list<udpdiscovery::DiscoveredPeer>::const_iterator it = discovered_peers.begin(); it != discovered_peers.end(); ++it) {
-        last_seen_user_datas.insert(std::make_pair((*it).ip_port(), (*it).user_data()));
-      }
-
-      std::cout << "Discovered peers: " << discovered_peers.size() << std::endl;
-      for (std::list<udpdiscovery::DiscoveredPeer>::const_iterator it = discovered_peers.begin(); it != discovered_peers.end(); ++it) {
-        std::cout << " - " << udpdiscovery::IpToString((*it).ip_port().ip()) << ", " << (*it).user_data() << std::endl;
-      }
-    } else {
-      bool same_user_datas = true;
-      for (std::list<udpdiscovery::DiscoveredPeer>::const_iterator it = new_discovered_peers.begin(); it != new_discovered_peers.end(); ++it) {
-        std::map<udpdiscovery::IpPort, std::string>::const_iterator find_it = last_seen_user_datas.find((*it).ip_port());
-        if (find_it != last_seen_user_datas.end()) {
-          if ((*find_it).second != (*it).user_data()) {
-            same_user_datas = false;
-            break;
-          }
-        } else {
-          same_user_datas = false;
-          break;
-        }
-      }
-
-      if (!same_user_datas) {
-        discovered_peers = new_discovered_peers;
-
-        last_seen_user_datas.clear();
-        for (std::list<udpdiscovery::DiscoveredPeer>::const_iterator it = discovered_peers.begin(); it != discovered_peers.end(); ++it) {
-          last_seen_user_datas.insert(std::make_pair((*it).ip_port(), (*it).user_data()));
-        }
-
-        std::cout << "Discovered peers: " << discovered_peers.size() << std::endl;
-        for (std::list<udpdiscovery::DiscoveredPeer>::const_iterator it = discovered_peers.begin(); it != discovered_peers.end(); ++it) {
-          std::cout << " - " << udpdiscovery::IpToString((*it).ip_port().ip()) << ", " << (*it).user_data() << std::endl;
-        }
-      }
-    }
-
+    // Discovered peers are printed by the observer.
 #if defined(_WIN32)
-    Sleep(500);
+    Sleep(1000);
 #else
-    usleep(500000);
+    sleep(1);
 #endif
   }
 
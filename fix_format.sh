@@ -2,9 +2,15 @@
 
 script_dir=`dirname $0`
 clang-format -i --style=Google \
+${script_dir}/udp_discovery_atomic.hpp \
+${script_dir}/udp_discovery_hash_map.hpp \
 ${script_dir}/udp_discovery_peer.cpp \
 ${script_dir}/udp_discovery_peer.hpp \
+${script_dir}/udp_discovery_peer_benchmark.cpp \
 ${script_dir}/udp_discovery_peer_e2e_test.cpp \
+${script_dir}/udp_discovery_peers_table.cpp \
+${script_dir}/udp_discovery_peers_table.hpp \
+${script_dir}/udp_discovery_peers_table_test.cpp \
 ${script_dir}/udp_discovery_protocol.cpp \
 ${script_dir}/udp_discovery_protocol.hpp \
 ${script_dir}/udp_discovery_protocol_test.cpp \
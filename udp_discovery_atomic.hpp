@@ -0,0 +1,100 @@
+#ifndef __UDP_DISCOVERY_ATOMIC_H_
+#define __UDP_DISCOVERY_ATOMIC_H_
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+namespace udpdiscovery {
+namespace impl {
+// Minimal set of sequentially consistent atomic operations. The library is
+// built as C++98 so std::atomic is not available.
+
+// Returns the incremented value.
+inline long AtomicIncrement(volatile long* value) {
+#if defined(_WIN32)
+  return InterlockedIncrement(value);
+#else
+  return __sync_add_and_fetch(value, 1);
+#endif
+}
+
+// Returns the decremented value.
+inline long AtomicDecrement(volatile long* value) {
+#if defined(_WIN32)
+  return InterlockedDecrement(value);
+#else
+  return __sync_sub_and_fetch(value, 1);
+#endif
+}
+
+inline long AtomicLoad(volatile long* value) {
+#if defined(_WIN32)
+  return InterlockedCompareExchange(value, 0, 0);
+#elif defined(__ATOMIC_SEQ_CST)
+  return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+#else
+  return __sync_add_and_fetch(value, 0);
+#endif
+}
+
+// Returns the new value.
+inline uint64_t AtomicAdd(volatile uint64_t* value, uint64_t delta) {
+#if defined(_WIN32)
+  return (uint64_t)InterlockedExchangeAdd64((volatile LONG64*)value,
+                                            (LONG64)delta) +
+         delta;
+#else
+  return __sync_add_and_fetch(value, delta);
+#endif
+}
+
+inline uint64_t AtomicLoad(volatile uint64_t* value) {
+#if defined(_WIN32)
+  return (uint64_t)InterlockedCompareExchange64((volatile LONG64*)value, 0, 0);
+#elif defined(__ATOMIC_SEQ_CST)
+  return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+#else
+  return __sync_add_and_fetch(value, 0);
+#endif
+}
+
+template <typename ValueType>
+ValueType* AtomicLoadPointer(ValueType* volatile* pointer) {
+#if defined(_WIN32)
+  return (ValueType*)InterlockedCompareExchangePointer(
+      (PVOID volatile*)pointer, 0, 0);
+#elif defined(__ATOMIC_SEQ_CST)
+  return __atomic_load_n(pointer, __ATOMIC_SEQ_CST);
+#else
+  return __sync_val_compare_and_swap(pointer, (ValueType*)0, (ValueType*)0);
+#endif
+}
+
+// Returns the previous value.
+template <typename ValueType>
+ValueType* AtomicExchangePointer(ValueType* volatile* pointer,
+                                 ValueType* value) {
+#if defined(_WIN32)
+  return (ValueType*)InterlockedExchangePointer((PVOID volatile*)pointer,
+                                                value);
+#elif defined(__ATOMIC_SEQ_CST)
+  return __atomic_exchange_n(pointer, value, __ATOMIC_SEQ_CST);
+#else
+  ValueType* prev = *pointer;
+  while (true) {
+    ValueType* cur = __sync_val_compare_and_swap(pointer, prev, value);
+    if (cur == prev) {
+      return prev;
+    }
+    prev = cur;
+  }
+#endif
+}
+}  // namespace impl
+}  // namespace udpdiscovery
+
+#endif
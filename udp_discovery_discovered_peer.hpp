@@ -2,11 +2,19 @@
 #define __DISCOVERY_DISCOVERED_PEER_H_
 
 #include <stdint.h>
+#include <list>
 #include "udp_discovery_ip_port.hpp"
 
 namespace udpdiscovery {
   class DiscoveredPeer {
    public:
+    DiscoveredPeer()
+        : last_received_packet_(0),
+          last_updated_(0),
+          interface_index_(0),
+          user_data_tag_(0) {
+    }
+
     IpPort ip_port() const {
       return ip_port_;
     }
@@ -28,6 +36,10 @@ namespace udpdiscovery {
       last_received_packet_ = last_received_packet;
     }
 
+    void set_last_received_packet(uint64_t last_received_packet) {
+      last_received_packet_ = last_received_packet;
+    }
+
     void set_last_updated(long last_updated) {
       last_updated_ = last_updated;
     }
@@ -36,11 +48,115 @@ namespace udpdiscovery {
       return last_updated_;
     }
 
+    // Index of the network interface the last packet of the peer was received
+    // on, 0 if unknown. Known on Linux only.
+    unsigned int interface_index() const {
+      return interface_index_;
+    }
+
+    void set_interface_index(unsigned int interface_index) {
+      interface_index_ = interface_index;
+    }
+
+    // Tag of user_data() that heartbeats of the peer are compared with.
+    uint32_t user_data_tag() const {
+      return user_data_tag_;
+    }
+
+    void set_user_data_tag(uint32_t user_data_tag) {
+      user_data_tag_ = user_data_tag;
+    }
+
    private:
     IpPort ip_port_;
     std::string user_data_;
     uint64_t last_received_packet_;
     long last_updated_;
+    unsigned int interface_index_;
+    uint32_t user_data_tag_;
+  };
+
+  class DiscoveredPeerChange {
+   public:
+    enum Type {
+      kAdded,
+      kUserDataChanged,
+      kRemoved,
+    };
+
+    DiscoveredPeerChange() : type_(kAdded), generation_(0) {
+    }
+
+    DiscoveredPeerChange(Type type, uint64_t generation, const DiscoveredPeer& peer)
+        : type_(type), generation_(generation), peer_(peer) {
+    }
+
+    Type type() const {
+      return type_;
+    }
+
+    // Generation of the discovered peers table after this change.
+    uint64_t generation() const {
+      return generation_;
+    }
+
+    const DiscoveredPeer& peer() const {
+      return peer_;
+    }
+
+   private:
+    Type type_;
+    uint64_t generation_;
+    DiscoveredPeer peer_;
+  };
+
+  class DiscoveredPeersChanges {
+   public:
+    DiscoveredPeersChanges() : generation_(0), full_resync_(false) {
+    }
+
+    // Current generation of the discovered peers table. Should be passed to
+    // the next Peer::ListChangesSince call.
+    uint64_t generation() const {
+      return generation_;
+    }
+
+    void set_generation(uint64_t generation) {
+      generation_ = generation;
+    }
+
+    // If true the requested generation is too old, changes() is empty and
+    // peers() contains all discovered peers.
+    bool full_resync() const {
+      return full_resync_;
+    }
+
+    void set_full_resync(bool full_resync) {
+      full_resync_ = full_resync;
+    }
+
+    const std::list<DiscoveredPeer>& peers() const {
+      return peers_;
+    }
+
+    std::list<DiscoveredPeer>& mutable_peers() {
+      return peers_;
+    }
+
+    // Changes in the order they happened.
+    const std::list<DiscoveredPeerChange>& changes() const {
+      return changes_;
+    }
+
+    std::list<DiscoveredPeerChange>& mutable_changes() {
+      return changes_;
+    }
+
+   private:
+    uint64_t generation_;
+    bool full_resync_;
+    std::list<DiscoveredPeer> peers_;
+    std::list<DiscoveredPeerChange> changes_;
   };
 }
 
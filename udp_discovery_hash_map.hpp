@@ -0,0 +1,116 @@
+#ifndef __UDP_DISCOVERY_HASH_MAP_H_
+#define __UDP_DISCOVERY_HASH_MAP_H_
+
+#include <stddef.h>
+
+#include <utility>
+#include <vector>
+
+namespace udpdiscovery {
+namespace impl {
+// Minimal separate chaining hash map. The library is built as C++98 so
+// std::unordered_map is not available. Pointers returned by Find() and
+// Insert() are valid only until the next Insert() or Erase() call.
+template <typename KeyType, typename ValueType, typename HashType>
+class HashMap {
+ public:
+  HashMap() : size_(0) {}
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  ValueType* Find(const KeyType& key) {
+    if (buckets_.empty()) {
+      return 0;
+    }
+
+    Bucket& bucket = buckets_[bucketIndex(key)];
+    for (size_t i = 0; i < bucket.size(); ++i) {
+      if (bucket[i].first == key) {
+        return &bucket[i].second;
+      }
+    }
+    return 0;
+  }
+
+  const ValueType* Find(const KeyType& key) const {
+    return const_cast<HashMap*>(this)->Find(key);
+  }
+
+  // Inserts the value if there is no value with the given key. Returns the
+  // pointer to the stored value in both cases.
+  ValueType* Insert(const KeyType& key, const ValueType& value) {
+    ValueType* found = Find(key);
+    if (found) {
+      return found;
+    }
+
+    maybeGrow();
+
+    Bucket& bucket = buckets_[bucketIndex(key)];
+    bucket.push_back(std::make_pair(key, value));
+    ++size_;
+
+    return &bucket.back().second;
+  }
+
+  bool Erase(const KeyType& key) {
+    if (buckets_.empty()) {
+      return false;
+    }
+
+    Bucket& bucket = buckets_[bucketIndex(key)];
+    for (size_t i = 0; i < bucket.size(); ++i) {
+      if (bucket[i].first == key) {
+        if (i + 1 != bucket.size()) {
+          bucket[i] = bucket.back();
+        }
+        bucket.pop_back();
+        --size_;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Clear() {
+    buckets_.clear();
+    size_ = 0;
+  }
+
+ private:
+  typedef std::vector<std::pair<KeyType, ValueType> > Bucket;
+
+  size_t bucketIndex(const KeyType& key) const {
+    // Number of buckets is always a power of two.
+    return hash_(key) & (buckets_.size() - 1);
+  }
+
+  void maybeGrow() {
+    if (size_ < buckets_.size()) {
+      return;
+    }
+
+    size_t new_num_buckets = buckets_.empty() ? 16 : buckets_.size() * 2;
+
+    std::vector<Bucket> old_buckets(new_num_buckets);
+    old_buckets.swap(buckets_);
+
+    for (size_t i = 0; i < old_buckets.size(); ++i) {
+      for (size_t j = 0; j < old_buckets[i].size(); ++j) {
+        buckets_[bucketIndex(old_buckets[i][j].first)].push_back(
+            old_buckets[i][j]);
+      }
+    }
+  }
+
+ private:
+  HashType hash_;
+  std::vector<Bucket> buckets_;
+  size_t size_;
+};
+}  // namespace impl
+}  // namespace udpdiscovery
+
+#endif
@@ -3,9 +3,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
+#include <map>
 #include <vector>
 
+#include "udp_discovery_atomic.hpp"
+#include "udp_discovery_hash_map.hpp"
+#include "udp_discovery_peers_table.hpp"
 #include "udp_discovery_protocol.hpp"
 
 // sockets
@@ -17,7 +23,12 @@ typedef SOCKET SocketType;
 typedef int AddressLenType;
 const SocketType kInvalidSocket = INVALID_SOCKET;
 #else
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <net/if.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -26,6 +37,10 @@ typedef int SocketType;
 typedef socklen_t AddressLenType;
 const SocketType kInvalidSocket = -1;
 #endif
+#if defined(__linux__)
+#include <linux/filter.h>
+#include <sys/eventfd.h>
+#endif
 
 // time
 #if defined(__APPLE__)
@@ -65,6 +80,15 @@ static void SetSocketTimeout(SocketType sock, int param, int timeout_ms) {
 #endif
 }
 
+static void SetSocketNonBlocking(SocketType sock) {
+#if defined(_WIN32)
+  u_long non_blocking = 1;
+  ioctlsocket(sock, FIONBIO, &non_blocking);
+#else
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
 static void CloseSocket(SocketType sock) {
 #if defined(_WIN32)
   closesocket(sock);
@@ -73,6 +97,299 @@ static void CloseSocket(SocketType sock) {
 #endif
 }
 
+// Sends every packet to one address, send errors are ignored.
+// Returns the number of sent datagrams.
+static size_t SendTo(SocketType sock, const udpdiscovery::IpPort& destination,
+                     const std::vector<std::string>& packets) {
+  sockaddr_in addr;
+  memset((char*)&addr, 0, sizeof(sockaddr_in));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(destination.port());
+  addr.sin_addr.s_addr = htonl(destination.ip());
+
+  size_t num_sent = 0;
+  for (size_t i = 0; i < packets.size(); ++i) {
+    if (sendto(sock, packets[i].data(), (int)packets[i].size(), 0,
+               (struct sockaddr*)&addr, sizeof(sockaddr_in)) >= 0) {
+      ++num_sent;
+    }
+  }
+  return num_sent;
+}
+
+// Peers that discover receive announcements. Peers that are only discoverable
+// receive probes if probes or heartbeats, that are answered with probes, are
+// on.
+static bool ReceivesPackets(const udpdiscovery::PeerParameters& parameters) {
+  if (parameters.can_discover()) {
+    return true;
+  }
+  return parameters.can_be_discovered() &&
+         (parameters.send_probe_on_start() ||
+          parameters.full_announcement_interval_ms() > 0);
+}
+
+// Creates the socket that receives discovery packets on the port. Several
+// sockets can be bound to the same port.
+static SocketType OpenBindingSocket(int port) {
+  SocketType sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock == kInvalidSocket) {
+    std::cerr << "udpdiscovery::Peer can't create binding socket." << std::endl;
+    return kInvalidSocket;
+  }
+
+  {
+    int reuse_addr = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse_addr,
+               sizeof(reuse_addr));
+#ifdef SO_REUSEPORT
+    int reuse_port = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse_port,
+               sizeof(reuse_port));
+#endif
+  }
+
+  sockaddr_in addr;
+  memset((char*)&addr, 0, sizeof(sockaddr_in));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(sockaddr_in)) < 0) {
+    CloseSocket(sock);
+    std::cerr << "udpdiscovery::Peer can't bind socket." << std::endl;
+    return kInvalidSocket;
+  }
+
+#if defined(__linux__)
+  // Destination address and ingress interface of received datagrams, see
+  // ReceiveBatch::EnablePacketInfo().
+  int value = 1;
+  setsockopt(sock, IPPROTO_IP, IP_PKTINFO, (const char*)&value, sizeof(value));
+#endif
+
+  return sock;
+}
+
+#if defined(__linux__)
+// Appends a conditional jump that goes to the next instruction if the
+// accumulator matches and to the dropping instruction otherwise, or the
+// other way around. Offsets of the dropping instruction are resolved by
+// AttachPacketFilter().
+static void AddDropJump(std::vector<sock_filter>& program,
+                        std::vector<size_t>& drops, uint16_t code, uint32_t k,
+                        bool drop_if_true) {
+  sock_filter jump = BPF_JUMP(code, k, 0, 0);
+  drops.push_back(program.size() * 2 + (drop_if_true ? 0 : 1));
+  program.push_back(jump);
+}
+#endif
+
+// Makes the kernel drop datagrams on the binding socket that
+// PeerEnv::CheckPacket() would reject by the header: unknown magic,
+// unsupported protocol versions, other application ids and own packets.
+// Only the fixed offsets of the header are checked, the rest is validated by
+// Parse(). Returns false if the filter is not attached.
+static bool AttachPacketFilter(SocketType sock,
+                               const udpdiscovery::PeerParameters& parameters,
+                               uint32_t peer_id) {
+#if defined(__linux__)
+  using namespace udpdiscovery;
+
+  // The filter of a UDP socket sees the datagram from the UDP header.
+  const uint32_t kPayload = 8;
+  int min_version = parameters.min_supported_protocol_version();
+  int max_version = parameters.max_supported_protocol_version();
+
+  std::vector<sock_filter> program;
+  // Indices of jumps to the dropping instruction, times 2, plus 1 for the
+  // false branch.
+  std::vector<size_t> drops;
+
+  sock_filter load_magic =
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, kPayload + impl::kHeaderMagicOffset);
+  program.push_back(load_magic);
+  // Magic of version 1 and later skips the check of version 0 magic.
+  sock_filter is_magic_v1 =
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, impl::kMagicV1, 2, 0);
+  program.push_back(is_magic_v1);
+  AddDropJump(program, drops, BPF_JMP | BPF_JEQ | BPF_K, impl::kMagicV0,
+              /* drop_if_true= */ false);
+  if (min_version == kProtocolVersion0) {
+    // Goes over the check of the version byte.
+    sock_filter to_application_id = BPF_JUMP(BPF_JMP | BPF_JA, 3, 0, 0);
+    program.push_back(to_application_id);
+  } else {
+    sock_filter drop = BPF_STMT(BPF_RET | BPF_K, 0);
+    program.push_back(drop);
+  }
+
+  // The version byte of packets with the magic of version 1.
+  sock_filter load_version = BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+                                      kPayload + impl::kHeaderVersionOffset);
+  program.push_back(load_version);
+  AddDropJump(program, drops, BPF_JMP | BPF_JGE | BPF_K,
+              (uint32_t)std::max(min_version, (int)kProtocolVersion1),
+              /* drop_if_true= */ false);
+  AddDropJump(program, drops, BPF_JMP | BPF_JGT | BPF_K, (uint32_t)max_version,
+              /* drop_if_true= */ true);
+
+  sock_filter load_application_id = BPF_STMT(
+      BPF_LD | BPF_W | BPF_ABS, kPayload + impl::kHeaderApplicationIdOffset);
+  program.push_back(load_application_id);
+  AddDropJump(program, drops, BPF_JMP | BPF_JEQ | BPF_K,
+              parameters.application_id(), /* drop_if_true= */ false);
+
+  if (!parameters.discover_self()) {
+    sock_filter load_peer_id = BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                        kPayload + impl::kHeaderPeerIdOffset);
+    program.push_back(load_peer_id);
+    AddDropJump(program, drops, BPF_JMP | BPF_JEQ | BPF_K, peer_id,
+                /* drop_if_true= */ true);
+  }
+
+  // Loads beyond the end of a short datagram drop it before this point.
+  sock_filter accept = BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+  program.push_back(accept);
+  sock_filter drop = BPF_STMT(BPF_RET | BPF_K, 0);
+  program.push_back(drop);
+
+  size_t drop_index = program.size() - 1;
+  for (size_t i = 0; i < drops.size(); ++i) {
+    size_t jump_index = drops[i] / 2;
+    uint8_t offset = (uint8_t)(drop_index - jump_index - 1);
+    if (drops[i] % 2 == 0) {
+      program[jump_index].jt = offset;
+    } else {
+      program[jump_index].jf = offset;
+    }
+  }
+
+  sock_fprog fprog;
+  fprog.len = (unsigned short)program.size();
+  fprog.filter = &program[0];
+  if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) <
+      0) {
+    std::cerr << "udpdiscovery::Peer can't attach socket filter." << std::endl;
+    return false;
+  }
+  return true;
+#else
+  (void)sock;
+  (void)parameters;
+  (void)peer_id;
+  return false;
+#endif
+}
+
+struct NetworkInterface {
+  unsigned int index;
+  unsigned int address;
+  // 0 if the interface can't broadcast.
+  unsigned int broadcast_address;
+  bool can_multicast;
+};
+
+// Lists IPv4 interfaces that are up, except loopback. Returns an empty list on
+// Windows.
+static std::vector<NetworkInterface> ListNetworkInterfaces() {
+  std::vector<NetworkInterface> result;
+#if !defined(_WIN32)
+  struct ifaddrs* ifaddrs_list = 0;
+  if (getifaddrs(&ifaddrs_list) != 0) {
+    return result;
+  }
+
+  for (struct ifaddrs* it = ifaddrs_list; it; it = it->ifa_next) {
+    if (!it->ifa_addr || it->ifa_addr->sa_family != AF_INET) {
+      continue;
+    }
+    if (!(it->ifa_flags & IFF_UP) || (it->ifa_flags & IFF_LOOPBACK)) {
+      continue;
+    }
+
+    NetworkInterface network_interface;
+    network_interface.index = if_nametoindex(it->ifa_name);
+    network_interface.address =
+        ntohl(((struct sockaddr_in*)it->ifa_addr)->sin_addr.s_addr);
+    network_interface.broadcast_address = 0;
+    if ((it->ifa_flags & IFF_BROADCAST) && it->ifa_broadaddr) {
+      network_interface.broadcast_address = ntohl(
+          ((struct sockaddr_in*)it->ifa_broadaddr)->sin_addr.s_addr);
+    }
+    network_interface.can_multicast = (it->ifa_flags & IFF_MULTICAST) != 0;
+    result.push_back(network_interface);
+  }
+
+  freeifaddrs(ifaddrs_list);
+#endif
+  return result;
+}
+
+// Joining the group the socket is already a member of fails and is ignored.
+static void JoinMulticastGroup(SocketType sock, unsigned int group_address,
+                               unsigned int interface_address) {
+  struct ip_mreq mreq;
+  mreq.imr_multiaddr.s_addr = htonl(group_address);
+  mreq.imr_interface.s_addr = htonl(interface_address);
+  setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq,
+             sizeof(mreq));
+}
+
+// Joins the multicast group of the parameters on the interface chosen by the
+// routing table and, with PeerParameters::use_all_interfaces(), on each
+// interface.
+static void JoinMulticastGroup(
+    SocketType sock, const udpdiscovery::PeerParameters& parameters,
+    const std::vector<NetworkInterface>& interfaces) {
+  JoinMulticastGroup(sock, parameters.multicast_group_address(), INADDR_ANY);
+  if (parameters.use_all_interfaces()) {
+    for (size_t i = 0; i < interfaces.size(); ++i) {
+      if (interfaces[i].can_multicast) {
+        JoinMulticastGroup(sock, parameters.multicast_group_address(),
+                           interfaces[i].address);
+      }
+    }
+  }
+}
+
+#if defined(_WIN32)
+typedef WSAPOLLFD PollFd;
+#else
+typedef struct pollfd PollFd;
+#endif
+
+// Waits until one of the sockets is readable. Negative timeout_ms waits
+// forever.
+static int PollSockets(PollFd* fds, int num_fds, long timeout_ms) {
+  for (int i = 0; i < num_fds; ++i) {
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+#if defined(_WIN32)
+  return WSAPoll(fds, num_fds, (int)timeout_ms);
+#else
+  return poll(fds, num_fds, (int)timeout_ms);
+#endif
+}
+
+// Size of a receive buffer that fits the largest packet of the protocol
+// versions.
+static size_t ReceiveSlotSize(int min_version, int max_version) {
+  size_t slot_size = 0;
+  for (int version = min_version; version <= max_version; ++version) {
+    slot_size = std::max(
+        slot_size,
+        udpdiscovery::MaxPacketSize((udpdiscovery::ProtocolVersion)version));
+  }
+  return slot_size;
+}
+
+static size_t ReceiveSlotSize(const udpdiscovery::PeerParameters& parameters) {
+  return ReceiveSlotSize(parameters.min_supported_protocol_version(),
+                         parameters.max_supported_protocol_version());
+}
+
 static bool IsRightTime(long last_action_time, long now_time, long timeout,
                         long& time_to_wait_out) {
   if (last_action_time == 0) {
@@ -82,7 +399,12 @@ static bool IsRightTime(long last_action_time, long now_time, long timeout,
 
   long time_passed = now_time - last_action_time;
   if (time_passed >= timeout) {
+    // Catches up with the schedule, but after a stall longer than the
+    // timeout acts again right away instead of waiting a negative time.
     time_to_wait_out = timeout - (time_passed - timeout);
+    if (time_to_wait_out < 0) {
+      time_to_wait_out = 0;
+    }
     return true;
   }
 
@@ -90,9 +412,56 @@ static bool IsRightTime(long last_action_time, long now_time, long timeout,
   return false;
 }
 
+// Lowers to_sleep_ms (-1 means no deadline) to the wait for a deadline that
+// has passed already or is to_wait_ms away.
+static void WaitAtMost(long to_wait_ms, long& to_sleep_ms) {
+  if (to_wait_ms < 0) {
+    to_wait_ms = 0;
+  }
+  if (to_sleep_ms < 0 || to_wait_ms < to_sleep_ms) {
+    to_sleep_ms = to_wait_ms;
+  }
+}
+
+static uint32_t MixBits(uint32_t value) {
+  value ^= value >> 16;
+  value *= 0x85ebca6b;
+  value ^= value >> 13;
+  value *= 0xc2b2ae35;
+  value ^= value >> 16;
+  return value;
+}
+
+// xorshift32, state should not be 0.
+static uint32_t NextRandom(uint32_t& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+// Returns a random value in [0, bound].
+static long RandomUpTo(uint32_t& state, long bound) {
+  if (bound <= 0) {
+    return 0;
+  }
+  return (long)(NextRandom(state) % ((uint32_t)bound + 1));
+}
+
+// Peers started in one process within the same second get different ids.
 static uint32_t MakeRandomId() {
-  srand((unsigned int)time(0));
-  return (uint32_t)rand();
+  static volatile long num_ids = 0;
+
+#if defined(_WIN32)
+  uint32_t process_id = (uint32_t)GetCurrentProcessId();
+#else
+  uint32_t process_id = (uint32_t)getpid();
+#endif
+
+  uint32_t id = MixBits((uint32_t)time(0));
+  id = MixBits(id ^ process_id);
+  id = MixBits(id ^ (uint32_t)udpdiscovery::impl::AtomicIncrement(&num_ids));
+  return id;
 }
 
 namespace udpdiscovery {
@@ -129,6 +498,14 @@ void SleepFor(long time_ms) {
 #endif
 }
 
+static void ReleaseSnapshotData(DiscoveredPeersSnapshotData* data) {
+  if (data && AtomicDecrement(&data->ref_count) == 0) {
+    delete data;
+  }
+}
+
+class MinimalisticConditionVariable;
+
 class MinimalisticMutex {
  public:
   MinimalisticMutex() {
@@ -164,6 +541,8 @@ class MinimalisticMutex {
   }
 
  private:
+  friend class MinimalisticConditionVariable;
+
 #if defined(_WIN32)
   CRITICAL_SECTION critical_section_;
 #else
@@ -171,6 +550,73 @@ class MinimalisticMutex {
 #endif
 };
 
+class MinimalisticConditionVariable {
+ public:
+  MinimalisticConditionVariable() {
+#if defined(_WIN32)
+    InitializeConditionVariable(&condition_variable_);
+#else
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#if !defined(__APPLE__)
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&condition_variable_, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+  }
+
+  ~MinimalisticConditionVariable() {
+#if !defined(_WIN32)
+    pthread_cond_destroy(&condition_variable_);
+#endif
+  }
+
+  // The mutex should be locked. Returns with the mutex locked after
+  // NotifyAll(), after the timeout or spuriously.
+  void WaitFor(MinimalisticMutex& mutex, long timeout_ms) {
+    if (timeout_ms < 0) {
+      timeout_ms = 0;
+    }
+
+#if defined(_WIN32)
+    SleepConditionVariableCS(&condition_variable_, &mutex.critical_section_,
+                             (DWORD)timeout_ms);
+#elif defined(__APPLE__)
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+    pthread_cond_timedwait_relative_np(&condition_variable_, &mutex.mutex_,
+                                       &timeout);
+#else
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&condition_variable_, &mutex.mutex_, &deadline);
+#endif
+  }
+
+  void NotifyAll() {
+#if defined(_WIN32)
+    WakeAllConditionVariable(&condition_variable_);
+#else
+    pthread_cond_broadcast(&condition_variable_);
+#endif
+  }
+
+ private:
+#if defined(_WIN32)
+  CONDITION_VARIABLE condition_variable_;
+#else
+  pthread_cond_t condition_variable_;
+#endif
+};
+
 class MinimalisticThread : public MinimalisticThreadInterface {
  public:
 #if defined(_WIN32)
@@ -219,380 +665,2686 @@ class MinimalisticThread : public MinimalisticThreadInterface {
 #endif
 };
 
-class PeerEnv : public PeerEnvInterface {
+// Wakes up a thread blocked in PollSockets. Uses eventfd on Linux, a pipe on
+// other POSIX systems and a loopback UDP socket connected to itself on
+// Windows.
+class PollWakeup {
  public:
-  PeerEnv()
-      : binding_sock_(kInvalidSocket),
-        sock_(kInvalidSocket),
-        packet_index_(0),
-        ref_count_(0),
-        exit_(false) {}
+  PollWakeup() : read_fd_(kInvalidSocket), write_fd_(kInvalidSocket) {}
 
-  ~PeerEnv() {
-    if (binding_sock_ != kInvalidSocket) {
-      CloseSocket(binding_sock_);
+  ~PollWakeup() {
+    if (read_fd_ != kInvalidSocket) {
+      CloseSocket(read_fd_);
     }
-
-    if (sock_ != kInvalidSocket) {
-      CloseSocket(sock_);
+    if (write_fd_ != kInvalidSocket && write_fd_ != read_fd_) {
+      CloseSocket(write_fd_);
     }
   }
 
-  bool Start(const PeerParameters& parameters, const std::string& user_data) {
-    parameters_ = parameters;
-    user_data_ = user_data;
-
-    if (!parameters_.can_use_broadcast() && !parameters_.can_use_multicast()) {
-      std::cerr
-          << "udpdiscovery::Peer can't use broadcast and can't use multicast."
-          << std::endl;
+  bool Init() {
+#if defined(__linux__)
+    read_fd_ = eventfd(0, EFD_NONBLOCK);
+    write_fd_ = read_fd_;
+    return read_fd_ != kInvalidSocket;
+#elif defined(_WIN32)
+    read_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (read_fd_ == kInvalidSocket) {
       return false;
     }
+    write_fd_ = read_fd_;
 
-    if (!parameters_.can_discover() && !parameters_.can_be_discovered()) {
-      std::cerr << "udpdiscovery::Peer can't discover and can't be discovered."
-                << std::endl;
+    sockaddr_in addr;
+    memset((char*)&addr, 0, sizeof(sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    AddressLenType addr_length = sizeof(sockaddr_in);
+    if (bind(read_fd_, (struct sockaddr*)&addr, sizeof(sockaddr_in)) != 0 ||
+        getsockname(read_fd_, (struct sockaddr*)&addr, &addr_length) != 0 ||
+        connect(read_fd_, (struct sockaddr*)&addr, sizeof(sockaddr_in)) != 0) {
       return false;
     }
 
-    InitSockets();
-
-    peer_id_ = MakeRandomId();
-
-    sock_ = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock_ == kInvalidSocket) {
-      std::cerr << "udpdiscovery::Peer can't create socket." << std::endl;
+    SetSocketNonBlocking(read_fd_);
+    return true;
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
       return false;
     }
+    read_fd_ = fds[0];
+    write_fd_ = fds[1];
+    SetSocketNonBlocking(read_fd_);
+    SetSocketNonBlocking(write_fd_);
+    return true;
+#endif
+  }
 
-    {
-      int value = 1;
-      setsockopt(sock_, SOL_SOCKET, SO_BROADCAST, (const char*)&value,
-                 sizeof(value));
-    }
-
-    if (parameters_.can_discover()) {
-      binding_sock_ = socket(AF_INET, SOCK_DGRAM, 0);
-      if (binding_sock_ == kInvalidSocket) {
-        std::cerr << "udpdiscovery::Peer can't create binding socket."
-                  << std::endl;
+  SocketType fd() const { return read_fd_; }
 
-        CloseSocket(sock_);
-        sock_ = kInvalidSocket;
-      }
+  // Can be called from any thread.
+  void Signal() {
+#if defined(__linux__)
+    uint64_t value = 1;
+    if (write(write_fd_, &value, sizeof(value)) < 0) {
+      // The counter is already signaled.
+    }
+#elif defined(_WIN32)
+    char value = 0;
+    send(write_fd_, &value, 1, 0);
+#else
+    char value = 0;
+    if (write(write_fd_, &value, 1) < 0) {
+      // The pipe is full so it is already signaled.
+    }
+#endif
+  }
 
-      {
-        int reuse_addr = 1;
-        setsockopt(binding_sock_, SOL_SOCKET, SO_REUSEADDR,
-                   (const char*)&reuse_addr, sizeof(reuse_addr));
-#ifdef SO_REUSEPORT
-        int reuse_port = 1;
-        setsockopt(binding_sock_, SOL_SOCKET, SO_REUSEPORT,
-                   (const char*)&reuse_port, sizeof(reuse_port));
+  void Drain() {
+#if defined(__linux__)
+    uint64_t value;
+    if (read(read_fd_, &value, sizeof(value)) < 0) {
+      // Nothing to drain.
+    }
+#else
+    char buffer[64];
+    while (true) {
+#if defined(_WIN32)
+      int num_read = recv(read_fd_, buffer, sizeof(buffer), 0);
+#else
+      int num_read = (int)read(read_fd_, buffer, sizeof(buffer));
 #endif
+      if (num_read <= 0) {
+        break;
       }
+    }
+#endif
+  }
 
-      if (parameters_.can_use_multicast()) {
-        struct ip_mreq mreq;
-        mreq.imr_multiaddr.s_addr =
-            htonl(parameters_.multicast_group_address());
-        mreq.imr_interface.s_addr = INADDR_ANY;
-        setsockopt(binding_sock_, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-                   (const char*)&mreq, sizeof(mreq));
-      }
+ private:
+  SocketType read_fd_;
+  SocketType write_fd_;
+};
 
-      sockaddr_in addr;
-      memset((char*)&addr, 0, sizeof(sockaddr_in));
-      addr.sin_family = AF_INET;
-      addr.sin_port = htons(parameters_.port());
-      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+// Buffers for receiving up to size() datagrams with one call. On Linux all
+// datagrams are received with one recvmmsg syscall. On other platforms the
+// first datagram is received with a blocking recvfrom and the rest are read if
+// they are already available. All buffers are allocated once in one block and
+// reused for every receive, so no memory is allocated or cleared per datagram.
+class ReceiveBatch {
+ public:
+  // Datagrams longer than slot_size are truncated, Parse() rejects them.
+  ReceiveBatch(int size, size_t slot_size)
+      : slot_size_(slot_size),
+        storage_(size * slot_size),
+        lengths_(size),
+        addrs_(size),
+        from_(size),
+        unicast_(size, true),
+        interface_indexes_(size, 0) {
+#if defined(__linux__)
+    iovecs_.resize(size);
+    msgs_.resize(size);
+    for (int i = 0; i < size; ++i) {
+      iovecs_[i].iov_base = bufferStart(i);
+      iovecs_[i].iov_len = slot_size_;
+
+      memset(&msgs_[i], 0, sizeof(struct mmsghdr));
+      msgs_[i].msg_hdr.msg_name = &addrs_[i];
+      msgs_[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      msgs_[i].msg_hdr.msg_iov = &iovecs_[i];
+      msgs_[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+  }
 
-      if (bind(binding_sock_, (struct sockaddr*)&addr, sizeof(sockaddr_in)) <
-          0) {
-        CloseSocket(binding_sock_);
-        binding_sock_ = kInvalidSocket;
+  int size() const { return (int)lengths_.size(); }
 
-        CloseSocket(sock_);
-        sock_ = kInvalidSocket;
+  // Makes unicast() tell datagrams sent to the address of this host from
+  // broadcast and multicast ones and interface_index() report the ingress
+  // interface. The socket should have IP_PKTINFO set. Only on Linux,
+  // elsewhere all datagrams are reported as unicast from an unknown interface.
+  void EnablePacketInfo() {
+#if defined(__linux__)
+    control_.resize(size() * kControlSize);
+#endif
+  }
 
-        std::cerr << "udpdiscovery::Peer can't bind socket." << std::endl;
-        return false;
+  // Blocks until at least one datagram is received or the socket receive
+  // timeout expires. Doesn't block if wait is false. Returns the number of
+  // received datagrams.
+  int Receive(SocketType sock, bool wait) {
+    int num_received = 0;
+
+#if defined(__linux__)
+    for (int i = 0; i < size(); ++i) {
+      msgs_[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      if (!control_.empty()) {
+        msgs_[i].msg_hdr.msg_control = &control_[i * kControlSize];
+        msgs_[i].msg_hdr.msg_controllen = kControlSize;
       }
+    }
 
-      // TODO: Implement the way to unblock recvfrom without timeouting.
-      SetSocketTimeout(binding_sock_, SO_RCVTIMEO, 1000);
+    num_received = recvmmsg(sock, &msgs_[0], size(),
+                            wait ? MSG_WAITFORONE : MSG_DONTWAIT, 0);
+    if (num_received < 0) {
+      return 0;
     }
 
-    return true;
-  }
+    for (int i = 0; i < num_received; ++i) {
+      lengths_[i] = msgs_[i].msg_len;
+      if (!control_.empty()) {
+        readPacketInfo(msgs_[i].msg_hdr, i);
+      }
+    }
+#else
+    for (int i = 0; i < size(); ++i) {
+      int flags = 0;
+      if (i > 0 || !wait) {
+#if defined(MSG_DONTWAIT)
+        flags = MSG_DONTWAIT;
+#else
+        if (i > 0) {
+          break;
+        }
+#endif
+      }
 
-  void SetUserData(const std::string& user_data) {
-    lock_.Lock();
-    user_data_ = user_data;
-    lock_.Unlock();
-  }
+      AddressLenType addr_length = sizeof(sockaddr_in);
+      int length = (int)recvfrom(sock, bufferStart(i), (int)slot_size_,
+                                 flags, (struct sockaddr*)&addrs_[i],
+                                 &addr_length);
+      if (length < 0) {
+        break;
+      }
 
-  std::list<DiscoveredPeer> ListDiscovered() {
-    std::list<DiscoveredPeer> result;
+      lengths_[i] = length;
+      ++num_received;
+    }
+#endif
 
-    lock_.Lock();
-    result = discovered_peers_;
-    lock_.Unlock();
+    for (int i = 0; i < num_received; ++i) {
+      from_[i].set_port(ntohs(addrs_[i].sin_port));
+      from_[i].set_ip(ntohl(addrs_[i].sin_addr.s_addr));
+    }
 
-    return result;
+    return num_received;
   }
 
-  void Exit() {
-    lock_.Lock();
-    exit_ = true;
-    lock_.Unlock();
-  }
+  const char* data(int i) const { return &storage_[i * slot_size_]; }
 
-  void SendingThreadFunc() {
-    lock_.Lock();
-    ++ref_count_;
-    lock_.Unlock();
+  size_t length(int i) const { return lengths_[i]; }
 
-    long last_send_time_ms = 0;
-    long last_delete_idle_ms = 0;
+  const IpPort& from(int i) const { return from_[i]; }
 
-    while (true) {
-      lock_.Lock();
-      if (exit_) {
-        for (int protocol_version =
-                 parameters_.min_supported_protocol_version();
-             protocol_version <= parameters_.max_supported_protocol_version();
-             ++protocol_version) {
-          send(/* under_lock= */ true, (ProtocolVersion)protocol_version,
-               kPacketIAmOutOfHere);
-        }
+  bool unicast(int i) const { return unicast_[i]; }
 
-        decreaseRefCountAndMaybeDestroySelfAndUnlock();
+  unsigned int interface_index(int i) const { return interface_indexes_[i]; }
+
+ private:
+  char* bufferStart(int i) { return &storage_[i * slot_size_]; }
+
+#if defined(__linux__)
+  static const size_t kControlSize = CMSG_SPACE(sizeof(struct in_pktinfo));
+
+  // The local address the datagram is accepted on equals the destination
+  // address of the header only for unicast datagrams.
+  void readPacketInfo(const struct msghdr& msg, int i) {
+    unicast_[i] = true;
+    interface_indexes_[i] = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR((struct msghdr*)&msg, cmsg)) {
+      if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+        struct in_pktinfo pktinfo;
+        memcpy(&pktinfo, CMSG_DATA(cmsg), sizeof(pktinfo));
+        unicast_[i] = (pktinfo.ipi_addr.s_addr == pktinfo.ipi_spec_dst.s_addr);
+        interface_indexes_[i] = (unsigned int)pktinfo.ipi_ifindex;
         return;
       }
-      lock_.Unlock();
+    }
+  }
+#endif
+
+ private:
+  size_t slot_size_;
+  std::vector<char> storage_;
+  std::vector<size_t> lengths_;
+  std::vector<sockaddr_in> addrs_;
+  std::vector<IpPort> from_;
+  std::vector<bool> unicast_;
+  std::vector<unsigned int> interface_indexes_;
+#if defined(__linux__)
+  std::vector<struct iovec> iovecs_;
+  std::vector<struct mmsghdr> msgs_;
+  std::vector<char> control_;
+#endif
+};
+
+// Destinations of announcements with per destination counters. On Linux all
+// datagrams of one announcement (every protocol version to every destination)
+// are sent with one sendmmsg syscall.
+class SendBatch {
+ public:
+#if !defined(__linux__)
+  SendBatch() : last_multicast_interface_(0) {}
+#endif
+
+  void AddDestination(const IpPort& destination) {
+    AddDestination(destination, 0, 0);
+  }
+
+  // Packets to the destination leave through the interface with
+  // interface_index and interface_address, unless the index is 0, from the
+  // socket passed to Send() all the same. Used for multicast, receivers tell
+  // peers apart by the source address and port.
+  void AddDestination(const IpPort& destination, unsigned int interface_index,
+                      unsigned int interface_address) {
+    destinations_.push_back(destination);
+    interface_indexes_.push_back(interface_index);
+    interface_addresses_.push_back(interface_address);
+
+    sockaddr_in addr;
+    memset((char*)&addr, 0, sizeof(sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(destination.port());
+    addr.sin_addr.s_addr = htonl(destination.ip());
+    addrs_.push_back(addr);
+
+    counters_.push_back(Counters());
+
+#if defined(__linux__)
+    // IP_PKTINFO of sendmsg overrides IP_MULTICAST_IF of the socket for one
+    // datagram.
+    controls_.resize(destinations_.size() * kControlSize);
+    if (interface_index != 0) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = &controls_[(destinations_.size() - 1) * kControlSize];
+      msg.msg_controllen = kControlSize;
+
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = IPPROTO_IP;
+      cmsg->cmsg_type = IP_PKTINFO;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+
+      struct in_pktinfo pktinfo;
+      memset(&pktinfo, 0, sizeof(pktinfo));
+      pktinfo.ipi_ifindex = (int)interface_index;
+      pktinfo.ipi_spec_dst.s_addr = htonl(interface_address);
+      memcpy(CMSG_DATA(cmsg), &pktinfo, sizeof(pktinfo));
+    }
+#endif
+  }
+
+  // Sends every packet to every destination.
+  void Send(SocketType sock, const std::vector<std::string>& packets) {
+    if (!packets.empty()) {
+      Send(sock, &packets[0], packets.size());
+    }
+  }
+
+  void Send(SocketType sock, const std::string* packets, size_t num_packets) {
+    size_t num_datagrams = num_packets * destinations_.size();
+    if (num_datagrams == 0) {
+      return;
+    }
+
+#if defined(__linux__)
+    if (msgs_.size() < num_datagrams) {
+      msgs_.resize(num_datagrams);
+      iovecs_.resize(num_datagrams);
+    }
+
+    for (size_t j = 0; j < destinations_.size(); ++j) {
+      for (size_t i = 0; i < num_packets; ++i) {
+        size_t k = j * num_packets + i;
+
+        iovecs_[k].iov_base = (void*)packets[i].data();
+        iovecs_[k].iov_len = packets[i].size();
+
+        memset(&msgs_[k], 0, sizeof(struct mmsghdr));
+        msgs_[k].msg_hdr.msg_name = &addrs_[j];
+        msgs_[k].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        msgs_[k].msg_hdr.msg_iov = &iovecs_[k];
+        msgs_[k].msg_hdr.msg_iovlen = 1;
+        if (interface_indexes_[j] != 0) {
+          msgs_[k].msg_hdr.msg_control = &controls_[j * kControlSize];
+          msgs_[k].msg_hdr.msg_controllen = kControlSize;
+        }
+      }
+    }
+
+    sendAll(sock, num_datagrams, num_packets);
+#else
+    for (size_t j = 0; j < destinations_.size(); ++j) {
+      // The interface of multicast is an option of the socket here.
+      if (interface_indexes_[j] != 0 &&
+          interface_addresses_[j] != last_multicast_interface_) {
+        struct in_addr interface_addr;
+        interface_addr.s_addr = htonl(interface_addresses_[j]);
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF,
+                   (const char*)&interface_addr, sizeof(interface_addr));
+        last_multicast_interface_ = interface_addresses_[j];
+      }
+
+      for (size_t i = 0; i < num_packets; ++i) {
+        int result =
+            (int)sendto(sock, packets[i].data(), (int)packets[i].size(), 0,
+                        (struct sockaddr*)&addrs_[j], sizeof(sockaddr_in));
+        if (result < 0) {
+          countError(j);
+        } else {
+          countSent(j);
+        }
+      }
+    }
+#endif
+  }
+
+  // Sums the counters of all destinations. Can be called from any thread.
+  void SumStats(uint64_t& packets_sent, uint64_t& send_errors) const {
+    packets_sent = 0;
+    send_errors = 0;
+    for (size_t i = 0; i < destinations_.size(); ++i) {
+      packets_sent += AtomicLoad(&counters_[i].packets_sent);
+      send_errors += AtomicLoad(&counters_[i].send_errors);
+    }
+  }
+
+  // Can be called from any thread.
+  std::list<DestinationStats> ListStats() const {
+    std::list<DestinationStats> result;
+    for (size_t i = 0; i < destinations_.size(); ++i) {
+      DestinationStats stats;
+      stats.set_destination(destinations_[i]);
+      stats.set_interface_address(interface_addresses_[i]);
+      stats.set_packets_sent(AtomicLoad(&counters_[i].packets_sent));
+      stats.set_send_errors(AtomicLoad(&counters_[i].send_errors));
+      result.push_back(stats);
+    }
+    return result;
+  }
+
+ private:
+  struct Counters {
+    Counters() : packets_sent(0), send_errors(0) {}
+
+    volatile uint64_t packets_sent;
+    volatile uint64_t send_errors;
+  };
+
+#if defined(__linux__)
+  static const size_t kControlSize = CMSG_SPACE(sizeof(struct in_pktinfo));
+
+  // sendmmsg stops at the first failed datagram, skip it and continue.
+  void sendAll(SocketType sock, size_t end, size_t num_packets) {
+    size_t num_processed = 0;
+    while (num_processed < end) {
+      int num_sent = sendmmsg(sock, &msgs_[num_processed],
+                              (unsigned int)(end - num_processed), 0);
+      if (num_sent < 0) {
+        num_sent = 0;
+      }
+
+      for (int k = 0; k < num_sent; ++k) {
+        countSent((num_processed + k) / num_packets);
+      }
+      num_processed += num_sent;
+
+      if (num_processed < end) {
+        countError(num_processed / num_packets);
+        ++num_processed;
+      }
+    }
+  }
+#endif
+
+  void countSent(size_t destination_index) {
+    AtomicAdd(&counters_[destination_index].packets_sent, 1);
+  }
+
+  void countError(size_t destination_index) {
+    AtomicAdd(&counters_[destination_index].send_errors, 1);
+  }
+
+ private:
+  std::vector<IpPort> destinations_;
+  std::vector<unsigned int> interface_indexes_;
+  std::vector<unsigned int> interface_addresses_;
+  std::vector<sockaddr_in> addrs_;
+  mutable std::vector<Counters> counters_;
+#if defined(__linux__)
+  std::vector<struct iovec> iovecs_;
+  std::vector<struct mmsghdr> msgs_;
+  // kControlSize bytes of IP_PKTINFO per destination.
+  std::vector<char> controls_;
+#else
+  unsigned int last_multicast_interface_;
+#endif
+};
+
+class PeerEnv;
+
+class PollRequester {
+ public:
+  virtual ~PollRequester() {}
+
+  // Asks to call Poll() of the env as soon as possible. Can be called from
+  // any thread.
+  virtual void RequestPoll(PeerEnv* env) = 0;
+};
+
+// The packet points into the buffers of ReceiveBatch and is valid until the
+// next receive.
+struct ReceivedPacket {
+  IpPort from;
+  unsigned int interface_index;
+  PacketView packet;
+};
+
+class PeerEnv : public PeerEnvInterface {
+ public:
+  PeerEnv()
+      : binding_sock_(kInvalidSocket),
+        sock_(kInvalidSocket),
+        packet_index_(0),
+        packets_data_type_(kPacketTypeUnknown),
+        packets_data_user_data_generation_(-1),
+        heartbeats_data_user_data_generation_(-1),
+        tick_is_heartbeat_(false),
+        announced_user_data_generation_(-1),
+        last_full_send_time_ms_(0),
+        last_send_time_ms_(0),
+        last_user_data_send_time_ms_(0),
+        timers_user_data_generation_(0),
+        next_send_interval_ms_(-1),
+        next_version_to_send_(0),
+        next_version_send_time_ms_(0),
+        random_state_(1),
+        probe_sent_(false),
+        num_discovered_peers_(0),
+        ttl_ms_(0),
+        ttl_hold_until_ms_(0),
+        poll_requester_(0),
+        poll_batch_(0),
+        next_deadline_ms_(-1),
+        num_started_receive_workers_(0),
+        ref_count_(0),
+        exit_(false),
+        user_data_generation_(0),
+        snapshot_(new DiscoveredPeersSnapshotData()),
+        snapshot_readers_(0),
+        changes_log_(1),
+        has_observer_(false),
+        observer_(0) {}
+
+  ~PeerEnv() {
+    delete poll_batch_;
+
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      delete shards_[i];
+    }
+
+    ReleaseSnapshotData(snapshot_);
+    for (size_t i = 0; i < retired_snapshots_.size(); ++i) {
+      ReleaseSnapshotData(retired_snapshots_[i]);
+    }
+
+    if (binding_sock_ != kInvalidSocket) {
+      CloseSocket(binding_sock_);
+    }
+
+    for (size_t i = 0; i < worker_binding_socks_.size(); ++i) {
+      CloseSocket(worker_binding_socks_[i]);
+    }
+
+    if (sock_ != kInvalidSocket) {
+      CloseSocket(sock_);
+    }
+  }
+
+  int num_receive_workers() const { return (int)shards_.size(); }
+
+  // If open_binding_socket is false the env doesn't receive by itself, the
+  // packets are passed to ProcessReceivedPackets() by the owner of the
+  // binding socket.
+  bool Start(const PeerParameters& parameters, const std::string& user_data,
+             PeerObserver* observer, bool open_binding_socket) {
+    parameters_ = parameters;
+    user_data_ = user_data;
+    changes_log_ = DiscoveredPeersChangeLog(parameters_.changes_log_size());
+    has_observer_ = (observer != 0);
+    observer_ = observer;
+
+    // Other engines receive in one thread.
+    int num_shards = 1;
+    if (parameters_.engine_mode() == PeerParameters::kEngineThreads &&
+        parameters_.can_discover()) {
+      num_shards = parameters_.num_receive_workers();
+    }
+    for (int i = 0; i < num_shards; ++i) {
+      shards_.push_back(new Shard(parameters_.same_peer_mode()));
+    }
+
+    if (!parameters_.can_use_broadcast() && !parameters_.can_use_multicast() &&
+        parameters_.unicast_targets().empty()) {
+      std::cerr << "udpdiscovery::Peer can't use broadcast, can't use "
+                   "multicast and has no unicast targets."
+                << std::endl;
+      return false;
+    }
+
+    if (!parameters_.can_discover() && !parameters_.can_be_discovered()) {
+      std::cerr << "udpdiscovery::Peer can't discover and can't be discovered."
+                << std::endl;
+      return false;
+    }
+
+    InitSockets();
+
+    peer_id_ = MakeRandomId();
+    random_state_ = MixBits(peer_id_ ^ (uint32_t)NowTime()) | 1;
+
+    sock_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_ == kInvalidSocket) {
+      std::cerr << "udpdiscovery::Peer can't create socket." << std::endl;
+      return false;
+    }
+
+    {
+      int value = 1;
+      setsockopt(sock_, SOL_SOCKET, SO_BROADCAST, (const char*)&value,
+                 sizeof(value));
+    }
+
+    std::vector<NetworkInterface> interfaces;
+    if (parameters_.use_all_interfaces()) {
+      interfaces = ListNetworkInterfaces();
+    }
+
+    if (parameters_.can_use_broadcast()) {
+      addBroadcastDestinations(interfaces);
+    }
+
+    if (parameters_.can_use_multicast()) {
+      addMulticastDestinations(interfaces);
+    }
+
+    for (size_t i = 0; i < parameters_.unicast_targets().size(); ++i) {
+      IpPort target = parameters_.unicast_targets()[i];
+      if (target.port() == 0) {
+        target.set_port(parameters_.port());
+      }
+      send_batch_.AddDestination(target);
+    }
+
+    if (ReceivesPackets(parameters_) && open_binding_socket) {
+      binding_sock_ = OpenBindingSocket(parameters_.port());
+      if (binding_sock_ == kInvalidSocket) {
+        CloseSocket(sock_);
+        sock_ = kInvalidSocket;
+        return false;
+      }
+
+      if (parameters_.can_use_multicast()) {
+        JoinMulticastGroup(binding_sock_, parameters_, interfaces);
+      }
+      if (parameters_.use_socket_filter()) {
+        AttachPacketFilter(binding_sock_, parameters_, peer_id_);
+      }
+
+      for (int i = 1; i < num_receive_workers(); ++i) {
+        SocketType sock = OpenBindingSocket(parameters_.port());
+        if (sock == kInvalidSocket) {
+          return false;
+        }
+        if (parameters_.can_use_multicast()) {
+          JoinMulticastGroup(sock, parameters_, interfaces);
+        }
+        if (parameters_.use_socket_filter()) {
+          AttachPacketFilter(sock, parameters_, peer_id_);
+        }
+        worker_binding_socks_.push_back(sock);
+      }
+
+      if (parameters_.engine_mode() == PeerParameters::kEngineThreads) {
+        // The receiving thread checks for exit once a second. The event loop
+        // engine is woken up by Exit() instead.
+        for (int i = 0; i < num_receive_workers(); ++i) {
+          SetSocketTimeout(workerBindingSocket(i), SO_RCVTIMEO, 1000);
+        }
+      }
+    }
+
+    if (parameters_.engine_mode() == PeerParameters::kEngineEventLoop) {
+      if (!wakeup_.Init()) {
+        std::cerr << "udpdiscovery::Peer can't create wakeup." << std::endl;
+        return false;
+      }
+    }
+
+    if (parameters_.engine_mode() == PeerParameters::kEngineExternal) {
+      // Poll() never blocks.
+      SetSocketNonBlocking(sock_);
+      if (binding_sock_ != kInvalidSocket) {
+        SetSocketNonBlocking(binding_sock_);
+      }
+      next_deadline_ms_ = NowTime();
+    }
+
+    return true;
+  }
+
+  void SetUserData(const std::string& user_data) {
+    lock_.Lock();
+    user_data_ = user_data;
+    AtomicIncrement(&user_data_generation_);
+    // Announces the change without waiting for the next send_timeout_ms.
+    sending_thread_wakeup_.NotifyAll();
+    if (parameters_.engine_mode() == PeerParameters::kEngineEventLoop) {
+      wakeup_.Signal();
+    }
+    lock_.Unlock();
+
+    if (poll_requester_) {
+      poll_requester_->RequestPoll(this);
+    }
+  }
+
+  std::list<DiscoveredPeer> ListDiscovered() {
+    std::list<DiscoveredPeer> result;
+    listShards(&result);
+    return result;
+  }
+
+  DiscoveredPeersSnapshot Snapshot() {
+    // While snapshot_readers_ is not zero the writer doesn't release retired
+    // snapshots, so the loaded snapshot can't be deleted before its reference
+    // count is incremented.
+    AtomicIncrement(&snapshot_readers_);
+    DiscoveredPeersSnapshotData* data = AtomicLoadPointer(&snapshot_);
+    AtomicIncrement(&data->ref_count);
+    AtomicDecrement(&snapshot_readers_);
+
+    return DiscoveredPeersSnapshot(data);
+  }
+
+  DiscoveredPeersChanges ListChangesSince(uint64_t generation) {
+    DiscoveredPeersChanges result;
+
+    changes_lock_.Lock();
+    result.set_generation(changes_log_.generation());
+    if (!changes_log_.ListChangesSince(generation,
+                                       &result.mutable_changes())) {
+      result.mutable_changes().clear();
+      result.set_full_resync(true);
+      listShards(&result.mutable_peers());
+    }
+    changes_lock_.Unlock();
+
+    return result;
+  }
+
+  std::list<DestinationStats> ListDestinationStats() {
+    return send_batch_.ListStats();
+  }
+
+  PeerStats GetStats() {
+    PeerStats stats;
+    stats.set_datagrams_received(AtomicLoad(&stats_.datagrams_received));
+    stats.set_parse_errors(AtomicLoad(&stats_.parse_errors));
+    stats.set_unsupported_version(AtomicLoad(&stats_.unsupported_version));
+    stats.set_other_application_id(AtomicLoad(&stats_.other_application_id));
+    stats.set_own_packets(AtomicLoad(&stats_.own_packets));
+
+    uint64_t packets_sent;
+    uint64_t send_errors;
+    send_batch_.SumStats(packets_sent, send_errors);
+    stats.set_packets_sent(packets_sent + AtomicLoad(&stats_.unicast_sent));
+    stats.set_send_errors(send_errors);
+
+    // Removals are loaded before additions, so the gauge never goes below 0.
+    uint64_t peers_left = AtomicLoad(&stats_.peers_left);
+    uint64_t peers_expired = AtomicLoad(&stats_.peers_expired);
+    uint64_t peers_added = AtomicLoad(&stats_.peers_added);
+    stats.set_peers_added(peers_added);
+    stats.set_peers_updated(AtomicLoad(&stats_.peers_updated));
+    stats.set_peers_left(peers_left);
+    stats.set_peers_expired(peers_expired);
+    stats.set_num_discovered_peers(peers_added - peers_left - peers_expired);
+    stats.set_user_data_bytes(AtomicLoad(&stats_.user_data_bytes));
+    stats.set_dropped_events(AtomicLoad(&stats_.dropped_events));
+    return stats;
+  }
+
+  bool FindDiscovered(const IpPort& ip_port,
+                      DiscoveredPeer& discovered_peer_out) {
+    bool found = false;
+
+    Shard& shard = *shards_[shardIndex(ip_port)];
+    shard.lock.Lock();
+    DiscoveredPeersTable::Iterator it = shard.table.Find(ip_port);
+    if (it != shard.table.end()) {
+      discovered_peer_out = *it;
+      found = true;
+    }
+    shard.lock.Unlock();
+
+    return found;
+  }
+
+  void Exit() {
+    lock_.Lock();
+    // Threads that see exit_ may release the last of their references while
+    // Exit() is still running, this one keeps the env alive until the end.
+    ++ref_count_;
+    exit_ = true;
+    sending_thread_wakeup_.NotifyAll();
+    events_wakeup_.NotifyAll();
+    if (parameters_.engine_mode() == PeerParameters::kEngineEventLoop) {
+      wakeup_.Signal();
+    }
+    lock_.Unlock();
+
+    // Waits for the callback that is being called right now.
+    observer_lock_.Lock();
+    observer_ = 0;
+    observer_lock_.Unlock();
+
+    if (parameters_.engine_mode() == PeerParameters::kEngineExternal &&
+        !poll_requester_) {
+      // There are no threads, the reference of the user is released here.
+      ReleaseExternal();
+    }
+
+    lock_.Lock();
+    decreaseRefCountAndMaybeDestroySelfAndUnlock();
+  }
+
+  // Sends kPacketIAmOutOfHere and releases the reference that is taken
+  // instead of threads with kEngineExternal. Should be called after Exit().
+  void ReleaseExternal() {
+    lock_.Lock();
+    send(/* under_lock= */ true, kPacketIAmOutOfHere);
+    decreaseRefCountAndMaybeDestroySelfAndUnlock();
+  }
+
+  // With kEngineExternal the env is polled by PeerReactor that should be
+  // asked to poll when user data changes. Should be called before the env is
+  // used by other threads.
+  void SetPollRequester(PollRequester* poll_requester) {
+    poll_requester_ = poll_requester;
+  }
+
+  bool ReceiveSocket(NativeSocket& socket_out) {
+    if (binding_sock_ == kInvalidSocket) {
+      return false;
+    }
+    socket_out = (NativeSocket)binding_sock_;
+    return true;
+  }
+
+  long NextDeadline() { return next_deadline_ms_; }
+
+  uint32_t application_id() const { return parameters_.application_id(); }
+
+  // Outcomes of checking a received datagram, indices of the counters passed
+  // to CountVerdicts().
+  enum PacketVerdict {
+    kVerdictAccepted,
+    kVerdictParseError,
+    kVerdictUnsupportedVersion,
+    kVerdictOtherApplicationId,
+    kVerdictOwnPacket,
+    kNumPacketVerdicts
+  };
+
+  // Returns kVerdictAccepted if the parsed packet should be processed by this
+  // peer. Doesn't need lock_.
+  PacketVerdict CheckPacket(ProtocolVersion packet_version,
+                            const PacketView& packet) {
+    return checkPacket(packet_version, packet);
+  }
+
+  // Adds the verdicts of datagrams received by the owner of the shared
+  // binding socket to the stats, kNumPacketVerdicts counters.
+  void CountVerdicts(const uint64_t* verdicts) { countVerdicts(verdicts); }
+
+  // Applies packets received by the owner of the shared binding socket.
+  void ProcessReceivedPackets(long cur_time_ms,
+                              const std::vector<ReceivedPacket>& packets,
+                              size_t num_packets) {
+    processReceivedPackets(cur_time_ms, packets, num_packets);
+  }
+
+  // Does the work of the sending and the receiving threads without blocking.
+  // Used with kEngineExternal only.
+  void Poll(long now) {
+    // Envs of other engines and of the reactor are polled by their threads.
+    if (parameters_.engine_mode() != PeerParameters::kEngineExternal ||
+        poll_requester_) {
+      return;
+    }
+
+    if (binding_sock_ != kInvalidSocket && !poll_batch_) {
+      poll_batch_ = new ReceiveBatch(parameters_.receive_batch_size(),
+                                     ReceiveSlotSize(parameters_));
+      poll_batch_->EnablePacketInfo();
+      poll_packets_.resize(poll_batch_->size());
+    }
+
+    Poll(now, poll_batch_, poll_packets_);
+  }
+
+  // Same as Poll(now) but with receive buffers that are shared by all envs
+  // polled by one thread. Receives at most kMaxPollBatches batches, if
+  // datagrams are left the next deadline is now.
+  void Poll(long now, ReceiveBatch* batch,
+            std::vector<ReceivedPacket>& packets) {
+    bool has_more = false;
+    if (binding_sock_ != kInvalidSocket) {
+      for (int i = 0; i < kMaxPollBatches; ++i) {
+        int num_received = batch->Receive(binding_sock_, /* wait= */ false);
+        processReceivedBatch(now, *batch, num_received, packets,
+                             /* worker_index= */ -1);
+        has_more = (num_received == batch->size());
+        if (!has_more) {
+          break;
+        }
+      }
+    }
+
+    long to_sleep_ms = processTimers(now);
+    if (has_more) {
+      to_sleep_ms = 0;
+    }
+    next_deadline_ms_ = (to_sleep_ms < 0) ? -1 : now + to_sleep_ms;
+  }
+
+  // Should be called before starting a thread that uses this object. Each
+  // thread releases its reference when it exits.
+  void IncreaseRefCount() {
+    lock_.Lock();
+    ++ref_count_;
+    lock_.Unlock();
+  }
+
+  void SendingThreadFunc() {
+    while (true) {
+      lock_.Lock();
+      if (exit_) {
+        send(/* under_lock= */ true, kPacketIAmOutOfHere);
+
+        decreaseRefCountAndMaybeDestroySelfAndUnlock();
+        return;
+      }
+      lock_.Unlock();
+
+      long to_sleep_ms = processTimers(NowTime());
+
+      // Exit(), SetUserData(), received probes and stale heartbeats wake the
+      // thread up before the deadline. Those that happen during
+      // processTimers() are not waited for.
+      lock_.Lock();
+      if (!exit_ && user_data_generation_ == timers_user_data_generation_ &&
+          probe_requests_.empty() && full_announcement_requests_.empty()) {
+        sending_thread_wakeup_.WaitFor(lock_, to_sleep_ms);
+      }
+      lock_.Unlock();
+    }
+  }
+
+  void DispatchingThreadFunc() {
+    lock_.Lock();
+
+    while (true) {
+      if (exit_) {
+        decreaseRefCountAndMaybeDestroySelfAndUnlock();
+        return;
+      }
+
+      if (events_.empty()) {
+        events_wakeup_.WaitFor(lock_, 1000);
+        continue;
+      }
+
+      std::vector<DiscoveredPeerChange> events(events_.begin(), events_.end());
+      events_.clear();
+      lock_.Unlock();
+
+      callObserver(events);
+
+      lock_.Lock();
+    }
+  }
+
+  // Every receive worker runs this function with its own socket.
+  void ReceivingThreadFunc() {
+    int worker_index = (int)AtomicIncrement(&num_started_receive_workers_) - 1;
+    SocketType sock = workerBindingSocket(worker_index);
+
+    // Everything is allocated before the loop. Received packets are parsed in
+    // place and user data is copied only when it is stored.
+    ReceiveBatch batch(parameters_.receive_batch_size(),
+                       ReceiveSlotSize(parameters_));
+    std::vector<ReceivedPacket> packets(batch.size());
+    batch.EnablePacketInfo();
+    if (num_receive_workers() == 1) {
+      worker_index = -1;
+    }
+
+    while (true) {
+      int num_received = batch.Receive(sock, /* wait= */ true);
+
+      lock_.Lock();
+      if (exit_) {
+        decreaseRefCountAndMaybeDestroySelfAndUnlock();
+        return;
+      }
+      lock_.Unlock();
+
+      processReceivedBatch(NowTime(), batch, num_received, packets,
+                           worker_index);
+    }
+  }
+
+  // Does the work of the sending and the receiving threads in one thread.
+  // Waits for datagrams, the next timer and Exit() in one poll call.
+  void EventLoopThreadFunc() {
+    ReceiveBatch batch(
+        binding_sock_ != kInvalidSocket ? parameters_.receive_batch_size() : 0,
+        ReceiveSlotSize(parameters_));
+    batch.EnablePacketInfo();
+    std::vector<ReceivedPacket> packets(batch.size());
+
+    PollFd fds[2];
+    int num_fds = 0;
+    fds[num_fds++].fd = wakeup_.fd();
+    if (binding_sock_ != kInvalidSocket) {
+      fds[num_fds++].fd = binding_sock_;
+    }
+
+    while (true) {
+      lock_.Lock();
+      if (exit_) {
+        send(/* under_lock= */ true, kPacketIAmOutOfHere);
+
+        decreaseRefCountAndMaybeDestroySelfAndUnlock();
+        return;
+      }
+      lock_.Unlock();
+
+      long to_sleep_ms = processTimers(NowTime());
+
+      if (PollSockets(fds, num_fds, to_sleep_ms) <= 0) {
+        continue;
+      }
+
+      if (fds[0].revents != 0) {
+        wakeup_.Drain();
+      }
+
+      if (num_fds > 1 && fds[1].revents != 0) {
+        int num_received = batch.Receive(binding_sock_, /* wait= */ false);
+        processReceivedBatch(NowTime(), batch, num_received, packets,
+                             /* worker_index= */ -1);
+      }
+    }
+  }
+
+ private:
+  PacketVerdict checkPacket(ProtocolVersion packet_version,
+                            const PacketView& packet) {
+    if (packet_version == kProtocolVersionUnknown) {
+      return kVerdictParseError;
+    }
+
+    if (packet_version < parameters_.min_supported_protocol_version() ||
+        packet_version > parameters_.max_supported_protocol_version()) {
+      return kVerdictUnsupportedVersion;
+    }
+
+    if (parameters_.application_id() != packet.application_id()) {
+      return kVerdictOtherApplicationId;
+    }
+
+    if (!parameters_.discover_self()) {
+      if (packet.peer_id() == peer_id_) {
+        return kVerdictOwnPacket;
+      }
+    }
+
+    return kVerdictAccepted;
+  }
+
+  void decreaseRefCountAndMaybeDestroySelfAndUnlock() {
+    --ref_count_;
+    int cur_ref_count = ref_count_;
+
+    // This method is performed when the mutex is locked.
+    lock_.Unlock();
+
+    if (cur_ref_count <= 0) {
+      if (cur_ref_count < 0) {
+        // Shouldn't be there.
+        std::cerr << "Strangly ref count is less than 0." << std::endl;
+      }
+
+      delete this;
+    }
+  }
+
+  // Sends announcements and removes expired peers when it is time. Returns
+  // the time until the next of these actions or -1 if there are none. Used
+  // only by one thread.
+  long processTimers(long cur_time_ms) {
+    long to_sleep_ms = -1;
+
+    timers_user_data_generation_ = AtomicLoad(&user_data_generation_);
+
+    if (!probe_sent_) {
+      probe_sent_ = true;
+      if (parameters_.can_discover() && parameters_.send_probe_on_start()) {
+        send_batch_.Send(sock_, probesData());
+      }
+    }
+
+    if (parameters_.can_discover()) {
+      requestFullAnnouncements(cur_time_ms);
+    }
+
+    if (parameters_.can_be_discovered()) {
+      long to_wait_ms = sendProbeResponses(cur_time_ms);
+      if (to_wait_ms >= 0 && (to_sleep_ms < 0 || to_wait_ms < to_sleep_ms)) {
+        to_sleep_ms = to_wait_ms;
+      }
+    }
+
+    if (parameters_.can_be_discovered()) {
+      bool jitter = parameters_.send_jitter_percent() > 0;
+      long send_interval_ms = sendIntervalMs();
+      if (jitter) {
+        if (next_send_interval_ms_ < 0) {
+          next_send_interval_ms_ = jitteredInterval(send_interval_ms);
+        }
+        send_interval_ms = next_send_interval_ms_;
+      }
+
+      // Not to_sleep_ms, it already holds the wait for answers to probes.
+      long to_send_ms;
+      if (IsRightTime(last_send_time_ms_, cur_time_ms, send_interval_ms,
+                      to_send_ms)) {
+        prepareTick(cur_time_ms);
+        if (jitter) {
+          sendFirstVersion(cur_time_ms);
+          // Not aligned to the previous ticks, peers drift apart.
+          next_send_interval_ms_ = jitteredInterval(sendIntervalMs());
+          to_send_ms = next_send_interval_ms_;
+        } else {
+          send_batch_.Send(sock_, tickPackets());
+          next_version_to_send_ = tickPackets().size();
+        }
+        last_send_time_ms_ = cur_time_ms;
+      }
+      WaitAtMost(to_send_ms, to_sleep_ms);
+
+      if (next_version_to_send_ < tickPackets().size()) {
+        long to_wait_ms = sendNextVersions(cur_time_ms);
+        if (to_wait_ms >= 0 && to_wait_ms < to_sleep_ms) {
+          to_sleep_ms = to_wait_ms;
+        }
+      }
+
+      if (timers_user_data_generation_ != announced_user_data_generation_) {
+        long interval_ms = parameters_.user_data_send_interval_ms();
+        long time_passed = cur_time_ms - last_user_data_send_time_ms_;
+        if (last_user_data_send_time_ms_ == 0 || time_passed >= interval_ms) {
+          send(/* under_lock= */ false, kPacketIAmHere);
+          markAnnounced(cur_time_ms);
+          last_user_data_send_time_ms_ = cur_time_ms;
+        } else {
+          WaitAtMost(interval_ms - time_passed, to_sleep_ms);
+        }
+      }
+    }
+
+    if (parameters_.can_discover()) {
+      WaitAtMost(deleteIdle(cur_time_ms), to_sleep_ms);
+    }
+
+    return to_sleep_ms;
+  }
+
+  // Parses received datagrams without locks and applies them. Broadcast and
+  // multicast datagrams are received by every receive worker, the worker with
+  // worker_index applies only those of its own shard. -1 applies all.
+  void processReceivedBatch(long cur_time_ms, const ReceiveBatch& batch,
+                            int num_received,
+                            std::vector<ReceivedPacket>& packets,
+                            int worker_index) {
+    size_t num_packets = 0;
+    // Counted per batch to add to stats_ once.
+    uint64_t verdicts[kNumPacketVerdicts] = {0};
+    for (int i = 0; i < num_received; ++i) {
+      if (worker_index >= 0 && !batch.unicast(i) &&
+          shardIndex(batch.from(i)) != (size_t)worker_index) {
+        continue;
+      }
+
+      PacketVerdict verdict = parseReceivedBuffer(
+          batch.data(i), batch.length(i), &packets[num_packets].packet);
+      ++verdicts[verdict];
+      if (verdict == kVerdictAccepted) {
+        packets[num_packets].from = batch.from(i);
+        packets[num_packets].interface_index = batch.interface_index(i);
+        ++num_packets;
+      }
+    }
+    countVerdicts(verdicts);
+
+    if (num_packets > 0) {
+      processReceivedPackets(cur_time_ms, packets, num_packets);
+    }
+  }
+
+  // Returns kVerdictAccepted if the packet should be processed by this peer.
+  // Doesn't need lock_.
+  PacketVerdict parseReceivedBuffer(const char* buffer, size_t size,
+                                    PacketView* packet) {
+    ProtocolVersion packet_version = packet->Parse(buffer, size);
+    return checkPacket(packet_version, *packet);
+  }
+
+  void countVerdicts(const uint64_t* verdicts) {
+    uint64_t num_received = 0;
+    for (int i = 0; i < kNumPacketVerdicts; ++i) {
+      num_received += verdicts[i];
+    }
+    if (num_received == 0) {
+      return;
+    }
+    AtomicAdd(&stats_.datagrams_received, num_received);
+
+    // Rejections are rare, skip the atomic adds of zeros.
+    if (verdicts[kVerdictParseError]) {
+      AtomicAdd(&stats_.parse_errors, verdicts[kVerdictParseError]);
+    }
+    if (verdicts[kVerdictUnsupportedVersion]) {
+      AtomicAdd(&stats_.unsupported_version,
+                verdicts[kVerdictUnsupportedVersion]);
+    }
+    if (verdicts[kVerdictOtherApplicationId]) {
+      AtomicAdd(&stats_.other_application_id,
+                verdicts[kVerdictOtherApplicationId]);
+    }
+    if (verdicts[kVerdictOwnPacket]) {
+      AtomicAdd(&stats_.own_packets, verdicts[kVerdictOwnPacket]);
+    }
+  }
+
+  // Refreshes of known peers take only the locks of their shards, a lock is
+  // held while consecutive packets belong to the same shard. Packets that
+  // change discovered peers are applied again under changes_lock_, so the
+  // changes log and the snapshot always match the tables.
+  void processReceivedPackets(long cur_time_ms,
+                              const std::vector<ReceivedPacket>& packets,
+                              size_t num_packets) {
+    std::vector<size_t> changing;
+    std::vector<IpPort> probes;
+    std::vector<IpPort> stale;
+
+    Shard* locked_shard = 0;
+    for (size_t i = 0; i < num_packets; ++i) {
+      if (packets[i].packet.packet_type() == kPacketProbe) {
+        probes.push_back(packets[i].from);
+        continue;
+      }
+      if (!parameters_.can_discover()) {
+        // Only probes are received to be answered.
+        continue;
+      }
+
+      Shard* shard = shards_[shardIndex(packets[i].from)];
+      if (shard != locked_shard) {
+        if (locked_shard) {
+          locked_shard->lock.Unlock();
+        }
+        shard->lock.Lock();
+        locked_shard = shard;
+      }
+
+      if (packets[i].packet.packet_type() == kPacketHeartbeat) {
+        if (!refreshFromHeartbeat(shard->table, cur_time_ms, packets[i])) {
+          stale.push_back(packets[i].from);
+        }
+      } else if (!refreshPeer(shard->table, cur_time_ms, packets[i])) {
+        changing.push_back(i);
+      }
+    }
+    if (locked_shard) {
+      locked_shard->lock.Unlock();
+    }
+
+    if (!probes.empty()) {
+      requestProbeResponses(probes);
+    }
+
+    if (!stale.empty()) {
+      addFullAnnouncementRequests(stale);
+    }
+
+    if (changing.empty()) {
+      return;
+    }
+
+    std::vector<DiscoveredPeerChange> events;
+
+    changes_lock_.Lock();
+
+    uint64_t generation = changes_log_.generation();
+
+    for (size_t i = 0; i < changing.size(); ++i) {
+      const ReceivedPacket& received = packets[changing[i]];
+      Shard& shard = *shards_[shardIndex(received.from)];
+      shard.lock.Lock();
+      processReceivedPacket(shard.table, cur_time_ms, received, &events);
+      shard.lock.Unlock();
+    }
+
+    if (changes_log_.generation() != generation) {
+      publishSnapshot();
+    }
+
+    changes_lock_.Unlock();
+
+    dispatchEvents(events);
+  }
+
+  // Applies the packet if it doesn't change discovered peers and returns
+  // true. Should be called under the lock of the shard of the table.
+  bool refreshPeer(DiscoveredPeersTable& table, long cur_time_ms,
+                   const ReceivedPacket& received) {
+    const PacketView& packet = received.packet;
+    DiscoveredPeersTable::Iterator find_it = table.Find(received.from);
+
+    if (packet.packet_type() == kPacketIAmHere) {
+      if (find_it == table.end()) {
+        return false;
+      }
+
+      if ((*find_it).last_received_packet() < packet.snapshot_index()) {
+        if (!packet.UserDataEquals((*find_it).user_data())) {
+          return false;
+        }
+        (*find_it).set_last_received_packet(packet.snapshot_index());
+      }
+      (*find_it).set_interface_index(received.interface_index);
+      table.Touch(find_it, cur_time_ms);
+      return true;
+    }
+
+    if (packet.packet_type() == kPacketIAmOutOfHere) {
+      return find_it == table.end();
+    }
+
+    return true;
+  }
+
+  // Refreshes a known peer. Returns false if the peer is unknown or the
+  // heartbeat is tagged with user data other than the peer has. Should be
+  // called under the lock of the shard of the table.
+  bool refreshFromHeartbeat(DiscoveredPeersTable& table, long cur_time_ms,
+                            const ReceivedPacket& received) {
+    const PacketView& packet = received.packet;
+    DiscoveredPeersTable::Iterator find_it = table.Find(received.from);
+    if (find_it == table.end()) {
+      return false;
+    }
+
+    // The peer is alive even if its user data is stale.
+    (*find_it).set_interface_index(received.interface_index);
+    table.Touch(find_it, cur_time_ms);
+
+    if (LoadBigEndian32(packet.user_data()) != (*find_it).user_data_tag()) {
+      return false;
+    }
+    if ((*find_it).last_received_packet() < packet.snapshot_index()) {
+      (*find_it).set_last_received_packet(packet.snapshot_index());
+    }
+    return true;
+  }
+
+  // Should be called under changes_lock_ and the lock of the shard of the
+  // table.
+  void processReceivedPacket(DiscoveredPeersTable& table, long cur_time_ms,
+                             const ReceivedPacket& received,
+                             std::vector<DiscoveredPeerChange>* events) {
+    const PacketView& packet = received.packet;
+    DiscoveredPeersTable::Iterator find_it = table.Find(received.from);
+
+    if (packet.packet_type() == kPacketIAmHere) {
+      if (find_it == table.end()) {
+        find_it = table.Add(received.from);
+        (*find_it).set_interface_index(received.interface_index);
+        (*find_it).SetUserData(
+            std::string(packet.user_data(), packet.user_data_size()),
+            packet.snapshot_index());
+        (*find_it).set_user_data_tag(
+            UserDataTag(packet.user_data(), packet.user_data_size()));
+        table.Touch(find_it, cur_time_ms);
+
+        AtomicAdd(&stats_.peers_added, 1);
+        AtomicAdd(&stats_.user_data_bytes, packet.user_data_size());
+
+        recordChange(DiscoveredPeerChange::kAdded, *find_it, events);
+      } else {
+        bool changed = false;
+        bool update_user_data =
+            ((*find_it).last_received_packet() < packet.snapshot_index());
+        if (update_user_data) {
+          changed = !packet.UserDataEquals((*find_it).user_data());
+          if (changed) {
+            // Unsigned wrap around subtracts the old size.
+            AtomicAdd(&stats_.peers_updated, 1);
+            AtomicAdd(&stats_.user_data_bytes,
+                      (uint64_t)packet.user_data_size() -
+                          (*find_it).user_data().size());
+            (*find_it).SetUserData(
+                std::string(packet.user_data(), packet.user_data_size()),
+                packet.snapshot_index());
+            (*find_it).set_user_data_tag(
+                UserDataTag(packet.user_data(), packet.user_data_size()));
+          } else {
+            (*find_it).set_last_received_packet(packet.snapshot_index());
+          }
+        }
+        (*find_it).set_interface_index(received.interface_index);
+        table.Touch(find_it, cur_time_ms);
+
+        if (changed) {
+          recordChange(DiscoveredPeerChange::kUserDataChanged, *find_it,
+                       events);
+        }
+      }
+    } else if (packet.packet_type() == kPacketIAmOutOfHere) {
+      if (find_it != table.end()) {
+        recordChange(DiscoveredPeerChange::kRemoved, *find_it, events);
+        AtomicAdd(&stats_.peers_left, 1);
+        AtomicAdd(&stats_.user_data_bytes,
+                  (uint64_t)0 - (*find_it).user_data().size());
+        table.Remove(find_it);
+      }
+    }
+  }
+
+  // Passes addresses of peers that sent stale heartbeats to the sending
+  // thread.
+  void addFullAnnouncementRequests(const std::vector<IpPort>& stale) {
+    lock_.Lock();
+    for (size_t i = 0; i < stale.size(); ++i) {
+      if (full_announcement_requests_.size() >= kMaxProbeRequests) {
+        break;
+      }
+      full_announcement_requests_.push_back(stale[i]);
+    }
+    sending_thread_wakeup_.NotifyAll();
+    lock_.Unlock();
+
+    if (poll_requester_) {
+      poll_requester_->RequestPoll(this);
+    }
+  }
+
+  // Asks peers that sent stale heartbeats for full announcements with probes
+  // sent to their port. A peer is asked once per interval between
+  // announcements, the next heartbeat asks again if the answer is lost.
+  void requestFullAnnouncements(long cur_time_ms) {
+    lock_.Lock();
+    std::vector<IpPort> requests;
+    requests.swap(full_announcement_requests_);
+    lock_.Unlock();
+
+    size_t num_recent = 0;
+    for (size_t i = 0; i < full_announcement_requests_sent_.size(); ++i) {
+      const ProbeResponse& sent = full_announcement_requests_sent_[i];
+      if (cur_time_ms - sent.send_time_ms < sendIntervalMs()) {
+        full_announcement_requests_sent_[num_recent++] = sent;
+      }
+    }
+    full_announcement_requests_sent_.resize(num_recent);
+
+    for (size_t i = 0; i < requests.size(); ++i) {
+      IpPort destination(requests[i].ip(), parameters_.port());
+
+      bool is_recent = false;
+      for (size_t j = 0; j < full_announcement_requests_sent_.size(); ++j) {
+        if (full_announcement_requests_sent_[j].destination == destination) {
+          is_recent = true;
+          break;
+        }
+      }
+      if (is_recent ||
+          full_announcement_requests_sent_.size() >= kMaxProbeRequests) {
+        continue;
+      }
+
+      AtomicAdd(&stats_.unicast_sent,
+                SendTo(sock_, destination, probesData()));
+
+      ProbeResponse sent;
+      sent.destination = destination;
+      sent.send_time_ms = cur_time_ms;
+      full_announcement_requests_sent_.push_back(sent);
+    }
+  }
+
+  // Passes received probes to the sending thread.
+  void requestProbeResponses(const std::vector<IpPort>& probes) {
+    if (!parameters_.can_be_discovered()) {
+      return;
+    }
+
+    lock_.Lock();
+    for (size_t i = 0; i < probes.size(); ++i) {
+      if (probe_requests_.size() >= kMaxProbeRequests) {
+        break;
+      }
+      probe_requests_.push_back(probes[i]);
+    }
+    sending_thread_wakeup_.NotifyAll();
+    lock_.Unlock();
+
+    if (poll_requester_) {
+      poll_requester_->RequestPoll(this);
+    }
+  }
+
+  // Answers probes with kPacketIAmHere sent to the port of this peer on the
+  // address of the prober. Every answer is delayed by a random time that
+  // grows with the number of discovered peers, so a big group doesn't answer
+  // at once. Returns the time until the next answer or -1 if there are none.
+  long sendProbeResponses(long cur_time_ms) {
+    lock_.Lock();
+    std::vector<IpPort> requests;
+    requests.swap(probe_requests_);
+    lock_.Unlock();
+
+    long max_delay_ms = parameters_.probe_response_delay_ms() *
+                        (long)(num_discovered_peers_ + 1);
+    if (max_delay_ms > sendIntervalMs()) {
+      max_delay_ms = sendIntervalMs();
+    }
+
+    for (size_t i = 0; i < requests.size(); ++i) {
+      IpPort destination(requests[i].ip(), parameters_.port());
+
+      // A probe is sent with every version to every destination.
+      bool is_pending = false;
+      for (size_t j = 0; j < probe_responses_.size(); ++j) {
+        if (probe_responses_[j].destination == destination) {
+          is_pending = true;
+          break;
+        }
+      }
+      if (is_pending || probe_responses_.size() >= kMaxProbeRequests) {
+        continue;
+      }
+
+      ProbeResponse response;
+      response.destination = destination;
+      response.send_time_ms =
+          cur_time_ms + RandomUpTo(random_state_, max_delay_ms);
+      probe_responses_.push_back(response);
+    }
+
+    long to_wait_ms = -1;
+    size_t num_pending = 0;
+    for (size_t i = 0; i < probe_responses_.size(); ++i) {
+      const ProbeResponse& response = probe_responses_[i];
+      if (response.send_time_ms <= cur_time_ms) {
+        preparePackets(/* under_lock= */ false, kPacketIAmHere);
+        AtomicAdd(&stats_.unicast_sent,
+                  SendTo(sock_, response.destination, packets_data_));
+        continue;
+      }
+
+      long response_wait_ms = response.send_time_ms - cur_time_ms;
+      if (to_wait_ms < 0 || response_wait_ms < to_wait_ms) {
+        to_wait_ms = response_wait_ms;
+      }
+      probe_responses_[num_pending++] = response;
+    }
+    probe_responses_.resize(num_pending);
+
+    return to_wait_ms;
+  }
+
+  // Returns the interval changed by a random value of up to
+  // send_jitter_percent() of it in both directions.
+  long jitteredInterval(long interval_ms) {
+    long jitter_ms = interval_ms * parameters_.send_jitter_percent() / 100;
+    long result =
+        interval_ms - jitter_ms + RandomUpTo(random_state_, 2 * jitter_ms);
+    if (result < 1) {
+      return 1;
+    }
+    return result;
+  }
+
+  // Sends the announcement of the first supported version, the others
+  // follow after random delays by sendNextVersions().
+  void sendFirstVersion(long cur_time_ms) {
+    std::vector<std::string>& packets = tickPackets();
+    if (packets.empty()) {
+      return;
+    }
+
+    send_batch_.Send(sock_, &packets[0], 1);
+    next_version_to_send_ = 1;
+    next_version_send_time_ms_ = cur_time_ms + versionSpacingMs();
+  }
+
+  // Sends the versions of the current announcement that are due. Returns the
+  // time until the next one or -1 if all are sent.
+  long sendNextVersions(long cur_time_ms) {
+    std::vector<std::string>& packets = tickPackets();
+    while (next_version_to_send_ < packets.size()) {
+      if (cur_time_ms < next_version_send_time_ms_) {
+        return next_version_send_time_ms_ - cur_time_ms;
+      }
+
+      send_batch_.Send(sock_, &packets[next_version_to_send_], 1);
+      ++next_version_to_send_;
+      next_version_send_time_ms_ = cur_time_ms + versionSpacingMs();
+    }
+    return -1;
+  }
+
+  // All versions are sent within the jitter of the interval.
+  long versionSpacingMs() {
+    long jitter_ms = sendIntervalMs() * parameters_.send_jitter_percent() / 100;
+    return RandomUpTo(random_state_, jitter_ms / (long)tickPackets().size());
+  }
+
+  // The interval between announcements. With a budget the whole group,
+  // this peer and the discovered peers, sends about the budget of
+  // announcements per second, like the interval of RTCP reports.
+  long sendIntervalMs() const {
+    long send_timeout_ms = parameters_.send_timeout_ms();
+    int budget = parameters_.announcement_budget_per_second();
+    if (budget <= 0) {
+      return send_timeout_ms;
+    }
+
+    double group_interval_ms = (num_discovered_peers_ + 1) * 1000.0 / budget;
+    if (group_interval_ms <= send_timeout_ms) {
+      return send_timeout_ms;
+    }
+    return (long)group_interval_ms;
+  }
+
+  // Other peers of the group widen their intervals the same way, so the ttl
+  // is widened in proportion. After the group shrinks the wider ttl is kept
+  // for one more ttl, peers that announced with the longer interval still
+  // have to announce again.
+  long updateTtlMs(long cur_time_ms) {
+    long ttl_ms = parameters_.discovered_peer_ttl_ms();
+    long send_timeout_ms = parameters_.send_timeout_ms();
+    long send_interval_ms = sendIntervalMs();
+    if (send_interval_ms > send_timeout_ms) {
+      if (send_timeout_ms > 0) {
+        ttl_ms = (long)((double)ttl_ms * send_interval_ms / send_timeout_ms);
+      } else {
+        ttl_ms += send_interval_ms;
+      }
+    }
+
+    if (ttl_ms >= ttl_ms_ || cur_time_ms >= ttl_hold_until_ms_) {
+      ttl_ms_ = ttl_ms;
+      ttl_hold_until_ms_ = cur_time_ms + ttl_ms;
+    }
+    return ttl_ms_;
+  }
+
+  // Removes expired peers and returns the time to wait until the next peer
+  // expires.
+  long deleteIdle(long cur_time_ms) {
+    long ttl_ms = updateTtlMs(cur_time_ms);
+
+    std::list<DiscoveredPeer> expired;
+    std::vector<DiscoveredPeerChange> events;
+
+    // A peer added later can't expire earlier than the ttl from now.
+    long next_expiration_time_ms = cur_time_ms + ttl_ms + 1;
+
+    size_t num_discovered_peers = 0;
+
+    changes_lock_.Lock();
+
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      Shard& shard = *shards_[i];
+      shard.lock.Lock();
+      shard.table.RemoveExpired(cur_time_ms, ttl_ms, &expired);
+      num_discovered_peers += shard.table.size();
+      long shard_expiration_time_ms;
+      if (shard.table.NextExpirationTime(ttl_ms, shard_expiration_time_ms) &&
+          shard_expiration_time_ms < next_expiration_time_ms) {
+        next_expiration_time_ms = shard_expiration_time_ms;
+      }
+      shard.lock.Unlock();
+    }
+
+    if (!expired.empty()) {
+      uint64_t num_expired = 0;
+      uint64_t expired_bytes = 0;
+      for (std::list<DiscoveredPeer>::const_iterator it = expired.begin();
+           it != expired.end(); ++it) {
+        recordChange(DiscoveredPeerChange::kRemoved, *it, &events);
+        ++num_expired;
+        expired_bytes += (*it).user_data().size();
+      }
+      AtomicAdd(&stats_.peers_expired, num_expired);
+      AtomicAdd(&stats_.user_data_bytes, (uint64_t)0 - expired_bytes);
+      publishSnapshot();
+    } else {
+      releaseRetiredSnapshots();
+    }
+
+    changes_lock_.Unlock();
+
+    num_discovered_peers_ = num_discovered_peers;
+
+    dispatchEvents(events);
+
+    return next_expiration_time_ms - cur_time_ms;
+  }
+
+  // Adds the change to the changes log and to the events for the observer.
+  // Should be called under changes_lock_.
+  void recordChange(DiscoveredPeerChange::Type type, const DiscoveredPeer& peer,
+                    std::vector<DiscoveredPeerChange>* events) {
+    const DiscoveredPeerChange& change = changes_log_.Add(type, peer);
+    if (has_observer_) {
+      events->push_back(change);
+    }
+  }
+
+  // Should be called without lock_.
+  void dispatchEvents(const std::vector<DiscoveredPeerChange>& events) {
+    if (events.empty()) {
+      return;
+    }
+
+    if (parameters_.observer_dispatch_mode() ==
+            PeerParameters::kObserverDispatchInline ||
+        parameters_.engine_mode() == PeerParameters::kEngineExternal) {
+      callObserver(events);
+      return;
+    }
+
+    lock_.Lock();
+    for (size_t i = 0; i < events.size(); ++i) {
+      if ((int)events_.size() >= parameters_.observer_queue_size()) {
+        AtomicAdd(&stats_.dropped_events, 1);
+        continue;
+      }
+      events_.push_back(events[i]);
+    }
+    events_wakeup_.NotifyAll();
+    lock_.Unlock();
+  }
+
+  void callObserver(const std::vector<DiscoveredPeerChange>& events) {
+    observer_lock_.Lock();
+    if (observer_) {
+      for (size_t i = 0; i < events.size(); ++i) {
+        switch (events[i].type()) {
+          case DiscoveredPeerChange::kAdded:
+            observer_->OnPeerJoined(events[i].peer());
+            break;
+
+          case DiscoveredPeerChange::kUserDataChanged:
+            observer_->OnPeerUserDataChanged(events[i].peer());
+            break;
+
+          case DiscoveredPeerChange::kRemoved:
+            observer_->OnPeerLeft(events[i].peer());
+            break;
+        }
+      }
+    }
+    observer_lock_.Unlock();
+  }
+
+  // Publishes the new snapshot of discovered peers. Snapshots only track
+  // ip/port and user data of peers, so refreshing last_updated() does not
+  // require publishing. Should be called under changes_lock_.
+  void publishSnapshot() {
+    DiscoveredPeersSnapshotData* data = new DiscoveredPeersSnapshotData();
+    listShards(&data->peers);
+
+    retired_snapshots_.push_back(AtomicExchangePointer(&snapshot_, data));
+    releaseRetiredSnapshots();
+  }
+
+  // Should be called under changes_lock_.
+  void releaseRetiredSnapshots() {
+    if (retired_snapshots_.empty()) {
+      return;
+    }
+
+    // Readers that are still loading the previous snapshot pointer may not
+    // have referenced it yet.
+    if (AtomicLoad(&snapshot_readers_) != 0) {
+      return;
+    }
+
+    for (size_t i = 0; i < retired_snapshots_.size(); ++i) {
+      ReleaseSnapshotData(retired_snapshots_[i]);
+    }
+    retired_snapshots_.clear();
+  }
+
+  // Sends to the broadcast address of each interface, or to INADDR_BROADCAST
+  // if there are no interfaces to use.
+  void addBroadcastDestinations(
+      const std::vector<NetworkInterface>& interfaces) {
+    bool has_destinations = false;
+    for (size_t i = 0; i < interfaces.size(); ++i) {
+      if (interfaces[i].broadcast_address != 0) {
+        send_batch_.AddDestination(
+            IpPort(interfaces[i].broadcast_address, parameters_.port()));
+        has_destinations = true;
+      }
+    }
+
+    if (!has_destinations) {
+      send_batch_.AddDestination(IpPort(INADDR_BROADCAST, parameters_.port()));
+    }
+  }
+
+  // The group is sent to through every interface that can multicast, all
+  // from sock_ so that receivers see one source port. Without interfaces to
+  // use the routing table chooses the interface.
+  void addMulticastDestinations(
+      const std::vector<NetworkInterface>& interfaces) {
+    IpPort group(parameters_.multicast_group_address(), parameters_.port());
+
+    bool has_destinations = false;
+    for (size_t i = 0; i < interfaces.size(); ++i) {
+      if (interfaces[i].can_multicast && interfaces[i].index != 0) {
+        send_batch_.AddDestination(group, interfaces[i].index,
+                                   interfaces[i].address);
+        has_destinations = true;
+      }
+    }
+
+    if (!has_destinations) {
+      send_batch_.AddDestination(group);
+    }
+  }
+
+  // Peers are split into shards by the key of DiscoveredPeersTable.
+  size_t shardIndex(const IpPort& from) const {
+    if (shards_.size() == 1) {
+      return 0;
+    }
+
+    IpPort key = from;
+    if (parameters_.same_peer_mode() == PeerParameters::kSamePeerIp) {
+      key.set_port(0);
+    }
+    // Tables of shards hash the same key, so the shard is chosen by other
+    // bits.
+    return MixBits((uint32_t)IpPortHash()(key)) % shards_.size();
+  }
+
+  // Appends peers of all shards. Takes locks of shards one by one.
+  void listShards(std::list<DiscoveredPeer>* peers_out) {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      Shard& shard = *shards_[i];
+      shard.lock.Lock();
+      peers_out->insert(peers_out->end(), shard.table.begin(),
+                        shard.table.end());
+      shard.lock.Unlock();
+    }
+  }
+
+  SocketType workerBindingSocket(int worker_index) const {
+    if (worker_index == 0) {
+      return binding_sock_;
+    }
+    return worker_binding_socks_[worker_index - 1];
+  }
+
+  // Sends the packet of every supported protocol version to every
+  // destination. Serialized packets are cached, while the packet type and
+  // user data stay the same only the snapshot index is patched in place.
+  // Sends every version at once, versions delayed by sendFirstVersion() are
+  // not sent again.
+  void send(bool under_lock, PacketType packet_type) {
+    preparePackets(under_lock, packet_type);
+    send_batch_.Send(sock_, packets_data_);
+    tick_is_heartbeat_ = false;
+    next_version_to_send_ = packets_data_.size();
+  }
+
+  // Peers of versions without heartbeats drop them and keep this peer only
+  // while its full announcements arrive within their ttl, that is assumed to
+  // be the same as ours. So the interval is at most half of the ttl.
+  long fullAnnouncementIntervalMs() const {
+    long full_interval_ms = parameters_.full_announcement_interval_ms();
+    long max_interval_ms = parameters_.discovered_peer_ttl_ms() / 2;
+    if (full_interval_ms > max_interval_ms) {
+      return max_interval_ms;
+    }
+    return full_interval_ms;
+  }
+
+  // Prepares the packets of a regular announcement. Between full
+  // announcements these are heartbeats, unless user data has changed since
+  // the last full announcement.
+  void prepareTick(long cur_time_ms) {
+    long full_interval_ms = fullAnnouncementIntervalMs();
+    tick_is_heartbeat_ =
+        full_interval_ms > 0 && last_full_send_time_ms_ != 0 &&
+        cur_time_ms - last_full_send_time_ms_ < full_interval_ms &&
+        announced_user_data_generation_ == timers_user_data_generation_;
+    if (tick_is_heartbeat_) {
+      prepareHeartbeats();
+    } else {
+      preparePackets(/* under_lock= */ false, kPacketIAmHere);
+      markAnnounced(cur_time_ms);
+    }
+  }
+
+  std::vector<std::string>& tickPackets() {
+    return tick_is_heartbeat_ ? heartbeats_data_ : packets_data_;
+  }
+
+  // Should be called after packets_data_ of kPacketIAmHere are sent to all
+  // destinations.
+  void markAnnounced(long cur_time_ms) {
+    announced_user_data_generation_ = packets_data_user_data_generation_;
+    last_full_send_time_ms_ = cur_time_ms;
+  }
+
+  void prepareHeartbeats() {
+    long user_data_generation = AtomicLoad(&user_data_generation_);
+    if (user_data_generation == heartbeats_data_user_data_generation_) {
+      for (size_t i = 0; i < heartbeats_data_.size(); ++i) {
+        StoreBigEndian64(packet_index_,
+                         &heartbeats_data_[i][kHeaderSnapshotIndexOffset]);
+        ++packet_index_;
+      }
+      return;
+    }
+
+    lock_.Lock();
+    uint32_t tag = UserDataTag(user_data_.data(), user_data_.size());
+    user_data_generation = AtomicLoad(&user_data_generation_);
+    lock_.Unlock();
+
+    char tag_data[kHeartbeatUserDataSize];
+    StoreBigEndian32(tag, tag_data);
+    serializeWithoutUserDataChanges(
+        kPacketHeartbeat, std::string(tag_data, sizeof(tag_data)),
+        heartbeats_data_);
+    heartbeats_data_user_data_generation_ = user_data_generation;
+  }
+
+  // Probes of every supported version, serialized once.
+  const std::vector<std::string>& probesData() {
+    if (probes_data_.empty()) {
+      serializeWithoutUserDataChanges(kPacketProbe, std::string(),
+                                      probes_data_);
+    }
+    return probes_data_;
+  }
+
+  void serializeWithoutUserDataChanges(PacketType packet_type,
+                                       const std::string& user_data,
+                                       std::vector<std::string>& out) {
+    Packet packet;
+    packet.set_packet_type(packet_type);
+    packet.set_application_id(parameters_.application_id());
+    packet.set_peer_id(peer_id_);
+    packet.set_user_data(user_data);
+
+    out.clear();
+    for (int protocol_version = parameters_.min_supported_protocol_version();
+         protocol_version <= parameters_.max_supported_protocol_version();
+         ++protocol_version) {
+      packet.set_snapshot_index(packet_index_);
+      ++packet_index_;
+
+      out.push_back(std::string());
+      if (!packet.Serialize((ProtocolVersion)protocol_version, out.back())) {
+        out.pop_back();
+      }
+    }
+  }
+
+  // Serializes the packets or updates their snapshot indexes.
+  void preparePackets(bool under_lock, PacketType packet_type) {
+    if (packet_type != packets_data_type_ ||
+        AtomicLoad(&user_data_generation_) !=
+            packets_data_user_data_generation_) {
+      serializePackets(under_lock, packet_type);
+    } else {
+      for (size_t i = 0; i < packets_data_.size(); ++i) {
+        StoreBigEndian64(packet_index_,
+                         &packets_data_[i][kHeaderSnapshotIndexOffset]);
+        ++packet_index_;
+      }
+    }
+  }
+
+  void serializePackets(bool under_lock, PacketType packet_type) {
+    if (!under_lock) {
+      lock_.Lock();
+    }
+    std::string user_data = user_data_;
+    long user_data_generation = AtomicLoad(&user_data_generation_);
+    if (!under_lock) {
+      lock_.Unlock();
+    }
+
+    Packet packet;
+    packet.set_packet_type(packet_type);
+    packet.set_application_id(parameters_.application_id());
+    packet.set_peer_id(peer_id_);
+    packet.SwapUserData(user_data);
+
+    packets_data_.clear();
+    for (int protocol_version = parameters_.min_supported_protocol_version();
+         protocol_version <= parameters_.max_supported_protocol_version();
+         ++protocol_version) {
+      packet.set_snapshot_index(packet_index_);
+      ++packet_index_;
+
+      packets_data_.push_back(std::string());
+      if (!packet.Serialize((ProtocolVersion)protocol_version,
+                            packets_data_.back())) {
+        packets_data_.pop_back();
+      }
+    }
+
+    packets_data_type_ = packet_type;
+    packets_data_user_data_generation_ = user_data_generation;
+  }
+
+ private:
+  // Probes beyond this number are not answered until the pending ones are.
+  static const size_t kMaxProbeRequests = 1024;
+  // A flood on the port doesn't keep Poll() from returning to the caller.
+  static const int kMaxPollBatches = 16;
+
+  struct ProbeResponse {
+    IpPort destination;
+    long send_time_ms;
+  };
+
+  // Counters of GetStats() that are not kept by send_batch_. Updated with
+  // atomic adds, at most a few per received batch.
+  struct StatsCounters {
+    StatsCounters()
+        : datagrams_received(0),
+          parse_errors(0),
+          unsupported_version(0),
+          other_application_id(0),
+          own_packets(0),
+          unicast_sent(0),
+          peers_added(0),
+          peers_updated(0),
+          peers_left(0),
+          peers_expired(0),
+          user_data_bytes(0),
+          dropped_events(0) {}
+
+    volatile uint64_t datagrams_received;
+    volatile uint64_t parse_errors;
+    volatile uint64_t unsupported_version;
+    volatile uint64_t other_application_id;
+    volatile uint64_t own_packets;
+    // Answers to probes and requests of full announcements.
+    volatile uint64_t unicast_sent;
+    volatile uint64_t peers_added;
+    volatile uint64_t peers_updated;
+    volatile uint64_t peers_left;
+    volatile uint64_t peers_expired;
+    volatile uint64_t user_data_bytes;
+    volatile uint64_t dropped_events;
+  };
+
+  PeerParameters parameters_;
+  uint32_t peer_id_;
+  SocketType binding_sock_;
+  SocketType sock_;
+  // Sockets of receive workers after the first one, that uses binding_sock_.
+  std::vector<SocketType> worker_binding_socks_;
+  uint64_t packet_index_;
+  // Used only by the sending thread.
+  std::vector<std::string> packets_data_;
+  PacketType packets_data_type_;
+  long packets_data_user_data_generation_;
+  std::vector<std::string> heartbeats_data_;
+  long heartbeats_data_user_data_generation_;
+  std::vector<std::string> probes_data_;
+  // The current regular announcement sends heartbeats_data_ instead of
+  // packets_data_.
+  bool tick_is_heartbeat_;
+  // Generation of user data in the last full announcement to all
+  // destinations. Answers to probes don't count.
+  long announced_user_data_generation_;
+  long last_full_send_time_ms_;
+  SendBatch send_batch_;
+  long last_send_time_ms_;
+  long last_user_data_send_time_ms_;
+  long timers_user_data_generation_;
+  // With send_jitter_percent() the interval until the next announcement and
+  // the versions of the current announcement that are not sent yet.
+  long next_send_interval_ms_;
+  size_t next_version_to_send_;
+  long next_version_send_time_ms_;
+  uint32_t random_state_;
+  bool probe_sent_;
+  // Answers to probes that are not sent yet, used only by the sending thread.
+  std::vector<ProbeResponse> probe_responses_;
+  // Recent requests of full announcements, not repeated within the interval
+  // between announcements. Used only by the sending thread.
+  std::vector<ProbeResponse> full_announcement_requests_sent_;
+  StatsCounters stats_;
+  size_t num_discovered_peers_;
+  long ttl_ms_;
+  long ttl_hold_until_ms_;
+  PollRequester* poll_requester_;
+  // Used by Poll() only, allocated on the first call.
+  ReceiveBatch* poll_batch_;
+  std::vector<ReceivedPacket> poll_packets_;
+  long next_deadline_ms_;
+  PollWakeup wakeup_;
+  volatile long num_started_receive_workers_;
+
+  MinimalisticMutex lock_;
+  MinimalisticConditionVariable sending_thread_wakeup_;
+  int ref_count_;
+  bool exit_;
+  std::string user_data_;
+  // Changed under lock_ together with user_data_, read by the sending thread
+  // without lock_.
+  volatile long user_data_generation_;
+
+  struct Shard {
+    explicit Shard(PeerParameters::SamePeerMode same_peer_mode)
+        : table(same_peer_mode) {}
+
+    MinimalisticMutex lock;
+    DiscoveredPeersTable table;
+  };
+
+  // One shard per receive worker. Changes of discovered peers are made under
+  // changes_lock_ and the lock of the shard, refreshes only under the lock of
+  // the shard. changes_lock_ is taken before locks of shards and no two locks
+  // of shards are held at once.
+  std::vector<Shard*> shards_;
+  MinimalisticMutex changes_lock_;
+
+  // Published under changes_lock_, Snapshot() reads it without locks.
+  DiscoveredPeersSnapshotData* volatile snapshot_;
+  volatile long snapshot_readers_;
+  std::vector<DiscoveredPeersSnapshotData*> retired_snapshots_;
+
+  DiscoveredPeersChangeLog changes_log_;
+
+  // observer_ is set in Start() and reset in Exit(), callbacks are called
+  // under observer_lock_.
+  bool has_observer_;
+  MinimalisticMutex observer_lock_;
+  PeerObserver* observer_;
+  // Events queued for the dispatching thread, guarded by lock_.
+  std::deque<DiscoveredPeerChange> events_;
+  MinimalisticConditionVariable events_wakeup_;
+
+  // Addresses of received probes for the sending thread, guarded by lock_.
+  std::vector<IpPort> probe_requests_;
+  // Addresses of peers with unknown user data in heartbeats, guarded by
+  // lock_.
+  std::vector<IpPort> full_announcement_requests_;
+};
+
+// One thread of PeerReactor. Waits for the shared binding sockets and calls
+// Poll() of the attached envs when a deadline passes or the user data changes.
+// All envs of the worker share one timer queue. Datagrams of a shared binding
+// socket are parsed once and passed to the envs with the application id of
+// the packet.
+class ReactorWorker : public PollRequester {
+ public:
+  ReactorWorker()
+      : exit_(false),
+        num_requested_detaches_(0),
+        num_processed_detaches_(0),
+        batch_(PeerParameters().receive_batch_size(),
+               ReceiveSlotSize(kProtocolVersion0, kProtocolVersion2)),
+        packets_(batch_.size()) {}
+
+  bool Init() {
+    batch_.EnablePacketInfo();
+    return wakeup_.Init();
+  }
+
+  // The env should have the reference for the worker. The worker owns
+  // binding_sock, if it is valid, and closes it after the last env that uses
+  // it is detached.
+  void Attach(PeerEnv* env, SocketType binding_sock) {
+    lock_.Lock();
+    attached_.push_back(std::make_pair(env, binding_sock));
+    wakeup_.Signal();
+    lock_.Unlock();
+  }
+
+  // The worker calls ReleaseExternal() of the env. If wait is true returns
+  // after that.
+  void Detach(PeerEnv* env, bool wait) {
+    lock_.Lock();
+    detached_.push_back(env);
+    uint64_t ticket = ++num_requested_detaches_;
+    wakeup_.Signal();
+    while (wait && num_processed_detaches_ < ticket) {
+      detached_wakeup_.WaitFor(lock_, 1000);
+    }
+    lock_.Unlock();
+  }
+
+  void RequestPoll(PeerEnv* env) {
+    lock_.Lock();
+    to_poll_.push_back(env);
+    wakeup_.Signal();
+    lock_.Unlock();
+  }
+
+  void Exit() {
+    lock_.Lock();
+    exit_ = true;
+    wakeup_.Signal();
+    lock_.Unlock();
+  }
+
+  void ThreadFunc() {
+    std::vector<std::pair<PeerEnv*, SocketType> > attached;
+    std::vector<PeerEnv*> detached;
+    std::vector<PeerEnv*> to_poll;
+    std::vector<PollFd> fds;
+    std::vector<SharedSocket*> fd_sockets;
+
+    while (true) {
+      lock_.Lock();
+      // Attaches and detaches requested before Exit() are processed once
+      // more, so that detached envs are released and waiters wake up.
+      bool exit = exit_;
+      attached.swap(attached_);
+      detached.swap(detached_);
+      to_poll.swap(to_poll_);
+      lock_.Unlock();
 
       long cur_time_ms = NowTime();
-      long to_sleep_ms = 0;
-
-      if (parameters_.can_be_discovered()) {
-        if (IsRightTime(last_send_time_ms, cur_time_ms,
-                        parameters_.send_timeout_ms(), to_sleep_ms)) {
-          for (int protocol_version =
-                   parameters_.min_supported_protocol_version();
-               protocol_version <= parameters_.max_supported_protocol_version();
-               ++protocol_version) {
-            send(/* under_lock= */ false, (ProtocolVersion)protocol_version,
-                 kPacketIAmHere);
+
+      for (size_t i = 0; i < attached.size(); ++i) {
+        Entry* entry = new Entry();
+        entry->env = attached[i].first;
+        entry->has_deadline = false;
+        entry->shared_socket = 0;
+        entry->is_receiver = false;
+        memset(entry->verdicts, 0, sizeof(entry->verdicts));
+        if (attached[i].second != kInvalidSocket) {
+          addToSharedSocket(entry, attached[i].second);
+        }
+        entries_[entry->env] = entry;
+        schedule(entry);
+      }
+
+      for (size_t i = 0; i < to_poll.size(); ++i) {
+        EntriesMap::iterator find_it = entries_.find(to_poll[i]);
+        if (find_it != entries_.end()) {
+          poll(find_it->second, cur_time_ms);
+        }
+      }
+
+      for (size_t i = 0; i < detached.size(); ++i) {
+        EntriesMap::iterator find_it = entries_.find(detached[i]);
+        if (find_it != entries_.end()) {
+          Entry* entry = find_it->second;
+          if (entry->has_deadline) {
+            timers_.erase(entry->timer_it);
+          }
+          if (entry->shared_socket) {
+            removeFromSharedSocket(entry);
           }
-          last_send_time_ms = cur_time_ms;
+          entries_.erase(find_it);
+          delete entry;
         }
+        detached[i]->ReleaseExternal();
       }
 
-      if (parameters_.can_discover()) {
-        long to_sleep_until_next_delete_idle = 0;
-        if (IsRightTime(last_delete_idle_ms, cur_time_ms,
-                        parameters_.discovered_peer_ttl_ms(),
-                        to_sleep_until_next_delete_idle)) {
-          deleteIdle(cur_time_ms);
-          last_delete_idle_ms = cur_time_ms;
-        }
+      if (!detached.empty()) {
+        lock_.Lock();
+        num_processed_detaches_ += detached.size();
+        detached_wakeup_.NotifyAll();
+        lock_.Unlock();
+      }
 
-        if (to_sleep_ms > to_sleep_until_next_delete_idle) {
-          to_sleep_ms = to_sleep_until_next_delete_idle;
-        }
+      attached.clear();
+      detached.clear();
+      to_poll.clear();
+
+      if (exit) {
+        break;
       }
 
-      SleepFor(to_sleep_ms);
-    }
-  }
+      fds.resize(1);
+      fd_sockets.resize(1);
+      fds[0].fd = wakeup_.fd();
+      fd_sockets[0] = 0;
+      for (SharedSocketsMap::iterator it = shared_sockets_.begin();
+           it != shared_sockets_.end(); ++it) {
+        PollFd fd;
+        fd.fd = it->first;
+        fds.push_back(fd);
+        fd_sockets.push_back(it->second);
+      }
 
-  void ReceivingThreadFunc() {
-    lock_.Lock();
-    ++ref_count_;
-    lock_.Unlock();
+      long timeout_ms = -1;
+      if (!timers_.empty()) {
+        timeout_ms = timers_.begin()->first - cur_time_ms;
+        if (timeout_ms < 0) {
+          timeout_ms = 0;
+        }
+      }
 
-    while (true) {
-      sockaddr_in from_addr;
-      AddressLenType addr_length = sizeof(sockaddr_in);
+      if (PollSockets(&fds[0], (int)fds.size(), timeout_ms) < 0) {
+        continue;
+      }
 
-      std::string buffer;
-      buffer.resize(kMaxPacketSize);
+      if (fds[0].revents != 0) {
+        wakeup_.Drain();
+      }
 
-      int length = (int)recvfrom(binding_sock_, &buffer[0], buffer.size(), 0,
-                                 (struct sockaddr*)&from_addr, &addr_length);
+      cur_time_ms = NowTime();
 
-      lock_.Lock();
-      if (exit_) {
-        decreaseRefCountAndMaybeDestroySelfAndUnlock();
-        return;
+      for (size_t i = 1; i < fds.size(); ++i) {
+        if (fds[i].revents != 0) {
+          receive(fd_sockets[i], cur_time_ms);
+        }
       }
-      lock_.Unlock();
 
-      if (length <= 0) {
-        continue;
+      while (!timers_.empty() && timers_.begin()->first <= cur_time_ms) {
+        poll(timers_.begin()->second, cur_time_ms);
       }
+    }
 
-      IpPort from;
-      from.set_port(ntohs(from_addr.sin_port));
-      from.set_ip(ntohl(from_addr.sin_addr.s_addr));
+    // Envs that are still attached are released by PeerReactorEnv::Detach()
+    // after the reactor is stopped.
+    for (EntriesMap::iterator it = entries_.begin(); it != entries_.end();
+         ++it) {
+      delete it->second;
+    }
+    entries_.clear();
+    timers_.clear();
 
-      buffer.resize(length);
-      processReceivedBuffer(NowTime(), from, buffer);
+    for (SharedSocketsMap::iterator it = shared_sockets_.begin();
+         it != shared_sockets_.end(); ++it) {
+      CloseSocket(it->first);
+      delete it->second;
     }
+    shared_sockets_.clear();
   }
 
  private:
-  void decreaseRefCountAndMaybeDestroySelfAndUnlock() {
-    --ref_count_;
-    int cur_ref_count = ref_count_;
+  struct Entry;
+  struct SharedSocket;
+  typedef std::multimap<long, Entry*> TimerQueue;
+  typedef std::map<PeerEnv*, Entry*> EntriesMap;
+  typedef std::map<SocketType, SharedSocket*> SharedSocketsMap;
+
+  struct ApplicationIdHash {
+    size_t operator()(uint32_t application_id) const {
+      return (size_t)(application_id * 0x9e3779b1u);
+    }
+  };
+
+  struct Entry {
+    PeerEnv* env;
+    bool has_deadline;
+    TimerQueue::iterator timer_it;
+    SharedSocket* shared_socket;
+    // The env has verdicts in the current receive batch and is in receivers_.
+    bool is_receiver;
+    uint64_t verdicts[PeerEnv::kNumPacketVerdicts];
+    // Packets of the current receive batch accepted by the env.
+    std::vector<ReceivedPacket> pending;
+  };
+
+  struct SharedSocket {
+    SocketType sock;
+    HashMap<uint32_t, std::vector<Entry*>, ApplicationIdHash> entries;
+    size_t num_entries;
+  };
+
+  void addToSharedSocket(Entry* entry, SocketType sock) {
+    SharedSocketsMap::iterator find_it = shared_sockets_.find(sock);
+    if (find_it == shared_sockets_.end()) {
+      SharedSocket* shared_socket = new SharedSocket();
+      shared_socket->sock = sock;
+      shared_socket->num_entries = 0;
+      find_it = shared_sockets_.insert(std::make_pair(sock, shared_socket))
+                    .first;
+    }
 
-    // This method is performed when the mutex is locked.
-    lock_.Unlock();
+    SharedSocket* shared_socket = find_it->second;
+    shared_socket->entries
+        .Insert(entry->env->application_id(), std::vector<Entry*>())
+        ->push_back(entry);
+    ++shared_socket->num_entries;
+    entry->shared_socket = shared_socket;
+  }
 
-    if (cur_ref_count <= 0) {
-      if (cur_ref_count < 0) {
-        // Shouldn't be there.
-        std::cerr << "Strangly ref count is less than 0." << std::endl;
-      }
+  void removeFromSharedSocket(Entry* entry) {
+    SharedSocket* shared_socket = entry->shared_socket;
+    uint32_t application_id = entry->env->application_id();
 
-      delete this;
+    std::vector<Entry*>* entries =
+        shared_socket->entries.Find(application_id);
+    entries->erase(std::find(entries->begin(), entries->end(), entry));
+    if (entries->empty()) {
+      shared_socket->entries.Erase(application_id);
     }
-  }
 
-  void processReceivedBuffer(long cur_time_ms, const IpPort& from,
-                             const std::string& buffer) {
-    Packet packet;
+    if (--shared_socket->num_entries == 0) {
+      shared_sockets_.erase(shared_socket->sock);
+      CloseSocket(shared_socket->sock);
+      delete shared_socket;
+    }
+  }
 
-    ProtocolVersion packet_version = packet.Parse(buffer);
-    bool is_supported_packet_version =
-        (packet_version >= parameters_.min_supported_protocol_version() &&
-         packet_version <= parameters_.max_supported_protocol_version());
-
-    if (packet_version != kProtocolVersionUnknown &&
-        is_supported_packet_version) {
-      bool accept_packet = false;
-      if (parameters_.application_id() == packet.application_id()) {
-        if (!parameters_.discover_self()) {
-          if (packet.peer_id() != peer_id_) {
-            accept_packet = true;
-          }
-        } else {
-          accept_packet = true;
+  // Parses every datagram once and applies it to the envs with the
+  // application id of the packet, each env under one lock per batch. Envs
+  // count the datagrams of their application id only, others are not theirs
+  // to count.
+  void receive(SharedSocket* shared_socket, long cur_time_ms) {
+    while (true) {
+      int num_received = batch_.Receive(shared_socket->sock,
+                                        /* wait= */ false);
+
+      for (int i = 0; i < num_received; ++i) {
+        ReceivedPacket received;
+        ProtocolVersion packet_version =
+            received.packet.Parse(batch_.data(i), batch_.length(i));
+        if (packet_version == kProtocolVersionUnknown) {
+          continue;
         }
-      }
 
-      if (accept_packet) {
-        lock_.Lock();
-
-        std::list<DiscoveredPeer>::iterator find_it = discovered_peers_.end();
-        for (std::list<DiscoveredPeer>::iterator it = discovered_peers_.begin();
-             it != discovered_peers_.end(); ++it) {
-          if (Same(parameters_.same_peer_mode(), (*it).ip_port(), from)) {
-            find_it = it;
-            break;
-          }
+        std::vector<Entry*>* entries =
+            shared_socket->entries.Find(received.packet.application_id());
+        if (!entries) {
+          continue;
         }
 
-        if (packet.packet_type() == kPacketIAmHere) {
-          if (find_it == discovered_peers_.end()) {
-            discovered_peers_.push_back(DiscoveredPeer());
-            discovered_peers_.back().set_ip_port(from);
-            discovered_peers_.back().SetUserData(packet.user_data(),
-                                                 packet.snapshot_index());
-            discovered_peers_.back().set_last_updated(cur_time_ms);
-          } else {
-            bool update_user_data =
-                ((*find_it).last_received_packet() < packet.snapshot_index());
-            if (update_user_data) {
-              (*find_it).SetUserData(packet.user_data(),
-                                     packet.snapshot_index());
-            }
-            (*find_it).set_last_updated(cur_time_ms);
+        received.from = batch_.from(i);
+        received.interface_index = batch_.interface_index(i);
+        for (size_t j = 0; j < entries->size(); ++j) {
+          Entry* entry = (*entries)[j];
+          PeerEnv::PacketVerdict verdict =
+              entry->env->CheckPacket(packet_version, received.packet);
+          if (!entry->is_receiver) {
+            entry->is_receiver = true;
+            receivers_.push_back(entry);
           }
-        } else if (packet.packet_type() == kPacketIAmOutOfHere) {
-          if (find_it != discovered_peers_.end()) {
-            discovered_peers_.erase(find_it);
+          ++entry->verdicts[verdict];
+          if (verdict == PeerEnv::kVerdictAccepted) {
+            entry->pending.push_back(received);
           }
         }
+      }
 
-        lock_.Unlock();
+      for (size_t i = 0; i < receivers_.size(); ++i) {
+        Entry* entry = receivers_[i];
+        entry->env->CountVerdicts(entry->verdicts);
+        if (!entry->pending.empty()) {
+          entry->env->ProcessReceivedPackets(cur_time_ms, entry->pending,
+                                             entry->pending.size());
+          entry->pending.clear();
+        }
+        entry->is_receiver = false;
+        memset(entry->verdicts, 0, sizeof(entry->verdicts));
+      }
+      receivers_.clear();
+
+      if (num_received < batch_.size()) {
+        break;
       }
     }
   }
 
-  void deleteIdle(long cur_time_ms) {
-    lock_.Lock();
+  void poll(Entry* entry, long cur_time_ms) {
+    entry->env->Poll(cur_time_ms, &batch_, packets_);
+    schedule(entry);
+  }
 
-    std::vector<std::list<DiscoveredPeer>::iterator> to_delete;
-    for (std::list<DiscoveredPeer>::iterator it = discovered_peers_.begin();
-         it != discovered_peers_.end(); ++it) {
-      if (cur_time_ms - (*it).last_updated() >
-          parameters_.discovered_peer_ttl_ms())
-        to_delete.push_back(it);
+  void schedule(Entry* entry) {
+    if (entry->has_deadline) {
+      timers_.erase(entry->timer_it);
+      entry->has_deadline = false;
     }
 
-    for (size_t i = 0; i < to_delete.size(); ++i)
-      discovered_peers_.erase(to_delete[i]);
-
-    lock_.Unlock();
+    long deadline = entry->env->NextDeadline();
+    if (deadline >= 0) {
+      entry->timer_it = timers_.insert(std::make_pair(deadline, entry));
+      entry->has_deadline = true;
+    }
   }
 
-  void send(bool under_lock, ProtocolVersion protocol_version,
-            PacketType packet_type) {
-    if (!under_lock) {
-      lock_.Lock();
+ private:
+  MinimalisticMutex lock_;
+  MinimalisticConditionVariable detached_wakeup_;
+  PollWakeup wakeup_;
+  bool exit_;
+  std::vector<std::pair<PeerEnv*, SocketType> > attached_;
+  std::vector<PeerEnv*> detached_;
+  std::vector<PeerEnv*> to_poll_;
+  uint64_t num_requested_detaches_;
+  uint64_t num_processed_detaches_;
+
+  // Used only by the worker thread.
+  EntriesMap entries_;
+  TimerQueue timers_;
+  SharedSocketsMap shared_sockets_;
+  ReceiveBatch batch_;
+  std::vector<ReceivedPacket> packets_;
+  std::vector<Entry*> receivers_;
+};
+
+#if defined(_WIN32)
+DWORD WINAPI ReactorWorkerThreadFunc(void* worker_typeless) {
+  ReactorWorker* worker = (ReactorWorker*)worker_typeless;
+  worker->ThreadFunc();
+
+  return 0;
+}
+#else
+void* ReactorWorkerThreadFunc(void* worker_typeless) {
+  ReactorWorker* worker = (ReactorWorker*)worker_typeless;
+  worker->ThreadFunc();
+
+  return 0;
+}
+#endif
+
+class PeerReactorEnv {
+ public:
+  ~PeerReactorEnv() { Stop(); }
+
+  bool Start(int num_threads) {
+    for (int i = 0; i < num_threads; ++i) {
+      ReactorWorker* worker = new ReactorWorker();
+      if (!worker->Init()) {
+        delete worker;
+        Stop();
+        return false;
+      }
+
+      workers_.push_back(worker);
+      num_envs_.push_back(0);
+      threads_.push_back(
+          new MinimalisticThread(ReactorWorkerThreadFunc, worker));
     }
-    std::string user_data = user_data_;
-    if (!under_lock) {
-      lock_.Unlock();
+    return true;
+  }
+
+  // Attaches the env to a worker. Envs that receive on the same port share
+  // one binding socket and are attached to the worker that receives from it,
+  // other envs go to the worker with the least number of envs. The env should
+  // have the reference for the reactor. Returns false if the binding socket
+  // can't be created, the env is not attached then.
+  bool Attach(PeerEnv* env, PeerParameters parameters) {
+    lock_.Lock();
+
+    AttachedEnv attached_env;
+    attached_env.port = -1;
+    SocketType binding_sock = kInvalidSocket;
+
+    if (ReceivesPackets(parameters)) {
+      PortsMap::iterator find_it = ports_.find(parameters.port());
+      if (find_it == ports_.end()) {
+        SocketType sock = OpenBindingSocket(parameters.port());
+        if (sock == kInvalidSocket) {
+          lock_.Unlock();
+          return false;
+        }
+        SetSocketNonBlocking(sock);
+
+        BindingSocket binding_socket;
+        binding_socket.sock = sock;
+        binding_socket.worker = leastLoadedWorker();
+        binding_socket.num_envs = 0;
+        find_it = ports_.insert(std::make_pair(parameters.port(),
+                                               binding_socket))
+                      .first;
+      }
+
+      if (parameters.can_use_multicast()) {
+        std::vector<NetworkInterface> interfaces;
+        if (parameters.use_all_interfaces()) {
+          interfaces = ListNetworkInterfaces();
+        }
+        JoinMulticastGroup(find_it->second.sock, parameters, interfaces);
+      }
+
+      ++find_it->second.num_envs;
+      attached_env.port = parameters.port();
+      attached_env.worker = find_it->second.worker;
+      binding_sock = find_it->second.sock;
+    } else {
+      attached_env.worker = leastLoadedWorker();
     }
 
-    Packet packet;
-    packet.set_packet_type(packet_type);
-    packet.set_application_id(parameters_.application_id());
-    packet.set_peer_id(peer_id_);
-    packet.set_snapshot_index(packet_index_);
-    packet.SwapUserData(user_data);
+    ++num_envs_[attached_env.worker];
+    attached_envs_[env] = attached_env;
 
-    ++packet_index_;
+    env->SetPollRequester(workers_[attached_env.worker]);
+    workers_[attached_env.worker]->Attach(env, binding_sock);
+
+    lock_.Unlock();
+    return true;
+  }
 
-    std::string packet_data;
-    if (!packet.Serialize(protocol_version, packet_data)) {
+  // Releases the env inline if the reactor is stopped already. Otherwise the
+  // worker releases it, the worker can't exit before that since Stop() takes
+  // the workers under lock_.
+  void Detach(PeerEnv* env, bool wait) {
+    lock_.Lock();
+    AttachedEnvsMap::iterator find_it = attached_envs_.find(env);
+    if (find_it == attached_envs_.end()) {
+      lock_.Unlock();
+      env->ReleaseExternal();
       return;
     }
 
-    sockaddr_in addr;
-    memset((char*)&addr, 0, sizeof(sockaddr_in));
+    AttachedEnv attached_env = find_it->second;
+    attached_envs_.erase(find_it);
+    --num_envs_[attached_env.worker];
 
-    if (parameters_.can_use_broadcast()) {
-      addr.sin_family = AF_INET;
-      addr.sin_port = htons(parameters_.port());
-      addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    // The worker closes the socket after the last env is detached, a new env
+    // on this port gets a new socket.
+    if (attached_env.port >= 0) {
+      PortsMap::iterator port_it = ports_.find(attached_env.port);
+      if (--port_it->second.num_envs == 0) {
+        ports_.erase(port_it);
+      }
     }
 
-    if (parameters_.can_use_multicast()) {
-      addr.sin_family = AF_INET;
-      addr.sin_port = htons(parameters_.port());
-      addr.sin_addr.s_addr = htonl(parameters_.multicast_group_address());
-    }
+    workers_[attached_env.worker]->Detach(env, wait);
+    lock_.Unlock();
+  }
+
+  void Stop() {
+    std::vector<ReactorWorker*> workers;
+    std::vector<MinimalisticThread*> threads;
+
+    lock_.Lock();
+    workers.swap(workers_);
+    threads.swap(threads_);
+    num_envs_.clear();
+    attached_envs_.clear();
+    ports_.clear();
+    lock_.Unlock();
 
-    sendto(sock_, packet_data.data(), packet_data.size(), 0,
-           (struct sockaddr*)&addr, sizeof(sockaddr_in));
+    for (size_t i = 0; i < workers.size(); ++i) {
+      workers[i]->Exit();
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+      threads[i]->Join();
+      delete threads[i];
+    }
+    for (size_t i = 0; i < workers.size(); ++i) {
+      delete workers[i];
+    }
   }
 
+  bool started() const { return !workers_.empty(); }
+
  private:
-  PeerParameters parameters_;
-  uint32_t peer_id_;
-  SocketType binding_sock_;
-  SocketType sock_;
-  uint64_t packet_index_;
+  struct AttachedEnv {
+    size_t worker;
+    // -1 if the env doesn't use a binding socket.
+    int port;
+  };
+
+  struct BindingSocket {
+    SocketType sock;
+    size_t worker;
+    int num_envs;
+  };
+
+  typedef std::map<PeerEnv*, AttachedEnv> AttachedEnvsMap;
+  typedef std::map<int, BindingSocket> PortsMap;
+
+  // Should be called under lock_.
+  size_t leastLoadedWorker() const {
+    size_t index = 0;
+    for (size_t i = 1; i < workers_.size(); ++i) {
+      if (num_envs_[i] < num_envs_[index]) {
+        index = i;
+      }
+    }
+    return index;
+  }
 
+ private:
   MinimalisticMutex lock_;
-  int ref_count_;
-  bool exit_;
-  std::string user_data_;
-  std::list<DiscoveredPeer> discovered_peers_;
+  std::vector<ReactorWorker*> workers_;
+  std::vector<MinimalisticThread*> threads_;
+  std::vector<int> num_envs_;
+  AttachedEnvsMap attached_envs_;
+  PortsMap ports_;
 };
 
 #if defined(_WIN32)
@@ -611,6 +3363,38 @@ void* SendingThreadFunc(void* env_typeless) {
 }
 #endif
 
+#if defined(_WIN32)
+DWORD WINAPI DispatchingThreadFunc(void* env_typeless) {
+  PeerEnv* env = (PeerEnv*)env_typeless;
+  env->DispatchingThreadFunc();
+
+  return 0;
+}
+#else
+void* DispatchingThreadFunc(void* env_typeless) {
+  PeerEnv* env = (PeerEnv*)env_typeless;
+  env->DispatchingThreadFunc();
+
+  return 0;
+}
+#endif
+
+#if defined(_WIN32)
+DWORD WINAPI EventLoopThreadFunc(void* env_typeless) {
+  PeerEnv* env = (PeerEnv*)env_typeless;
+  env->EventLoopThreadFunc();
+
+  return 0;
+}
+#else
+void* EventLoopThreadFunc(void* env_typeless) {
+  PeerEnv* env = (PeerEnv*)env_typeless;
+  env->EventLoopThreadFunc();
+
+  return 0;
+}
+#endif
+
 #if defined(_WIN32)
 DWORD WINAPI ReceivingThreadFunc(void* env_typeless) {
   PeerEnv* env = (PeerEnv*)env_typeless;
@@ -628,34 +3412,177 @@ void* ReceivingThreadFunc(void* env_typeless) {
 #endif
 };  // namespace impl
 
-Peer::Peer() : env_(0), sending_thread_(0), receiving_thread_(0) {}
+DiscoveredPeersSnapshot::DiscoveredPeersSnapshot() : data_(0) {}
+
+DiscoveredPeersSnapshot::DiscoveredPeersSnapshot(
+    impl::DiscoveredPeersSnapshotData* data)
+    : data_(data) {}
+
+DiscoveredPeersSnapshot::DiscoveredPeersSnapshot(
+    const DiscoveredPeersSnapshot& rhv)
+    : data_(rhv.data_) {
+  if (data_) {
+    impl::AtomicIncrement(&data_->ref_count);
+  }
+}
+
+DiscoveredPeersSnapshot& DiscoveredPeersSnapshot::operator=(
+    const DiscoveredPeersSnapshot& rhv) {
+  if (rhv.data_) {
+    impl::AtomicIncrement(&rhv.data_->ref_count);
+  }
+  impl::ReleaseSnapshotData(data_);
+  data_ = rhv.data_;
+  return *this;
+}
+
+DiscoveredPeersSnapshot::~DiscoveredPeersSnapshot() {
+  impl::ReleaseSnapshotData(data_);
+}
+
+static const std::list<DiscoveredPeer> kNoDiscoveredPeers;
+
+const std::list<DiscoveredPeer>& DiscoveredPeersSnapshot::peers() const {
+  if (!data_) {
+    return kNoDiscoveredPeers;
+  }
+  return data_->peers;
+}
+
+PeerReactor::PeerReactor() : env_(new impl::PeerReactorEnv()) {}
+
+PeerReactor::~PeerReactor() { delete env_; }
+
+bool PeerReactor::Start(int num_threads) {
+  Stop();
+
+  if (num_threads <= 0) {
+    return false;
+  }
+
+  InitSockets();
+
+  return env_->Start(num_threads);
+}
+
+void PeerReactor::Stop() { env_->Stop(); }
+
+Peer::Peer()
+    : env_(0),
+      reactor_(0),
+      sending_thread_(0),
+      dispatching_thread_(0) {}
 
 Peer::~Peer() { Stop(false); }
 
 bool Peer::Start(const PeerParameters& parameters,
                  const std::string& user_data) {
+  return Start(parameters, user_data, 0);
+}
+
+bool Peer::Start(const PeerParameters& parameters, const std::string& user_data,
+                 PeerObserver* observer) {
+  return Start(parameters, user_data, observer, 0);
+}
+
+bool Peer::Start(const PeerParameters& parameters, const std::string& user_data,
+                 PeerObserver* observer, PeerReactor* reactor) {
   Stop(false);
 
+  if (reactor && !reactor->env_->started()) {
+    std::cerr << "udpdiscovery::Peer reactor is not started." << std::endl;
+    return false;
+  }
+
+  // The reactor polls the env as an external event loop.
+  PeerParameters env_parameters = parameters;
+  if (reactor) {
+    env_parameters.set_engine_mode(PeerParameters::kEngineExternal);
+  }
+
+  // Peers of the reactor receive from the binding socket of the reactor.
   impl::PeerEnv* env = new impl::PeerEnv();
-  if (!env->Start(parameters, user_data)) {
+  if (!env->Start(env_parameters, user_data, observer,
+                  /* open_binding_socket= */ reactor == 0)) {
     delete env;
     env = 0;
 
     return false;
   }
 
+  // References are taken before threads start, otherwise a thread that exits
+  // early could destroy env while other threads are starting.
+  if (reactor) {
+    // The reference of the reactor, released by the reactor after Stop().
+    env->IncreaseRefCount();
+    if (!reactor->env_->Attach(env, env_parameters)) {
+      // Not used by any thread yet.
+      delete env;
+      return false;
+    }
+    env_ = env;
+    reactor_ = reactor->env_;
+    return true;
+  }
+
   env_ = env;
 
-  sending_thread_ = new impl::MinimalisticThread(impl::SendingThreadFunc, env_);
+  if (parameters.engine_mode() == PeerParameters::kEngineExternal) {
+    // The reference of the user, released by Stop().
+    env->IncreaseRefCount();
+    return true;
+  }
 
-  if (parameters.can_discover()) {
-    receiving_thread_ =
-        new impl::MinimalisticThread(impl::ReceivingThreadFunc, env_);
+  if (parameters.engine_mode() == PeerParameters::kEngineEventLoop) {
+    // The only thread both sends and receives.
+    env->IncreaseRefCount();
+    sending_thread_ =
+        new impl::MinimalisticThread(impl::EventLoopThreadFunc, env_);
+  } else {
+    env->IncreaseRefCount();
+    sending_thread_ =
+        new impl::MinimalisticThread(impl::SendingThreadFunc, env_);
+  }
+
+  if (ReceivesPackets(parameters) &&
+      parameters.engine_mode() == PeerParameters::kEngineThreads) {
+    for (int i = 0; i < env->num_receive_workers(); ++i) {
+      env->IncreaseRefCount();
+      receiving_threads_.push_back(
+          new impl::MinimalisticThread(impl::ReceivingThreadFunc, env_));
+    }
+  }
+
+  if (observer && parameters.observer_dispatch_mode() ==
+                      PeerParameters::kObserverDispatchThread) {
+    env->IncreaseRefCount();
+    dispatching_thread_ =
+        new impl::MinimalisticThread(impl::DispatchingThreadFunc, env_);
   }
 
   return true;
 }
 
+bool Peer::ReceiveSocket(NativeSocket& socket_out) const {
+  if (!env_) {
+    return false;
+  }
+  return env_->ReceiveSocket(socket_out);
+}
+
+long Peer::NextDeadline() const {
+  if (!env_) {
+    return -1;
+  }
+  return env_->NextDeadline();
+}
+
+void Peer::Poll(long now) {
+  if (env_) {
+    env_->Poll(now);
+  }
+}
+
 void Peer::SetUserData(const std::string& user_data) {
   if (env_) {
     env_->SetUserData(user_data);
@@ -670,6 +3597,45 @@ std::list<DiscoveredPeer> Peer::ListDiscovered() const {
   return result;
 }
 
+DiscoveredPeersSnapshot Peer::Snapshot() const {
+  if (!env_) {
+    return DiscoveredPeersSnapshot();
+  }
+  return env_->Snapshot();
+}
+
+DiscoveredPeersChanges Peer::ListChangesSince(uint64_t generation) const {
+  if (!env_) {
+    DiscoveredPeersChanges result;
+    result.set_full_resync(true);
+    return result;
+  }
+  return env_->ListChangesSince(generation);
+}
+
+std::list<DestinationStats> Peer::ListDestinationStats() const {
+  std::list<DestinationStats> result;
+  if (env_) {
+    result = env_->ListDestinationStats();
+  }
+  return result;
+}
+
+PeerStats Peer::GetStats() const {
+  if (!env_) {
+    return PeerStats();
+  }
+  return env_->GetStats();
+}
+
+bool Peer::FindDiscovered(const IpPort& ip_port,
+                          DiscoveredPeer& discovered_peer_out) const {
+  if (!env_) {
+    return false;
+  }
+  return env_->FindDiscovered(ip_port, discovered_peer_out);
+}
+
 void Peer::Stop() { Stop(/* wait_for_threads= */ false); }
 
 void Peer::StopAndWaitForThreads() { Stop(/* wait_for_threads= */ true); }
@@ -681,8 +3647,13 @@ void Peer::Stop(bool wait_for_threads) {
 
   env_->Exit();
 
+  if (reactor_) {
+    reactor_->Detach(static_cast<impl::PeerEnv*>(env_), wait_for_threads);
+    reactor_ = 0;
+  }
+
   // Threads live longer than the object itself. So env will be deleted in one
-  // of the threads.
+  // of the threads, by the reactor or by Exit() if there are no threads.
   env_ = 0;
 
   if (wait_for_threads) {
@@ -690,23 +3661,35 @@ void Peer::Stop(bool wait_for_threads) {
       sending_thread_->Join();
     }
 
-    if (receiving_thread_) {
-      receiving_thread_->Join();
+    for (size_t i = 0; i < receiving_threads_.size(); ++i) {
+      receiving_threads_[i]->Join();
+    }
+
+    if (dispatching_thread_) {
+      dispatching_thread_->Join();
     }
   } else {
     if (sending_thread_) {
       sending_thread_->Detach();
     }
 
-    if (receiving_thread_) {
-      receiving_thread_->Detach();
+    for (size_t i = 0; i < receiving_threads_.size(); ++i) {
+      receiving_threads_[i]->Detach();
+    }
+
+    if (dispatching_thread_) {
+      dispatching_thread_->Detach();
     }
   }
 
   delete sending_thread_;
   sending_thread_ = 0;
-  delete receiving_thread_;
-  receiving_thread_ = 0;
+  for (size_t i = 0; i < receiving_threads_.size(); ++i) {
+    delete receiving_threads_[i];
+  }
+  receiving_threads_.clear();
+  delete dispatching_thread_;
+  dispatching_thread_ = 0;
 }
 
 bool Same(PeerParameters::SamePeerMode mode, const IpPort& lhv,
@@ -1,17 +1,115 @@
 #ifndef __UDP_DISCOVERY_PEER_H_
 #define __UDP_DISCOVERY_PEER_H_
 
+#include <stdint.h>
+
 #include <list>
+#include <vector>
 
 #include "udp_discovery_discovered_peer.hpp"
 #include "udp_discovery_peer_parameters.hpp"
+#include "udp_discovery_peer_stats.hpp"
 
 namespace udpdiscovery {
+#if defined(_WIN32)
+// SOCKET.
+typedef uintptr_t NativeSocket;
+#else
+typedef int NativeSocket;
+#endif
+
 namespace impl {
 long NowTime();
 
 void SleepFor(long time_ms);
 
+class PeerEnv;
+
+class PeerReactorEnv;
+
+struct DiscoveredPeersSnapshotData {
+  DiscoveredPeersSnapshotData() : ref_count(1) {}
+
+  volatile long ref_count;
+  std::list<DiscoveredPeer> peers;
+};
+}  // namespace impl
+
+/**
+ * \brief Immutable reference counted list of discovered peers. Copying the
+ * snapshot does not copy the peers. Snapshots stay valid after the peer that
+ * created them is stopped.
+ */
+class DiscoveredPeersSnapshot {
+ public:
+  DiscoveredPeersSnapshot();
+  DiscoveredPeersSnapshot(const DiscoveredPeersSnapshot& rhv);
+  DiscoveredPeersSnapshot& operator=(const DiscoveredPeersSnapshot& rhv);
+  ~DiscoveredPeersSnapshot();
+
+  const std::list<DiscoveredPeer>& peers() const;
+
+ private:
+  friend class impl::PeerEnv;
+
+  // Takes ownership of one reference of data.
+  explicit DiscoveredPeersSnapshot(impl::DiscoveredPeersSnapshotData* data);
+
+ private:
+  impl::DiscoveredPeersSnapshotData* data_;
+};
+
+/**
+ * \brief Receives membership changes of a started discovery peer. Callbacks are
+ * never called concurrently. Callbacks should not call Stop() of the peer.
+ */
+class PeerObserver {
+ public:
+  virtual ~PeerObserver() {}
+
+  /**
+   * \brief A new peer is discovered.
+   */
+  virtual void OnPeerJoined(const DiscoveredPeer& /* peer */) {}
+
+  /**
+   * \brief A discovered peer changed its user data.
+   */
+  virtual void OnPeerUserDataChanged(const DiscoveredPeer& /* peer */) {}
+
+  /**
+   * \brief A discovered peer sent kPacketIAmOutOfHere or was not heard of for
+   * more than PeerParameters::discovered_peer_ttl_ms().
+   */
+  virtual void OnPeerLeft(const DiscoveredPeer& /* peer */) {}
+};
+
+/**
+ * \brief Runs many peers on a fixed number of threads. Peers started with the
+ * reactor don't create threads of their own, the threads of the reactor wait
+ * for sockets and timers of all attached peers at once. All peers should be
+ * stopped before the reactor is stopped or destroyed.
+ */
+class PeerReactor {
+ public:
+  PeerReactor();
+  ~PeerReactor();
+
+  bool Start(int num_threads);
+
+  void Stop();
+
+ private:
+  PeerReactor(const PeerReactor&);
+  PeerReactor& operator=(const PeerReactor&);
+
+  friend class Peer;
+
+ private:
+  impl::PeerReactorEnv* env_;
+};
+
+namespace impl {
 class PeerEnvInterface {
  public:
   virtual ~PeerEnvInterface() {}
@@ -20,6 +118,23 @@ class PeerEnvInterface {
 
   virtual std::list<DiscoveredPeer> ListDiscovered() = 0;
 
+  virtual DiscoveredPeersSnapshot Snapshot() = 0;
+
+  virtual DiscoveredPeersChanges ListChangesSince(uint64_t generation) = 0;
+
+  virtual std::list<DestinationStats> ListDestinationStats() = 0;
+
+  virtual PeerStats GetStats() = 0;
+
+  virtual bool FindDiscovered(const IpPort& ip_port,
+                              DiscoveredPeer& discovered_peer_out) = 0;
+
+  virtual bool ReceiveSocket(NativeSocket& socket_out) = 0;
+
+  virtual long NextDeadline() = 0;
+
+  virtual void Poll(long now) = 0;
+
   virtual void Exit() = 0;
 };
 
@@ -39,10 +154,28 @@ class Peer {
   ~Peer();
 
   /**
-   * \brief Starts discovery peeer.
+   * \brief Starts discovery peer.
    */
   bool Start(const PeerParameters& parameters, const std::string& user_data);
 
+  /**
+   * \brief Starts discovery peer that reports membership changes to the
+   * observer. PeerParameters::observer_dispatch_mode() chooses the thread that
+   * calls the observer. The observer should outlive the peer, after Stop()
+   * returns the observer is not called anymore.
+   */
+  bool Start(const PeerParameters& parameters, const std::string& user_data,
+             PeerObserver* observer);
+
+  /**
+   * \brief Starts discovery peer on the threads of the started reactor. The
+   * peer works as with PeerParameters::kEngineExternal and the reactor calls
+   * Poll(). The observer is called by a thread of the reactor. The reactor
+   * should outlive the peer.
+   */
+  bool Start(const PeerParameters& parameters, const std::string& user_data,
+             PeerObserver* observer, PeerReactor* reactor);
+
   /**
    * \brief Sets user data of the started discovery peer.
    */
@@ -53,6 +186,67 @@ class Peer {
    */
   std::list<DiscoveredPeer> ListDiscovered() const;
 
+  /**
+   * \brief Returns the current snapshot of discovered peers. Doesn't take
+   * locks and doesn't copy the peers, so it is cheap to call often and from
+   * many threads. A new snapshot is published when a peer appears, changes
+   * user data or disappears, so last_updated() of peers in the snapshot is the
+   * time of the last such change.
+   */
+  DiscoveredPeersSnapshot Snapshot() const;
+
+  /**
+   * \brief Lists changes of discovered peers made after the given generation.
+   * Start with generation 0 and then pass DiscoveredPeersChanges::generation()
+   * of the previous result. If the requested changes are not kept anymore
+   * (see PeerParameters::changes_log_size()) the result is a full resync.
+   */
+  DiscoveredPeersChanges ListChangesSince(uint64_t generation) const;
+
+  /**
+   * \brief Finds one discovered peer without copying the whole list. Peers
+   * are compared according to PeerParameters::same_peer_mode(). Returns false
+   * if there is no such peer.
+   */
+  bool FindDiscovered(const IpPort& ip_port,
+                      DiscoveredPeer& discovered_peer_out) const;
+
+  /**
+   * \brief Lists destinations of announcements with the number of sent
+   * datagrams and send errors per destination.
+   */
+  std::list<DestinationStats> ListDestinationStats() const;
+
+  /**
+   * \brief Returns counters of received and sent datagrams and of changes of
+   * discovered peers. Reads a few atomic counters without locks.
+   */
+  PeerStats GetStats() const;
+
+  /**
+   * \brief Returns the socket that receives discovery packets when the peer is
+   * started with PeerParameters::kEngineExternal. Poll() should be called when
+   * the socket is readable. Returns false if the peer doesn't discover.
+   */
+  bool ReceiveSocket(NativeSocket& socket_out) const;
+
+  /**
+   * \brief Returns the time in impl::NowTime() milliseconds when Poll() should
+   * be called next or -1 if there is nothing to wait for. Used with
+   * PeerParameters::kEngineExternal.
+   */
+  long NextDeadline() const;
+
+  /**
+   * \brief Receives available packets, sends announcements and removes
+   * expired peers if it is time. Never blocks. Used with
+   * PeerParameters::kEngineExternal and should be called from one thread, the
+   * same that calls Stop(). Call Poll() after SetUserData() to announce the
+   * change immediately. Does nothing with other engines or a reactor. If
+   * more packets are left than one call receives NextDeadline() is now.
+   */
+  void Poll(long now);
+
   /**
    * \brief Stops discovery peer immediately. Working threads will finish
    * execution lately.
@@ -80,8 +274,10 @@ class Peer {
 
  private:
   impl::PeerEnvInterface* env_;
+  impl::PeerReactorEnv* reactor_;
   impl::MinimalisticThreadInterface* sending_thread_;
-  impl::MinimalisticThreadInterface* receiving_thread_;
+  std::vector<impl::MinimalisticThreadInterface*> receiving_threads_;
+  impl::MinimalisticThreadInterface* dispatching_thread_;
 };
 
 bool Same(PeerParameters::SamePeerMode mode, const IpPort& lhv,
@@ -0,0 +1,921 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <new>
+#include <string>
+#include <vector>
+
+#include "udp_discovery_atomic.hpp"
+#include "udp_discovery_peer.hpp"
+#include "udp_discovery_protocol.hpp"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <windows.h>
+typedef SOCKET SocketType;
+typedef int AddressLenType;
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+typedef int SocketType;
+typedef socklen_t AddressLenType;
+#endif
+
+const int kPort = 12031;
+const uint32_t kApplicationId = 7681413;
+const unsigned int kLocalhost = (127 << 24) + 1;
+
+// Counts heap allocations of the whole process.
+static volatile long num_allocations = 0;
+
+void* operator new(size_t size) throw(std::bad_alloc) {
+  udpdiscovery::impl::AtomicIncrement(&num_allocations);
+  void* p = malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) throw() { free(p); }
+
+static void CloseSocket(SocketType sock) {
+#if defined(_WIN32)
+  closesocket(sock);
+#else
+  close(sock);
+#endif
+}
+
+// Sends kPacketIAmHere packets from many sockets so the discovering peer sees
+// many different peers.
+class FakePeers {
+ public:
+  FakePeers(int num_peers, const std::string& user_data,
+            uint32_t application_id = kApplicationId) {
+    for (int i = 0; i < num_peers; ++i) {
+      SocketType sock = socket(AF_INET, SOCK_DGRAM, 0);
+      int value = 1;
+      setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (const char*)&value,
+                 sizeof(value));
+      socks_.push_back(sock);
+    }
+
+    udpdiscovery::Packet packet;
+    packet.set_packet_type(udpdiscovery::kPacketIAmHere);
+    packet.set_application_id(application_id);
+    packet.set_peer_id(1);
+    packet.set_snapshot_index(0);
+    packet.set_user_data(user_data);
+    packet.Serialize(udpdiscovery::kProtocolVersion1, packet_data_);
+  }
+
+  ~FakePeers() {
+    for (size_t i = 0; i < socks_.size(); ++i) {
+      CloseSocket(socks_[i]);
+    }
+  }
+
+  void Announce(unsigned int ip = kLocalhost) {
+    sockaddr_in addr;
+    memset((char*)&addr, 0, sizeof(sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(ip);
+
+    for (size_t i = 0; i < socks_.size(); ++i) {
+      sendto(socks_[i], packet_data_.data(), (int)packet_data_.size(), 0,
+             (struct sockaddr*)&addr, sizeof(sockaddr_in));
+    }
+  }
+
+ private:
+  std::vector<SocketType> socks_;
+  std::string packet_data_;
+};
+
+class BenchmarkThread {
+ public:
+  BenchmarkThread(void (*f)(void*), void* arg) : f_(f), arg_(arg) {
+#if defined(_WIN32)
+    thread_ = CreateThread(NULL, 0, ThreadFunc, this, 0, NULL);
+#else
+    pthread_create(&thread_, 0, ThreadFunc, this);
+#endif
+  }
+
+  void Join() {
+#if defined(_WIN32)
+    WaitForSingleObject(thread_, INFINITE);
+    CloseHandle(thread_);
+#else
+    pthread_join(thread_, 0);
+#endif
+  }
+
+ private:
+#if defined(_WIN32)
+  static DWORD WINAPI ThreadFunc(void* self) {
+    ((BenchmarkThread*)self)->f_(((BenchmarkThread*)self)->arg_);
+    return 0;
+  }
+#else
+  static void* ThreadFunc(void* self) {
+    ((BenchmarkThread*)self)->f_(((BenchmarkThread*)self)->arg_);
+    return 0;
+  }
+#endif
+
+  void (*f_)(void*);
+  void* arg_;
+#if defined(_WIN32)
+  HANDLE thread_;
+#else
+  pthread_t thread_;
+#endif
+};
+
+struct ReaderArgs {
+  udpdiscovery::Peer* peer;
+  bool use_snapshot;
+  long duration_ms;
+  long num_reads;
+  size_t num_peers_seen;
+};
+
+static void ReaderFunc(void* args_typeless) {
+  ReaderArgs* args = (ReaderArgs*)args_typeless;
+
+  long start_time = udpdiscovery::impl::NowTime();
+  long num_reads = 0;
+  size_t num_peers_seen = 0;
+  while (true) {
+    for (int i = 0; i < 100; ++i) {
+      if (args->use_snapshot) {
+        udpdiscovery::DiscoveredPeersSnapshot snapshot =
+            args->peer->Snapshot();
+        num_peers_seen += snapshot.peers().size();
+      } else {
+        num_peers_seen += args->peer->ListDiscovered().size();
+      }
+    }
+    num_reads += 100;
+
+    if (udpdiscovery::impl::NowTime() - start_time >= args->duration_ms) {
+      break;
+    }
+  }
+
+  args->num_reads = num_reads;
+  args->num_peers_seen = num_peers_seen;
+}
+
+static double MeasureReaders(udpdiscovery::Peer& peer, int num_threads,
+                             bool use_snapshot) {
+  const long kDurationMs = 300;
+
+  std::vector<ReaderArgs> args(num_threads);
+  std::vector<BenchmarkThread*> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    args[i].peer = &peer;
+    args[i].use_snapshot = use_snapshot;
+    args[i].duration_ms = kDurationMs;
+    args[i].num_reads = 0;
+    args[i].num_peers_seen = 0;
+    threads.push_back(new BenchmarkThread(ReaderFunc, &args[i]));
+  }
+
+  long num_reads = 0;
+  for (int i = 0; i < num_threads; ++i) {
+    threads[i]->Join();
+    delete threads[i];
+    num_reads += args[i].num_reads;
+  }
+
+  return (double)num_reads * 1000.0 / kDurationMs;
+}
+
+// Measures how many reads of the discovered peers per second all reader threads
+// manage while the receiving thread is busy with incoming packets.
+void benchmark_ReadersScaling() {
+  const int kNumPeers = 200;
+
+  udpdiscovery::PeerParameters parameters;
+  parameters.set_can_discover(true);
+  parameters.set_port(kPort);
+  parameters.set_application_id(kApplicationId);
+
+  udpdiscovery::Peer peer;
+  peer.Start(parameters, "");
+
+  FakePeers fake_peers(kNumPeers, std::string(100, 'x'));
+  fake_peers.Announce();
+  udpdiscovery::impl::SleepFor(200);
+
+  printf("ReadersScaling: %d peers discovered\n",
+         (int)peer.Snapshot().peers().size());
+  printf("%8s %20s %20s\n", "threads", "ListDiscovered/s", "Snapshot/s");
+
+  for (int num_threads = 1; num_threads <= 8; num_threads *= 2) {
+    fake_peers.Announce();
+    double list_reads = MeasureReaders(peer, num_threads, false);
+    fake_peers.Announce();
+    double snapshot_reads = MeasureReaders(peer, num_threads, true);
+
+    printf("%8d %20.0f %20.0f\n", num_threads, list_reads, snapshot_reads);
+  }
+
+  peer.StopAndWaitForThreads();
+}
+
+// Simulates an announcement storm: many peers announce at once. Measures how
+// long it takes the discovering peer to see all of them for different
+// receive batch sizes.
+void benchmark_IngestStorm() {
+  const int kNumPeers = 500;
+  const int kNumRounds = 20;
+
+  FakePeers fake_peers(kNumPeers, std::string(100, 'x'));
+
+  printf("IngestStorm: %d peers, %d announcements each\n", kNumPeers,
+         kNumRounds);
+  printf("%12s %12s %16s\n", "batch size", "discovered", "time to all, ms");
+
+  for (int batch_size = 1; batch_size <= 64; batch_size *= 4) {
+    udpdiscovery::PeerParameters parameters;
+    parameters.set_can_discover(true);
+    parameters.set_port(kPort);
+    parameters.set_application_id(kApplicationId);
+    parameters.set_receive_batch_size(batch_size);
+
+    udpdiscovery::Peer peer;
+    peer.Start(parameters, "");
+    udpdiscovery::impl::SleepFor(100);
+
+    long start_time = udpdiscovery::impl::NowTime();
+    for (int i = 0; i < kNumRounds; ++i) {
+      fake_peers.Announce();
+    }
+
+    size_t num_discovered = 0;
+    long time_to_all = -1;
+    while (udpdiscovery::impl::NowTime() - start_time < 2000) {
+      num_discovered = peer.Snapshot().peers().size();
+      if (num_discovered == kNumPeers) {
+        time_to_all = udpdiscovery::impl::NowTime() - start_time;
+        break;
+      }
+      udpdiscovery::impl::SleepFor(1);
+    }
+
+    printf("%12d %12d %16ld\n", batch_size, (int)num_discovered, time_to_all);
+
+    peer.StopAndWaitForThreads();
+  }
+}
+
+// Measures heap allocations of the receiving thread per received packet when
+// all peers are already discovered and announce the same user data.
+void benchmark_ReceiveAllocations() {
+  const int kNumPeers = 100;
+  const int kNumRounds = 50;
+
+  udpdiscovery::PeerParameters parameters;
+  parameters.set_can_discover(true);
+  parameters.set_port(kPort);
+  parameters.set_application_id(kApplicationId);
+
+  udpdiscovery::Peer peer;
+  peer.Start(parameters, "");
+
+  FakePeers fake_peers(kNumPeers, std::string(100, 'x'));
+  fake_peers.Announce();
+  udpdiscovery::impl::SleepFor(200);
+
+  size_t num_discovered = peer.Snapshot().peers().size();
+
+  long allocations_before = udpdiscovery::impl::AtomicLoad(&num_allocations);
+  for (int i = 0; i < kNumRounds; ++i) {
+    fake_peers.Announce();
+    udpdiscovery::impl::SleepFor(1);
+  }
+  udpdiscovery::impl::SleepFor(200);
+  long allocations =
+      udpdiscovery::impl::AtomicLoad(&num_allocations) - allocations_before;
+
+  printf("ReceiveAllocations: %d peers discovered\n", (int)num_discovered);
+  printf("%12s %12s %20s\n", "packets", "allocations", "allocations/packet");
+  printf("%12d %12ld %20.3f\n", kNumPeers * kNumRounds, allocations,
+         (double)allocations / (kNumPeers * kNumRounds));
+
+  peer.StopAndWaitForThreads();
+}
+
+static uint64_t SentPackets(const udpdiscovery::Peer& peer) {
+  uint64_t result = 0;
+  std::list<udpdiscovery::DestinationStats> stats = peer.ListDestinationStats();
+  for (std::list<udpdiscovery::DestinationStats>::const_iterator it =
+           stats.begin();
+       it != stats.end(); ++it) {
+    result += (*it).packets_sent() + (*it).send_errors();
+  }
+  return result;
+}
+
+// Measures heap allocations of the sending thread per announcement when user
+// data doesn't change.
+void benchmark_SendAllocations() {
+  udpdiscovery::PeerParameters parameters;
+  parameters.set_can_be_discovered(true);
+  parameters.set_port(kPort);
+  parameters.set_application_id(kApplicationId);
+  parameters.set_send_timeout_ms(1);
+  parameters.set_can_use_broadcast(false);
+  parameters.add_unicast_target(udpdiscovery::IpPort(kLocalhost, 0));
+  parameters.set_supported_protocol_versions(udpdiscovery::kProtocolVersion0,
+                                             udpdiscovery::kProtocolVersion1);
+
+  udpdiscovery::Peer peer;
+  peer.Start(parameters, std::string(100, 'x'));
+  udpdiscovery::impl::SleepFor(100);
+
+  uint64_t sent_before = SentPackets(peer);
+  long allocations_before = udpdiscovery::impl::AtomicLoad(&num_allocations);
+  udpdiscovery::impl::SleepFor(500);
+  long allocations =
+      udpdiscovery::impl::AtomicLoad(&num_allocations) - allocations_before;
+  uint64_t sent = SentPackets(peer) - sent_before;
+
+  printf("SendAllocations\n");
+  printf("%12s %12s %20s\n", "packets", "allocations", "allocations/packet");
+  printf("%12d %12ld %20.3f\n", (int)sent, allocations,
+         sent ? (double)allocations / sent : 0.0);
+
+  peer.StopAndWaitForThreads();
+}
+
+static double NowSeconds() {
+#if defined(_WIN32)
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / frequency.QuadPart;
+#else
+  struct timeval now;
+  gettimeofday(&now, 0);
+  return now.tv_sec + now.tv_usec / 1000000.0;
+#endif
+}
+
+// Measures how long StopAndWaitForThreads takes for every engine mode when
+// nothing is received.
+void benchmark_StopLatency() {
+  const int kNumIterations = 5;
+
+  printf("StopLatency\n");
+  printf("%12s %16s %16s\n", "engine", "avg stop, ms", "max stop, ms");
+
+  for (int mode = udpdiscovery::PeerParameters::kEngineThreads;
+       mode <= udpdiscovery::PeerParameters::kEngineEventLoop; ++mode) {
+    double total_seconds = 0;
+    double max_seconds = 0;
+
+    for (int i = 0; i < kNumIterations; ++i) {
+      udpdiscovery::PeerParameters parameters;
+      parameters.set_can_discover(true);
+      parameters.set_can_be_discovered(true);
+      parameters.set_port(kPort);
+      parameters.set_application_id(kApplicationId);
+      parameters.set_engine_mode(
+          (udpdiscovery::PeerParameters::EngineMode)mode);
+      // Announcements go to another port, otherwise the own kPacketIAmOutOfHere
+      // packet wakes up the receiving thread.
+      parameters.set_can_use_broadcast(false);
+      parameters.add_unicast_target(
+          udpdiscovery::IpPort(kLocalhost, kPort + 1));
+
+      udpdiscovery::Peer peer;
+      peer.Start(parameters, "");
+      udpdiscovery::impl::SleepFor(50 + 37 * i);
+
+      double start = NowSeconds();
+      peer.StopAndWaitForThreads();
+      double seconds = NowSeconds() - start;
+
+      total_seconds += seconds;
+      if (seconds > max_seconds) {
+        max_seconds = seconds;
+      }
+    }
+
+    printf("%12s %16.3f %16.3f\n",
+           mode == udpdiscovery::PeerParameters::kEngineThreads ? "threads"
+                                                                : "event loop",
+           total_seconds * 1000 / kNumIterations, max_seconds * 1000);
+  }
+}
+
+// Reads a "Name:   value" field of /proc/self/status, -1 if not available.
+static long ReadProcStatus(const char* name) {
+  long value = -1;
+#if defined(__linux__)
+  FILE* f = fopen("/proc/self/status", "r");
+  if (!f) {
+    return -1;
+  }
+  size_t name_len = strlen(name);
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      value = atol(line + name_len + 1);
+      break;
+    }
+  }
+  fclose(f);
+#else
+  (void)name;
+#endif
+  return value;
+}
+
+// Reports threads and resident memory of the process with the given number
+// of running peers, each with its own application id, for peers with own
+// threads and for peers attached to a reactor.
+void benchmark_ReactorFootprint() {
+  const int kNumPeers[] = {1, 10, 100};
+  const int kReactorThreads = 2;
+
+  printf("ReactorFootprint\n");
+  printf("%12s %8s %10s %14s\n", "engine", "peers", "threads", "VmRSS, kB");
+
+  // Freed memory is not always returned to the system, so the reactor, that
+  // is expected to use less, goes first.
+  for (int reactor_mode = 1; reactor_mode >= 0; --reactor_mode) {
+    for (size_t n = 0; n < sizeof(kNumPeers) / sizeof(kNumPeers[0]); ++n) {
+      udpdiscovery::PeerReactor reactor;
+      if (reactor_mode) {
+        reactor.Start(kReactorThreads);
+      }
+
+      std::vector<udpdiscovery::Peer*> peers;
+      for (int i = 0; i < kNumPeers[n]; ++i) {
+        udpdiscovery::PeerParameters parameters;
+        parameters.set_can_discover(true);
+        parameters.set_can_be_discovered(true);
+        parameters.set_port(kPort);
+        parameters.set_application_id(kApplicationId + i);
+
+        udpdiscovery::Peer* peer = new udpdiscovery::Peer();
+        peer->Start(parameters, "", 0, reactor_mode ? &reactor : 0);
+        peers.push_back(peer);
+      }
+      udpdiscovery::impl::SleepFor(500);
+
+      long threads = ReadProcStatus("Threads");
+      long rss_kb = ReadProcStatus("VmRSS");
+      const char* engine = reactor_mode ? "reactor" : "threads";
+      if (threads < 0 || rss_kb < 0) {
+        printf("%12s %8d %10s %14s\n", engine, kNumPeers[n], "n/a", "n/a");
+      } else {
+        printf("%12s %8d %10ld %14ld\n", engine, kNumPeers[n], threads,
+               rss_kb);
+      }
+
+      for (size_t i = 0; i < peers.size(); ++i) {
+        peers[i]->StopAndWaitForThreads();
+        delete peers[i];
+      }
+      reactor.Stop();
+    }
+  }
+}
+
+// Broadcasts announcements of one application while many peers with
+// different application ids listen on the same port. Every peer of the
+// threads engine has its own socket that receives and parses a copy of every
+// datagram, the peers of the reactor share one socket.
+void benchmark_SharedSocketIngest() {
+  const int kNumListeners = 20;
+  const int kNumPeers = 200;
+  const int kNumRounds = 20;
+
+  FakePeers fake_peers(kNumPeers, std::string(100, 'x'));
+
+  printf("SharedSocketIngest: %d listeners, %d peers, %d announcements each\n",
+         kNumListeners, kNumPeers, kNumRounds);
+  printf("%12s %12s %16s %12s\n", "engine", "discovered", "time to all, ms",
+         "cpu, ms");
+
+  for (int reactor_mode = 0; reactor_mode < 2; ++reactor_mode) {
+    udpdiscovery::PeerReactor reactor;
+    if (reactor_mode) {
+      reactor.Start(1);
+    }
+
+    std::vector<udpdiscovery::Peer*> listeners;
+    for (int i = 0; i < kNumListeners; ++i) {
+      udpdiscovery::PeerParameters parameters;
+      parameters.set_can_discover(true);
+      parameters.set_port(kPort);
+      parameters.set_application_id(kApplicationId + i);
+      parameters.set_receive_batch_size(64);
+
+      udpdiscovery::Peer* listener = new udpdiscovery::Peer();
+      listener->Start(parameters, "", 0, reactor_mode ? &reactor : 0);
+      listeners.push_back(listener);
+    }
+    udpdiscovery::impl::SleepFor(100);
+
+    clock_t start_clock = clock();
+    long start_time = udpdiscovery::impl::NowTime();
+    for (int i = 0; i < kNumRounds; ++i) {
+      fake_peers.Announce(INADDR_BROADCAST);
+    }
+
+    size_t num_discovered = 0;
+    long time_to_all = -1;
+    while (udpdiscovery::impl::NowTime() - start_time < 2000) {
+      num_discovered = listeners[0]->Snapshot().peers().size();
+      if (num_discovered == kNumPeers) {
+        time_to_all = udpdiscovery::impl::NowTime() - start_time;
+        break;
+      }
+      udpdiscovery::impl::SleepFor(1);
+    }
+    // Let the other listeners drain their sockets.
+    udpdiscovery::impl::SleepFor(200);
+    double cpu_ms = (double)(clock() - start_clock) * 1000 / CLOCKS_PER_SEC;
+
+    printf("%12s %12d %16ld %12.1f\n", reactor_mode ? "reactor" : "threads",
+           (int)num_discovered, time_to_all, cpu_ms);
+
+    for (size_t i = 0; i < listeners.size(); ++i) {
+      listeners[i]->StopAndWaitForThreads();
+      delete listeners[i];
+    }
+    reactor.Stop();
+  }
+}
+
+struct LoadSenderArgs {
+  udpdiscovery::Peer* peer;
+  int num_peers;
+  long duration_ms;
+  long num_sent;
+};
+
+// Announces num_peers fake peers from their own sockets in rounds with
+// increasing snapshot indexes. The next round is sent after the peer applied
+// the last packet of the round, so datagrams are not dropped by full socket
+// buffers and num_sent is the number of processed packets.
+static void LoadSenderFunc(void* args_typeless) {
+  LoadSenderArgs* args = (LoadSenderArgs*)args_typeless;
+
+  std::vector<SocketType> socks;
+  for (int i = 0; i < args->num_peers; ++i) {
+    socks.push_back(socket(AF_INET, SOCK_DGRAM, 0));
+  }
+
+  sockaddr_in addr;
+  memset((char*)&addr, 0, sizeof(sockaddr_in));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(kPort);
+  addr.sin_addr.s_addr = htonl(kLocalhost);
+
+  udpdiscovery::Packet packet;
+  packet.set_packet_type(udpdiscovery::kPacketIAmHere);
+  packet.set_application_id(kApplicationId);
+  packet.set_peer_id(1);
+  packet.set_user_data(std::string(100, 'x'));
+  std::string packet_data;
+
+  udpdiscovery::IpPort last_peer;
+  long num_sent = 0;
+  long start_time = 0;
+  for (uint64_t round = 0;; ++round) {
+    // Round 0 adds the peers and is not measured.
+    if (round == 1) {
+      start_time = udpdiscovery::impl::NowTime();
+      num_sent = 0;
+    }
+    if (round > 1 &&
+        udpdiscovery::impl::NowTime() - start_time >= args->duration_ms) {
+      break;
+    }
+
+    packet.set_snapshot_index(round);
+    packet_data.clear();
+    packet.Serialize(udpdiscovery::kProtocolVersion1, packet_data);
+
+    long round_start_time = udpdiscovery::impl::NowTime();
+    for (size_t i = 0; i < socks.size(); ++i) {
+      sendto(socks[i], packet_data.data(), (int)packet_data.size(), 0,
+             (struct sockaddr*)&addr, sizeof(sockaddr_in));
+    }
+    num_sent += (long)socks.size();
+
+    if (round == 0) {
+      sockaddr_in local_addr;
+      AddressLenType local_addr_length = sizeof(sockaddr_in);
+      getsockname(socks.back(), (struct sockaddr*)&local_addr,
+                  &local_addr_length);
+      last_peer = udpdiscovery::IpPort(kLocalhost, ntohs(local_addr.sin_port));
+    }
+
+    while (true) {
+      udpdiscovery::DiscoveredPeer found;
+      if (args->peer->FindDiscovered(last_peer, found) &&
+          found.last_received_packet() >= round) {
+        break;
+      }
+      // The last packet is lost, go on with the next round.
+      if (udpdiscovery::impl::NowTime() - round_start_time > 100) {
+        break;
+      }
+      udpdiscovery::impl::SleepFor(0);
+    }
+  }
+
+  for (size_t i = 0; i < socks.size(); ++i) {
+    CloseSocket(socks[i]);
+  }
+
+  args->num_sent = num_sent;
+}
+
+// Unicast load from many senders over loopback. The sockets of receive
+// workers share the port, the kernel spreads senders between them.
+void benchmark_ReceiveWorkersScaling() {
+  const int kNumSenders = 4;
+  const int kPeersPerSender = 64;
+  const long kDurationMs = 1000;
+
+  printf("ReceiveWorkersScaling: %d senders, %d peers each\n", kNumSenders,
+         kPeersPerSender);
+  printf("%12s %16s\n", "workers", "packets/s");
+
+  for (int num_workers = 1; num_workers <= 8; num_workers *= 2) {
+    udpdiscovery::PeerParameters parameters;
+    parameters.set_can_discover(true);
+    parameters.set_port(kPort);
+    parameters.set_application_id(kApplicationId);
+    parameters.set_receive_batch_size(64);
+    parameters.set_num_receive_workers(num_workers);
+
+    udpdiscovery::Peer peer;
+    peer.Start(parameters, "");
+    udpdiscovery::impl::SleepFor(100);
+
+    std::vector<LoadSenderArgs> args(kNumSenders);
+    std::vector<BenchmarkThread*> threads;
+    for (int i = 0; i < kNumSenders; ++i) {
+      args[i].peer = &peer;
+      args[i].num_peers = kPeersPerSender;
+      args[i].duration_ms = kDurationMs;
+      args[i].num_sent = 0;
+      threads.push_back(new BenchmarkThread(LoadSenderFunc, &args[i]));
+    }
+
+    long num_sent = 0;
+    for (int i = 0; i < kNumSenders; ++i) {
+      threads[i]->Join();
+      delete threads[i];
+      num_sent += args[i].num_sent;
+    }
+
+    printf("%12d %16.0f\n", num_workers,
+           (double)num_sent * 1000.0 / kDurationMs);
+
+    peer.StopAndWaitForThreads();
+  }
+}
+
+// Receives one datagram. The arrival time is taken by the kernel where
+// possible, the receiving thread can be scheduled long after the arrival.
+static bool ReceiveWithTimestamp(SocketType sock, double& arrival) {
+  char buffer[udpdiscovery::kMaxPacketSize];
+#if defined(_WIN32)
+  if (recv(sock, buffer, sizeof(buffer), 0) <= 0) {
+    return false;
+  }
+  arrival = NowSeconds();
+  return true;
+#else
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = sizeof(buffer);
+  char control[CMSG_SPACE(sizeof(struct timeval))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, 0) <= 0) {
+    return false;
+  }
+
+  arrival = NowSeconds();
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != 0;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+      struct timeval time;
+      memcpy(&time, CMSG_DATA(cmsg), sizeof(time));
+      arrival = time.tv_sec + time.tv_usec / 1000000.0;
+    }
+  }
+  return true;
+#endif
+}
+
+// Returns the largest number of arrival times within window_seconds.
+static int PeakBurst(const std::vector<double>& arrivals,
+                     double window_seconds) {
+  int peak = 0;
+  size_t begin = 0;
+  for (size_t end = 0; end < arrivals.size(); ++end) {
+    while (arrivals[end] - arrivals[begin] >= window_seconds) {
+      ++begin;
+    }
+    if ((int)(end - begin + 1) > peak) {
+      peak = (int)(end - begin + 1);
+    }
+  }
+  return peak;
+}
+
+// Many local peers started together announce to one receiving socket over
+// loopback. Without jitter they stay phase-locked and their announcements
+// arrive in bursts, with jitter the bursts spread over the interval.
+void benchmark_AnnouncementBursts() {
+  const int kNumPeers = 50;
+  const int kReceivePort = kPort + 2;
+  const double kWindowSeconds = 0.005;
+
+  printf("AnnouncementBursts: %d peers, peak datagrams within %.0f ms\n",
+         kNumPeers, kWindowSeconds * 1000);
+  printf("%12s %12s %12s\n", "jitter, %", "datagrams", "peak");
+
+  for (int jitter_percent = 0; jitter_percent <= 50; jitter_percent += 25) {
+    SocketType sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int buffer_size = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&buffer_size,
+               sizeof(buffer_size));
+#if defined(_WIN32)
+    DWORD timeout = 100;
+#else
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 100000;
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout,
+               sizeof(timeout));
+
+    sockaddr_in addr;
+    memset((char*)&addr, 0, sizeof(sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kReceivePort);
+    addr.sin_addr.s_addr = htonl(kLocalhost);
+    bind(sock, (struct sockaddr*)&addr, sizeof(sockaddr_in));
+#if !defined(_WIN32)
+    int value = 1;
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &value, sizeof(value));
+#endif
+
+    udpdiscovery::PeerParameters parameters;
+    parameters.set_can_be_discovered(true);
+    parameters.set_port(kPort);
+    parameters.set_application_id(kApplicationId);
+    parameters.set_send_timeout_ms(200);
+    parameters.set_send_jitter_percent(jitter_percent);
+    parameters.set_can_use_broadcast(false);
+    parameters.add_unicast_target(
+        udpdiscovery::IpPort(kLocalhost, kReceivePort));
+    parameters.set_supported_protocol_versions(udpdiscovery::kProtocolVersion0,
+                                               udpdiscovery::kProtocolVersion1);
+
+    std::vector<udpdiscovery::Peer*> peers;
+    for (int i = 0; i < kNumPeers; ++i) {
+      peers.push_back(new udpdiscovery::Peer());
+      peers.back()->Start(parameters, "");
+    }
+
+    // Lets jittered peers drift apart.
+    udpdiscovery::impl::SleepFor(1000);
+
+    std::vector<double> arrivals;
+    double start = NowSeconds();
+    while (NowSeconds() - start < 3.0) {
+      double arrival;
+      if (ReceiveWithTimestamp(sock, arrival)) {
+        arrivals.push_back(arrival);
+      }
+    }
+
+    printf("%12d %12d %12d\n", jitter_percent, (int)arrivals.size(),
+           PeakBurst(arrivals, kWindowSeconds));
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+      peers[i]->StopAndWaitForThreads();
+      delete peers[i];
+    }
+    CloseSocket(sock);
+  }
+}
+
+// Measures CPU time of the process while peers of another application id
+// flood the port, without and with the socket filter that drops their
+// packets in the kernel. Sending takes the same time in both runs.
+void benchmark_ForeignTraffic() {
+  const int kNumPeers = 200;
+  const int kNumRounds = 100;
+
+  FakePeers fake_peers(kNumPeers, std::string(100, 'x'), kApplicationId + 1);
+
+  printf("ForeignTraffic: %d peers of another application id, %d rounds\n",
+         kNumPeers, kNumRounds);
+  printf("%12s %12s\n", "filter", "cpu, ms");
+
+  for (int use_filter = 0; use_filter <= 1; ++use_filter) {
+    udpdiscovery::PeerParameters parameters;
+    parameters.set_can_discover(true);
+    parameters.set_port(kPort);
+    parameters.set_application_id(kApplicationId);
+    parameters.set_use_socket_filter(use_filter != 0);
+
+    udpdiscovery::Peer peer;
+    peer.Start(parameters, "");
+    udpdiscovery::impl::SleepFor(100);
+
+    clock_t start = clock();
+    for (int i = 0; i < kNumRounds; ++i) {
+      fake_peers.Announce();
+      udpdiscovery::impl::SleepFor(1);
+    }
+    udpdiscovery::impl::SleepFor(200);
+    double cpu_ms = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+
+    printf("%12s %12.1f\n", use_filter ? "on" : "off", cpu_ms);
+
+    peer.StopAndWaitForThreads();
+  }
+}
+
+int main(int argc, char* argv[]) {
+#if defined(_WIN32)
+  WSADATA wsa_data;
+  WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#endif
+
+  const char* filter = (argc > 1) ? argv[1] : "";
+
+  if (strstr("ReadersScaling", filter)) {
+    benchmark_ReadersScaling();
+  }
+
+  if (strstr("IngestStorm", filter)) {
+    benchmark_IngestStorm();
+  }
+
+  if (strstr("ReceiveAllocations", filter)) {
+    benchmark_ReceiveAllocations();
+  }
+
+  if (strstr("SendAllocations", filter)) {
+    benchmark_SendAllocations();
+  }
+
+  if (strstr("StopLatency", filter)) {
+    benchmark_StopLatency();
+  }
+
+  if (strstr("ReactorFootprint", filter)) {
+    benchmark_ReactorFootprint();
+  }
+
+  if (strstr("SharedSocketIngest", filter)) {
+    benchmark_SharedSocketIngest();
+  }
+
+  if (strstr("ReceiveWorkersScaling", filter)) {
+    benchmark_ReceiveWorkersScaling();
+  }
+
+  if (strstr("AnnouncementBursts", filter)) {
+    benchmark_AnnouncementBursts();
+  }
+
+  if (strstr("ForeignTraffic", filter)) {
+    benchmark_ForeignTraffic();
+  }
+
+  return 0;
+}
@@ -1,3 +1,4 @@
+#include "udp_discovery_atomic.hpp"
 #include "udp_discovery_peer.hpp"
 
 #undef NDEBUG
@@ -98,6 +99,64 @@ class EnsureNoUserDataCallable {
   std::string user_data_;
 };
 
+class CountingObserver : public udpdiscovery::PeerObserver {
+ public:
+  CountingObserver(const std::string& user_data,
+                   const std::string& updated_user_data)
+      : user_data_(user_data),
+        updated_user_data_(updated_user_data),
+        num_joined(0),
+        num_updated(0),
+        num_left(0) {}
+
+  void OnPeerJoined(const udpdiscovery::DiscoveredPeer& peer) {
+    if (peer.user_data() == user_data_) {
+      udpdiscovery::impl::AtomicIncrement(&num_joined);
+    }
+  }
+
+  void OnPeerUserDataChanged(const udpdiscovery::DiscoveredPeer& peer) {
+    if (peer.user_data() == updated_user_data_) {
+      udpdiscovery::impl::AtomicIncrement(&num_updated);
+    }
+  }
+
+  void OnPeerLeft(const udpdiscovery::DiscoveredPeer& peer) {
+    if (peer.user_data() == updated_user_data_) {
+      udpdiscovery::impl::AtomicIncrement(&num_left);
+    }
+  }
+
+ private:
+  std::string user_data_;
+  std::string updated_user_data_;
+
+ public:
+  volatile long num_joined;
+  volatile long num_updated;
+  volatile long num_left;
+};
+
+class CounterIsPositiveCallable {
+ public:
+  CounterIsPositiveCallable(volatile long* counter) : counter_(counter) {}
+
+  WaitResult<bool> operator()() {
+    if (udpdiscovery::impl::AtomicLoad(counter_) > 0) {
+      WaitResult<bool> result;
+      result.has_result = true;
+      result.result = true;
+
+      return result;
+    }
+
+    return WaitResult<bool>();
+  }
+
+ private:
+  volatile long* counter_;
+};
+
 void peer_udp_broadcast_discovery() {
   udpdiscovery::PeerParameters peer_parameters;
   peer_parameters.set_can_discover(true);
@@ -129,6 +188,25 @@ void peer_udp_broadcast_discovery() {
   assert(find2.is_timeout == false);
   assert(find2.has_result == true);
 
+  std::list<udpdiscovery::DiscoveredPeer> peers = peer1.ListDiscovered();
+  for (std::list<udpdiscovery::DiscoveredPeer>::iterator it = peers.begin();
+       it != peers.end(); ++it) {
+    udpdiscovery::DiscoveredPeer found;
+    assert(peer1.FindDiscovered((*it).ip_port(), found));
+    assert(found.ip_port() == (*it).ip_port());
+  }
+
+  udpdiscovery::DiscoveredPeersSnapshot snapshot = peer1.Snapshot();
+  bool snapshot_has_peer2 = false;
+  for (std::list<udpdiscovery::DiscoveredPeer>::const_iterator it =
+           snapshot.peers().begin();
+       it != snapshot.peers().end(); ++it) {
+    if ((*it).user_data() == "peer 2") {
+      snapshot_has_peer2 = true;
+    }
+  }
+  assert(snapshot_has_peer2);
+
   peer1.StopAndWaitForThreads();
   peer2.StopAndWaitForThreads();
 }
@@ -171,6 +249,49 @@ void peer_udp_multicast_discovery() {
   peer2.StopAndWaitForThreads();
 }
 
+void peer_unicast_targets() {
+  const unsigned int kLocalhost = (127 << 24) + 1;
+
+  udpdiscovery::PeerParameters discovering_parameters;
+  discovering_parameters.set_can_discover(true);
+  discovering_parameters.set_port(kPort);
+  discovering_parameters.set_application_id(kApplicationId);
+
+  udpdiscovery::PeerParameters announcing_parameters;
+  announcing_parameters.set_can_be_discovered(true);
+  announcing_parameters.set_port(kPort);
+  announcing_parameters.set_application_id(kApplicationId);
+  announcing_parameters.set_send_timeout_ms(100);
+  announcing_parameters.set_can_use_broadcast(false);
+  announcing_parameters.set_can_use_multicast(false);
+  announcing_parameters.add_unicast_target(
+      udpdiscovery::IpPort(kLocalhost, 0));
+
+  udpdiscovery::Peer peer1;
+  peer1.Start(discovering_parameters, "");
+
+  udpdiscovery::Peer peer2;
+  peer2.Start(announcing_parameters, "peer 2");
+
+  FindUserDataCallable find_peer2(peer1, "peer 2");
+  WaitResult<bool> find =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 200,
+                 /* callable= */ find_peer2);
+  assert(find.is_timeout == false);
+  assert(find.has_result == true);
+
+  std::list<udpdiscovery::DestinationStats> stats =
+      peer2.ListDestinationStats();
+  assert(stats.size() == 1);
+  assert(stats.front().destination() ==
+         udpdiscovery::IpPort(kLocalhost, kPort));
+  assert(stats.front().packets_sent() > 0);
+  assert(stats.front().send_errors() == 0);
+
+  peer1.StopAndWaitForThreads();
+  peer2.StopAndWaitForThreads();
+}
+
 void peer_change_user_data() {
   udpdiscovery::PeerParameters peer_parameters;
   peer_parameters.set_can_discover(true);
@@ -196,6 +317,12 @@ void peer_change_user_data() {
   assert(find.is_timeout == false);
   assert(find.has_result == true);
 
+  udpdiscovery::DiscoveredPeersChanges changes = peer1.ListChangesSince(0);
+  assert(!changes.full_resync());
+  assert(!changes.changes().empty());
+  assert(changes.changes().back().generation() == changes.generation());
+  uint64_t generation = changes.generation();
+
   peer2.SetUserData("peer 2 updated user data");
 
   find_peer2.SetUserData("peer 2 updated user data");
@@ -204,6 +331,85 @@ void peer_change_user_data() {
   assert(find.is_timeout == false);
   assert(find.has_result == true);
 
+  changes = peer1.ListChangesSince(generation);
+  assert(!changes.full_resync());
+  bool has_user_data_change = false;
+  for (std::list<udpdiscovery::DiscoveredPeerChange>::const_iterator it =
+           changes.changes().begin();
+       it != changes.changes().end(); ++it) {
+    assert((*it).generation() > generation);
+    if ((*it).type() == udpdiscovery::DiscoveredPeerChange::kUserDataChanged &&
+        (*it).peer().user_data() == "peer 2 updated user data") {
+      has_user_data_change = true;
+    }
+  }
+  assert(has_user_data_change);
+
+  peer1.StopAndWaitForThreads();
+  peer2.StopAndWaitForThreads();
+}
+
+static uint64_t SentPackets(const udpdiscovery::Peer& peer) {
+  uint64_t result = 0;
+  std::list<udpdiscovery::DestinationStats> stats = peer.ListDestinationStats();
+  for (std::list<udpdiscovery::DestinationStats>::const_iterator it =
+           stats.begin();
+       it != stats.end(); ++it) {
+    result += (*it).packets_sent();
+  }
+  return result;
+}
+
+void peer_user_data_propagation(
+    udpdiscovery::PeerParameters::EngineMode engine_mode) {
+  udpdiscovery::PeerParameters discovering_parameters;
+  discovering_parameters.set_can_discover(true);
+  discovering_parameters.set_port(kPort);
+  discovering_parameters.set_application_id(kApplicationId);
+
+  // Regular announcements are too rare to deliver the change in time.
+  udpdiscovery::PeerParameters announcing_parameters;
+  announcing_parameters.set_can_be_discovered(true);
+  announcing_parameters.set_port(kPort);
+  announcing_parameters.set_application_id(kApplicationId);
+  announcing_parameters.set_send_timeout_ms(60000);
+  announcing_parameters.set_user_data_send_interval_ms(100);
+  announcing_parameters.set_engine_mode(engine_mode);
+
+  udpdiscovery::Peer peer1;
+  peer1.Start(discovering_parameters, "");
+
+  udpdiscovery::Peer peer2;
+  peer2.Start(announcing_parameters, "peer 2");
+
+  FindUserDataCallable find_peer2(peer1, "peer 2");
+  WaitResult<bool> find =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 10,
+                 /* callable= */ find_peer2);
+  assert(find.is_timeout == false);
+
+  uint64_t sent_before = SentPackets(peer2);
+
+  // A burst of changes is sent at once and then once more after the interval
+  // with the latest user data.
+  long start_time = udpdiscovery::impl::NowTime();
+  for (int i = 0; i < 50; ++i) {
+    peer2.SetUserData("peer 2 intermediate");
+  }
+  peer2.SetUserData("peer 2 updated");
+
+  find_peer2.SetUserData("peer 2 updated");
+  find = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 5,
+                    /* callable= */ find_peer2);
+  assert(find.is_timeout == false);
+
+  long latency_ms = udpdiscovery::impl::NowTime() - start_time;
+  assert(latency_ms < 1000);
+
+  udpdiscovery::impl::SleepFor(300);
+  uint64_t sent = SentPackets(peer2) - sent_before;
+  assert(sent >= 1 && sent <= 2);
+
   peer1.StopAndWaitForThreads();
   peer2.StopAndWaitForThreads();
 }
@@ -289,11 +495,1140 @@ void peer_V0_V1_discover() {
   peer2.StopAndWaitForThreads();
 }
 
+void peer_V1_V2_discover() {
+  // Peer1 supports only V1, peer2 supports V1 and V2 and peer3 supports only
+  // V2 and has user data too big for V1. User data of peer3 is compressed.
+  udpdiscovery::PeerParameters peer_parameters1;
+  peer_parameters1.set_can_discover(true);
+  peer_parameters1.set_can_be_discovered(true);
+  peer_parameters1.set_port(kPort);
+  peer_parameters1.set_application_id(kApplicationId);
+  peer_parameters1.set_send_timeout_ms(100);
+  peer_parameters1.set_supported_protocol_version(
+      udpdiscovery::kProtocolVersion1);
+
+  udpdiscovery::PeerParameters peer_parameters2 = peer_parameters1;
+  peer_parameters2.set_supported_protocol_versions(
+      udpdiscovery::kProtocolVersion1, udpdiscovery::kProtocolVersion2);
+
+  udpdiscovery::PeerParameters peer_parameters3 = peer_parameters1;
+  peer_parameters3.set_supported_protocol_version(
+      udpdiscovery::kProtocolVersion2);
+
+  std::string user_data3;
+  while (user_data3.size() < 10000) {
+    user_data3 += "{\"service\":\"peer 3\",\"port\":8080},";
+  }
+
+  udpdiscovery::Peer peer1;
+  peer1.Start(peer_parameters1, "peer 1");
+  udpdiscovery::Peer peer2;
+  peer2.Start(peer_parameters2, "peer 2");
+  udpdiscovery::Peer peer3;
+  peer3.Start(peer_parameters3, user_data3);
+
+  FindUserDataCallable find_peer1(peer2, "peer 1");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                 /* callable= */ find_peer1);
+  assert(wait_result.is_timeout == false);
+
+  FindUserDataCallable find_peer2(peer1, "peer 2");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ find_peer2);
+  assert(wait_result.is_timeout == false);
+
+  FindUserDataCallable find_peer3(peer2, user_data3);
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ find_peer3);
+  assert(wait_result.is_timeout == false);
+
+  FindUserDataCallable find_peer2_by_peer3(peer3, "peer 2");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ find_peer2_by_peer3);
+  assert(wait_result.is_timeout == false);
+
+  // Peer3 is heard only with V2.
+  EnsureNoUserDataCallable no_peer3(peer1, user_data3);
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ no_peer3);
+  assert(wait_result.is_timeout == false);
+
+  peer3.StopAndWaitForThreads();
+  peer2.StopAndWaitForThreads();
+  peer1.StopAndWaitForThreads();
+}
+
+// The reactor parses a datagram once and passes copies of the packet to the
+// envs, compressed user data of V2 should stay valid in the copies.
+void peer_reactor_V2_compressed() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+  peer_parameters.set_supported_protocol_version(
+      udpdiscovery::kProtocolVersion2);
+
+  std::string user_datas[2];
+  for (int i = 0; i < 2; ++i) {
+    while (user_datas[i].size() < 10000) {
+      user_datas[i] += i == 0 ? "{\"service\":\"peer 0\",\"port\":8080},"
+                              : "{\"service\":\"peer 1\",\"port\":8081},";
+    }
+  }
+
+  udpdiscovery::PeerReactor reactor;
+  assert(reactor.Start(1));
+
+  udpdiscovery::Peer peers[2];
+  for (int i = 0; i < 2; ++i) {
+    assert(peers[i].Start(peer_parameters, user_datas[i], 0, &reactor));
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    FindUserDataCallable find_peer(peers[i], user_datas[1 - i]);
+    WaitResult<bool> wait_result =
+        Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                   /* callable= */ find_peer);
+    assert(wait_result.is_timeout == false);
+  }
+
+  peers[0].StopAndWaitForThreads();
+  peers[1].StopAndWaitForThreads();
+  reactor.Stop();
+}
+
+void peer_observer(
+    udpdiscovery::PeerParameters::ObserverDispatchMode dispatch_mode) {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+  peer_parameters.set_observer_dispatch_mode(dispatch_mode);
+
+  CountingObserver observer("peer 2", "peer 2 updated user data");
+
+  udpdiscovery::Peer peer1;
+  peer1.Start(peer_parameters, "peer 1", &observer);
+
+  // TODO: Understand why do we need this timeout.
+  udpdiscovery::impl::SleepFor(1000);
+
+  udpdiscovery::Peer peer2;
+  peer2.Start(peer_parameters, "peer 2");
+
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ CounterIsPositiveCallable(
+                     &observer.num_joined));
+  assert(wait_result.is_timeout == false);
+
+  peer2.SetUserData("peer 2 updated user data");
+
+  wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ CounterIsPositiveCallable(
+                     &observer.num_updated));
+  assert(wait_result.is_timeout == false);
+
+  peer2.StopAndWaitForThreads();
+
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                           /* callable= */ CounterIsPositiveCallable(
+                               &observer.num_left));
+  assert(wait_result.is_timeout == false);
+
+  peer1.StopAndWaitForThreads();
+}
+
+void peer_event_loop_engine() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+
+  udpdiscovery::PeerParameters event_loop_parameters = peer_parameters;
+  event_loop_parameters.set_engine_mode(
+      udpdiscovery::PeerParameters::kEngineEventLoop);
+
+  udpdiscovery::Peer peer1;
+  peer1.Start(peer_parameters, "peer 1");
+
+  udpdiscovery::Peer peer2;
+  peer2.Start(event_loop_parameters, "peer 2");
+
+  FindUserDataCallable find_peer2(peer1, "peer 2");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 200,
+                 /* callable= */ find_peer2);
+  assert(wait_result.is_timeout == false);
+
+  FindUserDataCallable find_peer1(peer2, "peer 1");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 200,
+                           /* callable= */ find_peer1);
+  assert(wait_result.is_timeout == false);
+
+  // The event loop is woken up by Stop, it doesn't wait for the receive
+  // timeout.
+  long stop_start_time = udpdiscovery::impl::NowTime();
+  peer2.StopAndWaitForThreads();
+  assert(udpdiscovery::impl::NowTime() - stop_start_time < 500);
+
+  EnsureNoUserDataCallable no_peer2(peer1, "peer 2");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 200,
+                           /* callable= */ no_peer2);
+  assert(wait_result.is_timeout == false);
+
+  peer1.StopAndWaitForThreads();
+}
+
+void peer_external_engine() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+
+  udpdiscovery::PeerParameters external_parameters = peer_parameters;
+  external_parameters.set_engine_mode(
+      udpdiscovery::PeerParameters::kEngineExternal);
+
+  udpdiscovery::Peer peer1;
+  peer1.Start(peer_parameters, "peer 1");
+  // Does nothing, peer1 is polled by its own threads.
+  peer1.Poll(udpdiscovery::impl::NowTime());
+
+  udpdiscovery::Peer peer2;
+  peer2.Start(external_parameters, "peer 2");
+
+  udpdiscovery::NativeSocket receive_socket;
+  assert(peer2.ReceiveSocket(receive_socket));
+  assert(peer2.NextDeadline() >= 0);
+
+  // Drives peer2 as an external loop would. A real loop would also wait for
+  // receive_socket to become readable.
+  FindUserDataCallable find_peer1(peer2, "peer 1");
+  bool peer1_found = false;
+  long start_time = udpdiscovery::impl::NowTime();
+  while (udpdiscovery::impl::NowTime() - start_time < 5000) {
+    long now = udpdiscovery::impl::NowTime();
+    peer2.Poll(now);
+
+    long next_deadline = peer2.NextDeadline();
+    assert(next_deadline > now);
+    assert(next_deadline <= now + peer_parameters.send_timeout_ms());
+
+    if (find_peer1().has_result) {
+      peer1_found = true;
+      break;
+    }
+    udpdiscovery::impl::SleepFor(10);
+  }
+  assert(peer1_found);
+
+  FindUserDataCallable find_peer2(peer1, "peer 2");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 200,
+                 /* callable= */ find_peer2);
+  assert(wait_result.is_timeout == false);
+
+  peer2.Stop();
+
+  EnsureNoUserDataCallable no_peer2(peer1, "peer 2");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 200,
+                           /* callable= */ no_peer2);
+  assert(wait_result.is_timeout == false);
+
+  peer1.StopAndWaitForThreads();
+}
+
+void peer_reactor() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+
+  udpdiscovery::PeerReactor reactor;
+  assert(reactor.Start(2));
+
+  udpdiscovery::Peer peer1;
+  peer1.Start(peer_parameters, "peer 1");
+
+  CountingObserver observer("peer 1", "peer 1 updated");
+  udpdiscovery::Peer reactor_peers[3];
+  reactor_peers[0].Start(peer_parameters, "reactor peer 0", &observer,
+                         &reactor);
+  reactor_peers[1].Start(peer_parameters, "reactor peer 1", 0, &reactor);
+  reactor_peers[2].Start(peer_parameters, "reactor peer 2", 0, &reactor);
+
+  const char* user_datas[] = {"reactor peer 0", "reactor peer 1",
+                              "reactor peer 2"};
+  for (int i = 0; i < 3; ++i) {
+    FindUserDataCallable find_reactor_peer(peer1, user_datas[i]);
+    WaitResult<bool> wait_result =
+        Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                   /* callable= */ find_reactor_peer);
+    assert(wait_result.is_timeout == false);
+
+    FindUserDataCallable find_peer1(reactor_peers[i], "peer 1");
+    wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                             /* callable= */ find_peer1);
+    assert(wait_result.is_timeout == false);
+  }
+
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ CounterIsPositiveCallable(
+                     &observer.num_joined));
+  assert(wait_result.is_timeout == false);
+
+  // User data of a peer on the reactor is announced immediately as well.
+  reactor_peers[1].SetUserData("reactor peer 1 updated");
+  FindUserDataCallable find_updated(peer1, "reactor peer 1 updated");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 10,
+                           /* callable= */ find_updated);
+  assert(wait_result.is_timeout == false);
+
+  reactor_peers[2].StopAndWaitForThreads();
+
+  EnsureNoUserDataCallable no_reactor_peer2(peer1, "reactor peer 2");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ no_reactor_peer2);
+  assert(wait_result.is_timeout == false);
+
+  // The reactor releases a peer detached right before it stops, a peer
+  // stopped after the reactor is released by Stop() itself. Both say goodbye.
+  reactor_peers[0].Stop();
+  reactor.Stop();
+  reactor_peers[1].StopAndWaitForThreads();
+
+  EnsureNoUserDataCallable no_reactor_peer0(peer1, "reactor peer 0");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ no_reactor_peer0);
+  assert(wait_result.is_timeout == false);
+
+  EnsureNoUserDataCallable no_reactor_peer1(peer1, "reactor peer 1 updated");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ no_reactor_peer1);
+  assert(wait_result.is_timeout == false);
+
+  peer1.StopAndWaitForThreads();
+}
+
+// Peers of the reactor with different application ids on one port share the
+// binding socket and only see peers of their own application.
+void peer_reactor_application_ids() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+
+  udpdiscovery::PeerParameters other_parameters = peer_parameters;
+  other_parameters.set_application_id(kApplicationId + 1);
+
+  udpdiscovery::PeerReactor reactor;
+  assert(reactor.Start(1));
+
+  udpdiscovery::Peer peer1;
+  peer1.Start(peer_parameters, "peer 1");
+
+  udpdiscovery::Peer reactor_peer;
+  assert(reactor_peer.Start(peer_parameters, "reactor peer", 0, &reactor));
+  udpdiscovery::Peer other_peers[2];
+  assert(other_peers[0].Start(other_parameters, "other peer 0", 0, &reactor));
+  assert(other_peers[1].Start(other_parameters, "other peer 1", 0, &reactor));
+
+  FindUserDataCallable find_peer1(reactor_peer, "peer 1");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                 /* callable= */ find_peer1);
+  assert(wait_result.is_timeout == false);
+
+  FindUserDataCallable find_other_peer1(other_peers[0], "other peer 1");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ find_other_peer1);
+  assert(wait_result.is_timeout == false);
+
+  FindUserDataCallable find_reactor_peer(peer1, "reactor peer");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ find_reactor_peer);
+  assert(wait_result.is_timeout == false);
+
+  // Several announcements of every peer are received by now.
+  udpdiscovery::impl::SleepFor(300);
+  assert(reactor_peer.ListDiscovered().size() == 1);
+  assert(other_peers[0].ListDiscovered().size() == 1);
+  assert(other_peers[1].ListDiscovered().size() == 1);
+  assert(peer1.ListDiscovered().size() == 1);
+
+  other_peers[0].StopAndWaitForThreads();
+  other_peers[1].StopAndWaitForThreads();
+
+  // The shared socket stays open for the remaining peer.
+  reactor_peer.SetUserData("reactor peer updated");
+  peer1.SetUserData("peer 1 updated");
+  FindUserDataCallable find_peer1_updated(reactor_peer, "peer 1 updated");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 10,
+                           /* callable= */ find_peer1_updated);
+  assert(wait_result.is_timeout == false);
+
+  reactor_peer.StopAndWaitForThreads();
+  peer1.StopAndWaitForThreads();
+  reactor.Stop();
+}
+
+// A peer with several receive workers discovers every peer once, broadcast
+// copies received by all workers are applied by one of them.
+void peer_receive_workers() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+
+  udpdiscovery::PeerParameters sharded_parameters = peer_parameters;
+  sharded_parameters.set_num_receive_workers(4);
+
+  CountingObserver observer("peer 0", "peer 0 updated");
+  udpdiscovery::Peer sharded_peer;
+  assert(sharded_peer.Start(sharded_parameters, "sharded peer", &observer));
+
+  udpdiscovery::Peer peers[3];
+  const char* user_datas[] = {"peer 0", "peer 1", "peer 2"};
+  for (int i = 0; i < 3; ++i) {
+    peers[i].Start(peer_parameters, user_datas[i]);
+  }
+
+  for (int i = 0; i < 3; ++i) {
+    FindUserDataCallable find_peer(sharded_peer, user_datas[i]);
+    WaitResult<bool> wait_result =
+        Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                   /* callable= */ find_peer);
+    assert(wait_result.is_timeout == false);
+
+    FindUserDataCallable find_sharded_peer(peers[i], "sharded peer");
+    wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                             /* callable= */ find_sharded_peer);
+    assert(wait_result.is_timeout == false);
+  }
+
+  // Several announcements of every peer are received by now.
+  udpdiscovery::impl::SleepFor(300);
+  std::list<udpdiscovery::DiscoveredPeer> discovered =
+      sharded_peer.ListDiscovered();
+  assert(discovered.size() == 3);
+  assert(sharded_peer.Snapshot().peers().size() == 3);
+  for (std::list<udpdiscovery::DiscoveredPeer>::iterator it =
+           discovered.begin();
+       it != discovered.end(); ++it) {
+    udpdiscovery::DiscoveredPeer found;
+    assert(sharded_peer.FindDiscovered((*it).ip_port(), found));
+    assert(found.user_data() == (*it).user_data());
+  }
+  assert(udpdiscovery::impl::AtomicLoad(&observer.num_joined) == 1);
+
+  peers[0].SetUserData("peer 0 updated");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ CounterIsPositiveCallable(
+                     &observer.num_updated));
+  assert(wait_result.is_timeout == false);
+
+  peers[1].StopAndWaitForThreads();
+  EnsureNoUserDataCallable no_peer1(sharded_peer, "peer 1");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ no_peer1);
+  assert(wait_result.is_timeout == false);
+
+  peers[0].StopAndWaitForThreads();
+  peers[2].StopAndWaitForThreads();
+  sharded_peer.StopAndWaitForThreads();
+}
+
+// Announcements go to the broadcast address of every interface or through
+// every interface to the multicast group.
+void peer_all_interfaces(bool use_multicast) {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+  if (use_multicast) {
+    peer_parameters.set_can_use_broadcast(false);
+    peer_parameters.set_can_use_multicast(true);
+    peer_parameters.set_multicast_group_address(kMulticastAddress);
+  }
+
+  udpdiscovery::PeerParameters all_interfaces_parameters = peer_parameters;
+  all_interfaces_parameters.set_use_all_interfaces(true);
+
+  udpdiscovery::Peer all_interfaces_peer;
+  assert(all_interfaces_peer.Start(all_interfaces_parameters,
+                                   "all interfaces peer"));
+
+  // The answer to the probe is unicast from the sending socket, it must not
+  // look like one more peer next to the announcements.
+  peer_parameters.set_send_probe_on_start(true);
+  udpdiscovery::Peer peer1;
+  peer1.Start(peer_parameters, "peer 1");
+
+  FindUserDataCallable find_all_interfaces_peer(peer1, "all interfaces peer");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                 /* callable= */ find_all_interfaces_peer);
+  assert(wait_result.is_timeout == false);
+
+  FindUserDataCallable find_peer1(all_interfaces_peer, "peer 1");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 100,
+                           /* callable= */ find_peer1);
+  assert(wait_result.is_timeout == false);
+
+  std::list<udpdiscovery::DestinationStats> stats =
+      all_interfaces_peer.ListDestinationStats();
+  assert(!stats.empty());
+  for (std::list<udpdiscovery::DestinationStats>::iterator it = stats.begin();
+       it != stats.end(); ++it) {
+    assert((*it).packets_sent() > 0);
+  }
+
+  udpdiscovery::impl::SleepFor(3 * peer_parameters.send_timeout_ms());
+
+  std::list<udpdiscovery::DiscoveredPeer> discovered = peer1.ListDiscovered();
+  int num_all_interfaces_peers = 0;
+  for (std::list<udpdiscovery::DiscoveredPeer>::iterator it =
+           discovered.begin();
+       it != discovered.end(); ++it) {
+#if defined(__linux__)
+    assert((*it).interface_index() > 0);
+#endif
+    if ((*it).user_data() == "all interfaces peer") {
+      ++num_all_interfaces_peers;
+    }
+  }
+  assert(num_all_interfaces_peers == 1);
+
+  all_interfaces_peer.StopAndWaitForThreads();
+  peer1.StopAndWaitForThreads();
+}
+
+static long SumPacketsSent(const udpdiscovery::Peer& peer) {
+  std::list<udpdiscovery::DestinationStats> stats = peer.ListDestinationStats();
+  long packets_sent = 0;
+  for (std::list<udpdiscovery::DestinationStats>::iterator it = stats.begin();
+       it != stats.end(); ++it) {
+    packets_sent += (long)(*it).packets_sent();
+  }
+  return packets_sent;
+}
+
+// A loop stalled for longer than two send intervals gets a deadline that has
+// passed already, not "no deadline", and goes on announcing afterwards.
+void peer_external_engine_stall() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+
+  udpdiscovery::PeerParameters external_parameters = peer_parameters;
+  external_parameters.set_engine_mode(
+      udpdiscovery::PeerParameters::kEngineExternal);
+
+  udpdiscovery::Peer peer1;
+  peer1.Start(peer_parameters, "peer 1");
+
+  udpdiscovery::Peer peer2;
+  peer2.Start(external_parameters, "peer 2");
+
+  peer2.Poll(udpdiscovery::impl::NowTime());
+  udpdiscovery::impl::SleepFor(3 * peer_parameters.send_timeout_ms() + 50);
+
+  long now = udpdiscovery::impl::NowTime();
+  peer2.Poll(now);
+  long next_deadline = peer2.NextDeadline();
+  assert(next_deadline >= now);
+  assert(next_deadline <= now + peer_parameters.send_timeout_ms());
+
+  long packets_sent = SumPacketsSent(peer2);
+  long start_time = udpdiscovery::impl::NowTime();
+  while (udpdiscovery::impl::NowTime() - start_time < 1000) {
+    now = udpdiscovery::impl::NowTime();
+    next_deadline = peer2.NextDeadline();
+    assert(next_deadline >= 0);
+    if (next_deadline > now) {
+      udpdiscovery::impl::SleepFor(next_deadline - now);
+    }
+    peer2.Poll(udpdiscovery::impl::NowTime());
+  }
+  packets_sent = SumPacketsSent(peer2) - packets_sent;
+  assert(packets_sent >= 5);
+
+  FindUserDataCallable find_peer2(peer1, "peer 2");
+  assert(find_peer2().has_result);
+
+  peer2.Stop();
+  peer1.StopAndWaitForThreads();
+}
+
+// Peers with a budget of 10 announcements per second in a group of three
+// announce every 300 ms instead of every 100 ms, and don't expire each other
+// although the configured ttl is shorter than that.
+void peer_announcement_budget() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+  peer_parameters.set_discovered_peer_ttl_ms(250);
+
+  udpdiscovery::PeerParameters budget_parameters = peer_parameters;
+  budget_parameters.set_can_discover(true);
+  budget_parameters.set_announcement_budget_per_second(10);
+
+  udpdiscovery::Peer peer;
+  peer.Start(peer_parameters, "peer");
+
+  CountingObserver observer("budget peer 2", "budget peer 2");
+  udpdiscovery::Peer budget_peer1;
+  budget_peer1.Start(budget_parameters, "budget peer 1", &observer);
+  udpdiscovery::Peer budget_peer2;
+  budget_peer2.Start(budget_parameters, "budget peer 2");
+
+  const char* user_datas[] = {"peer", "budget peer 2"};
+  for (int i = 0; i < 2; ++i) {
+    FindUserDataCallable find_peer(budget_peer1, user_datas[i]);
+    WaitResult<bool> wait_result =
+        Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                   /* callable= */ find_peer);
+    assert(wait_result.is_timeout == false);
+  }
+
+  // Lets the intervals adapt to the size of the group.
+  udpdiscovery::impl::SleepFor(500);
+
+  long peer_packets_sent = SumPacketsSent(peer);
+  long budget_packets_sent = SumPacketsSent(budget_peer1);
+  udpdiscovery::impl::SleepFor(2000);
+  peer_packets_sent = SumPacketsSent(peer) - peer_packets_sent;
+  budget_packets_sent = SumPacketsSent(budget_peer1) - budget_packets_sent;
+
+  assert(budget_packets_sent > 0);
+  assert(budget_packets_sent * 2 < peer_packets_sent);
+  assert(udpdiscovery::impl::AtomicLoad(&observer.num_left) == 0);
+  assert(budget_peer1.ListDiscovered().size() == 2);
+
+  budget_peer2.StopAndWaitForThreads();
+  budget_peer1.StopAndWaitForThreads();
+  peer.StopAndWaitForThreads();
+}
+
+// Peers with jitter send announcements of every supported version at
+// random moments and keep discovering each other.
+void peer_send_jitter() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+  peer_parameters.set_discovered_peer_ttl_ms(500);
+  peer_parameters.set_send_jitter_percent(50);
+  peer_parameters.set_supported_protocol_versions(
+      udpdiscovery::kProtocolVersion0, udpdiscovery::kProtocolVersion1);
+
+  CountingObserver observer("peer 2", "peer 2");
+  udpdiscovery::Peer peer1;
+  peer1.Start(peer_parameters, "peer 1", &observer);
+  udpdiscovery::Peer peer2;
+  peer2.Start(peer_parameters, "peer 2");
+
+  FindUserDataCallable find_peer2(peer1, "peer 2");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ find_peer2);
+  assert(wait_result.is_timeout == false);
+
+  long packets_sent = SumPacketsSent(peer1);
+  udpdiscovery::impl::SleepFor(1000);
+  packets_sent = SumPacketsSent(peer1) - packets_sent;
+
+  // About 10 announcements of two versions.
+  assert(packets_sent >= 10 && packets_sent <= 40);
+  assert(udpdiscovery::impl::AtomicLoad(&observer.num_left) == 0);
+
+  peer2.StopAndWaitForThreads();
+  peer1.StopAndWaitForThreads();
+}
+
+// A started discoverer probes and discoverable peers answer at once instead
+// of at their next announcements. Peers of one reactor share the socket, so
+// unicast answers sent to the port reach the prober on one host.
+void peer_probe_on_start() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(10000);
+  peer_parameters.set_discovered_peer_ttl_ms(20000);
+  peer_parameters.set_send_probe_on_start(true);
+
+  udpdiscovery::PeerReactor reactor;
+  assert(reactor.Start(1));
+
+  udpdiscovery::Peer peers[2];
+  assert(peers[0].Start(peer_parameters, "peer 0", 0, &reactor));
+  assert(peers[1].Start(peer_parameters, "peer 1", 0, &reactor));
+
+  FindUserDataCallable find_peer1(peers[0], "peer 1");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 10,
+                 /* callable= */ find_peer1);
+  assert(wait_result.is_timeout == false);
+
+  // The first announcements of peers are sent, the next ones are 10 s away.
+  udpdiscovery::impl::SleepFor(200);
+
+  long start_time = udpdiscovery::impl::NowTime();
+  udpdiscovery::Peer prober;
+  assert(prober.Start(peer_parameters, "prober", 0, &reactor));
+
+  const char* user_datas[] = {"peer 0", "peer 1"};
+  for (int i = 0; i < 2; ++i) {
+    FindUserDataCallable find_peer(prober, user_datas[i]);
+    wait_result = Wait<bool>(/* timeout = */ 2000, /* sleep_timeout = */ 10,
+                             /* callable= */ find_peer);
+    assert(wait_result.is_timeout == false);
+  }
+  assert(udpdiscovery::impl::NowTime() - start_time < 2000);
+
+  prober.StopAndWaitForThreads();
+  peers[0].StopAndWaitForThreads();
+  peers[1].StopAndWaitForThreads();
+  reactor.Stop();
+}
+
+// A peer that only can be discovered listens for probes too and answers the
+// probe of a peer that only discovers.
+void peer_probe_discoverable_only() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(10000);
+  peer_parameters.set_discovered_peer_ttl_ms(20000);
+  peer_parameters.set_send_probe_on_start(true);
+
+  udpdiscovery::PeerParameters discoverable_parameters = peer_parameters;
+  discoverable_parameters.set_can_discover(false);
+  discoverable_parameters.set_can_be_discovered(true);
+
+  udpdiscovery::PeerParameters prober_parameters = peer_parameters;
+  prober_parameters.set_can_discover(true);
+  prober_parameters.set_can_be_discovered(false);
+
+  udpdiscovery::PeerReactor reactor;
+  assert(reactor.Start(1));
+
+  udpdiscovery::Peer discoverable;
+  assert(discoverable.Start(discoverable_parameters, "discoverable", 0,
+                            &reactor));
+
+  // The first announcement is sent, the next one is 10 s away.
+  udpdiscovery::impl::SleepFor(200);
+
+  udpdiscovery::Peer prober;
+  assert(prober.Start(prober_parameters, "prober", 0, &reactor));
+
+  FindUserDataCallable find_discoverable(prober, "discoverable");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 2000, /* sleep_timeout = */ 10,
+                 /* callable= */ find_discoverable);
+  assert(wait_result.is_timeout == false);
+
+  prober.StopAndWaitForThreads();
+  discoverable.StopAndWaitForThreads();
+  reactor.Stop();
+}
+
+// Peers with full announcements every 2 s send heartbeats in between. The
+// heartbeats keep peers discovered, changes of user data are announced at
+// once, and a started peer that doesn't probe asks for the user data of the
+// peers it hears heartbeats from, without waiting for a full announcement.
+void peer_heartbeats() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+  peer_parameters.set_discovered_peer_ttl_ms(5000);
+  peer_parameters.set_full_announcement_interval_ms(2000);
+  peer_parameters.set_send_probe_on_start(false);
+
+  udpdiscovery::PeerReactor reactor;
+  assert(reactor.Start(1));
+
+  CountingObserver observer("peer 1", "peer 1");
+  udpdiscovery::Peer peers[2];
+  assert(peers[0].Start(peer_parameters, "peer 0", &observer, &reactor));
+  assert(peers[1].Start(peer_parameters, "peer 1", 0, &reactor));
+
+  FindUserDataCallable find_peer1(peers[0], "peer 1");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 10,
+                 /* callable= */ find_peer1);
+  assert(wait_result.is_timeout == false);
+
+  long start_time = udpdiscovery::impl::NowTime();
+  udpdiscovery::Peer late_peer;
+  assert(late_peer.Start(peer_parameters, "late peer", 0, &reactor));
+
+  const char* user_datas[] = {"peer 0", "peer 1"};
+  for (int i = 0; i < 2; ++i) {
+    FindUserDataCallable find_peer(late_peer, user_datas[i]);
+    wait_result = Wait<bool>(/* timeout = */ 2000, /* sleep_timeout = */ 10,
+                             /* callable= */ find_peer);
+    assert(wait_result.is_timeout == false);
+  }
+  assert(udpdiscovery::impl::NowTime() - start_time < 1000);
+
+  // Longer than the interval of full announcements.
+  udpdiscovery::impl::SleepFor(2500);
+  assert(udpdiscovery::impl::AtomicLoad(&observer.num_left) == 0);
+
+  start_time = udpdiscovery::impl::NowTime();
+  peers[1].SetUserData("peer 1 changed");
+  FindUserDataCallable find_changed(peers[0], "peer 1 changed");
+  wait_result = Wait<bool>(/* timeout = */ 2000, /* sleep_timeout = */ 10,
+                           /* callable= */ find_changed);
+  assert(wait_result.is_timeout == false);
+  assert(udpdiscovery::impl::NowTime() - start_time < 1000);
+
+  late_peer.StopAndWaitForThreads();
+  peers[0].StopAndWaitForThreads();
+  peers[1].StopAndWaitForThreads();
+  reactor.Stop();
+}
+
+class StatIsPositiveCallable {
+ public:
+  typedef uint64_t (udpdiscovery::PeerStats::*Getter)() const;
+
+  StatIsPositiveCallable(udpdiscovery::Peer& peer, Getter getter)
+      : peer_(peer), getter_(getter) {}
+
+  WaitResult<bool> operator()() {
+    if ((peer_.GetStats().*getter_)() > 0) {
+      WaitResult<bool> result;
+      result.has_result = true;
+      result.result = true;
+      return result;
+    }
+    return WaitResult<bool>();
+  }
+
+ private:
+  udpdiscovery::Peer& peer_;
+  Getter getter_;
+};
+
+// A peer with the socket filter still receives packets of both magics and
+// of every version that it supports, and its own packets with
+// discover_self().
+void peer_socket_filter() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+
+  udpdiscovery::PeerParameters filter_parameters = peer_parameters;
+  filter_parameters.set_use_socket_filter(true);
+  filter_parameters.set_discover_self(true);
+  filter_parameters.set_supported_protocol_versions(
+      udpdiscovery::kProtocolVersion0, udpdiscovery::kProtocolVersion2);
+
+  udpdiscovery::PeerParameters v0_parameters = peer_parameters;
+  v0_parameters.set_supported_protocol_version(
+      udpdiscovery::kProtocolVersion0);
+  udpdiscovery::PeerParameters v2_parameters = peer_parameters;
+  v2_parameters.set_supported_protocol_version(
+      udpdiscovery::kProtocolVersion2);
+
+  udpdiscovery::Peer filter_peer;
+  assert(filter_peer.Start(filter_parameters, "filter peer"));
+  udpdiscovery::Peer v0_peer;
+  assert(v0_peer.Start(v0_parameters, "v0 peer"));
+  udpdiscovery::Peer v2_peer;
+  assert(v2_peer.Start(v2_parameters, "v2 peer"));
+
+  const char* user_datas[] = {"filter peer", "v0 peer", "v2 peer"};
+  for (int i = 0; i < 3; ++i) {
+    FindUserDataCallable find_peer(filter_peer, user_datas[i]);
+    WaitResult<bool> wait_result =
+        Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                   /* callable= */ find_peer);
+    assert(wait_result.is_timeout == false);
+  }
+
+  v2_peer.StopAndWaitForThreads();
+  v0_peer.StopAndWaitForThreads();
+  filter_peer.StopAndWaitForThreads();
+
+#if defined(__linux__)
+  // Without discover_self() the kernel drops own packets and those of other
+  // application ids, the peer never sees them. A peer without the filter
+  // shows that both kinds are sent.
+  filter_parameters.set_discover_self(false);
+  udpdiscovery::PeerParameters foreign_parameters = peer_parameters;
+  foreign_parameters.set_application_id(kApplicationId + 1);
+
+  udpdiscovery::Peer quiet_filter_peer;
+  assert(quiet_filter_peer.Start(filter_parameters, "quiet filter peer"));
+  udpdiscovery::Peer control_peer;
+  assert(control_peer.Start(peer_parameters, "control peer"));
+  udpdiscovery::Peer foreign_peer;
+  assert(foreign_peer.Start(foreign_parameters, "foreign peer"));
+
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ StatIsPositiveCallable(
+                     control_peer, &udpdiscovery::PeerStats::own_packets));
+  assert(wait_result.is_timeout == false);
+  wait_result = Wait<bool>(
+      /* timeout = */ 5000, /* sleep_timeout = */ 50,
+      /* callable= */ StatIsPositiveCallable(
+          control_peer, &udpdiscovery::PeerStats::other_application_id));
+  assert(wait_result.is_timeout == false);
+
+  FindUserDataCallable find_control_peer(quiet_filter_peer, "control peer");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                           /* callable= */ find_control_peer);
+  assert(wait_result.is_timeout == false);
+
+  udpdiscovery::PeerStats stats = quiet_filter_peer.GetStats();
+  assert(stats.datagrams_received() > 0);
+  assert(stats.own_packets() == 0);
+  assert(stats.other_application_id() == 0);
+
+  foreign_peer.StopAndWaitForThreads();
+  control_peer.StopAndWaitForThreads();
+  quiet_filter_peer.StopAndWaitForThreads();
+#endif
+}
+
+class DiscoveredCountCallable {
+ public:
+  DiscoveredCountCallable(udpdiscovery::Peer& peer, uint64_t num_peers)
+      : peer_(peer), num_peers_(num_peers) {}
+
+  WaitResult<bool> operator()() {
+    if (peer_.GetStats().num_discovered_peers() == num_peers_) {
+      WaitResult<bool> result;
+      result.has_result = true;
+      result.result = true;
+      return result;
+    }
+    return WaitResult<bool>();
+  }
+
+ private:
+  udpdiscovery::Peer& peer_;
+  uint64_t num_peers_;
+};
+
+void peer_stats() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+
+  udpdiscovery::PeerParameters other_parameters = peer_parameters;
+  other_parameters.set_application_id(kApplicationId + 1);
+  udpdiscovery::PeerParameters v0_parameters = peer_parameters;
+  v0_parameters.set_supported_protocol_version(
+      udpdiscovery::kProtocolVersion0);
+
+  udpdiscovery::Peer peer1;
+  assert(peer1.GetStats().datagrams_received() == 0);
+  assert(peer1.Start(peer_parameters, "peer 1"));
+  udpdiscovery::Peer peer2;
+  assert(peer2.Start(peer_parameters, "peer 2"));
+  udpdiscovery::Peer other_peer;
+  assert(other_peer.Start(other_parameters, "other peer"));
+  udpdiscovery::Peer v0_peer;
+  assert(v0_peer.Start(v0_parameters, "v0 peer"));
+
+  FindUserDataCallable find_peer2(peer1, "peer 2");
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ find_peer2);
+  assert(wait_result.is_timeout == false);
+  // Announcements of the peers that peer1 doesn't accept.
+  wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ StatIsPositiveCallable(
+                     peer1, &udpdiscovery::PeerStats::other_application_id));
+  assert(wait_result.is_timeout == false);
+  wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ StatIsPositiveCallable(
+                     peer1, &udpdiscovery::PeerStats::unsupported_version));
+  assert(wait_result.is_timeout == false);
+
+  udpdiscovery::PeerStats stats = peer1.GetStats();
+  assert(stats.datagrams_received() > 0);
+  assert(stats.other_application_id() > 0);
+  assert(stats.unsupported_version() > 0);
+  assert(stats.packets_sent() > 0);
+  assert(stats.send_errors() == 0);
+  assert(stats.peers_added() == 1);
+  assert(stats.num_discovered_peers() == 1);
+  assert(stats.user_data_bytes() == std::string("peer 2").size());
+
+  peer2.SetUserData("peer 2 changed");
+  FindUserDataCallable find_changed(peer1, "peer 2 changed");
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                           /* callable= */ find_changed);
+  assert(wait_result.is_timeout == false);
+  stats = peer1.GetStats();
+  assert(stats.peers_updated() == 1);
+  assert(stats.user_data_bytes() == std::string("peer 2 changed").size());
+
+  peer2.StopAndWaitForThreads();
+  DiscoveredCountCallable no_peers(peer1, 0);
+  wait_result = Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                           /* callable= */ no_peers);
+  assert(wait_result.is_timeout == false);
+  stats = peer1.GetStats();
+  assert(stats.peers_left() == 1);
+  assert(stats.user_data_bytes() == 0);
+
+  // A peer on a reactor counts the verdicts on the datagrams of its
+  // application id: its own packets and those of the v0 peer.
+  udpdiscovery::PeerReactor reactor;
+  assert(reactor.Start(1));
+  udpdiscovery::Peer reactor_peer;
+  assert(reactor_peer.Start(peer_parameters, "reactor peer", 0, &reactor));
+  wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ StatIsPositiveCallable(
+                     reactor_peer, &udpdiscovery::PeerStats::own_packets));
+  assert(wait_result.is_timeout == false);
+  wait_result = Wait<bool>(
+      /* timeout = */ 5000, /* sleep_timeout = */ 50,
+      /* callable= */ StatIsPositiveCallable(
+          reactor_peer, &udpdiscovery::PeerStats::unsupported_version));
+  assert(wait_result.is_timeout == false);
+  stats = reactor_peer.GetStats();
+  assert(stats.datagrams_received() >=
+         stats.own_packets() + stats.unsupported_version());
+  assert(stats.other_application_id() == 0);
+  reactor_peer.StopAndWaitForThreads();
+  reactor.Stop();
+
+  v0_peer.StopAndWaitForThreads();
+  other_peer.StopAndWaitForThreads();
+  peer1.StopAndWaitForThreads();
+}
+
+// Blocks the dispatching thread in its first callback.
+class SlowObserver : public udpdiscovery::PeerObserver {
+ public:
+  SlowObserver() : num_calls_(0) {}
+
+  void OnPeerJoined(const udpdiscovery::DiscoveredPeer& /* peer */) {
+    if (udpdiscovery::impl::AtomicIncrement(&num_calls_) == 1) {
+      udpdiscovery::impl::SleepFor(1000);
+    }
+  }
+
+ private:
+  volatile long num_calls_;
+};
+
+// Events that don't fit into the queue of the dispatching thread are counted.
+void peer_observer_queue_overflow() {
+  udpdiscovery::PeerParameters peer_parameters;
+  peer_parameters.set_can_discover(true);
+  peer_parameters.set_can_be_discovered(true);
+  peer_parameters.set_port(kPort);
+  peer_parameters.set_application_id(kApplicationId);
+  peer_parameters.set_send_timeout_ms(100);
+
+  udpdiscovery::PeerParameters observed_parameters = peer_parameters;
+  observed_parameters.set_observer_dispatch_mode(
+      udpdiscovery::PeerParameters::kObserverDispatchThread);
+  observed_parameters.set_observer_queue_size(1);
+
+  SlowObserver observer;
+  udpdiscovery::Peer peer1;
+  assert(peer1.Start(observed_parameters, "peer 1", &observer));
+  assert(peer1.GetStats().dropped_events() == 0);
+
+  udpdiscovery::Peer peers[3];
+  const char* user_datas[] = {"peer 2", "peer 3", "peer 4"};
+  for (int i = 0; i < 3; ++i) {
+    assert(peers[i].Start(peer_parameters, user_datas[i]));
+  }
+
+  WaitResult<bool> wait_result =
+      Wait<bool>(/* timeout = */ 5000, /* sleep_timeout = */ 50,
+                 /* callable= */ StatIsPositiveCallable(
+                     peer1, &udpdiscovery::PeerStats::dropped_events));
+  assert(wait_result.is_timeout == false);
+
+  for (int i = 0; i < 3; ++i) {
+    peers[i].StopAndWaitForThreads();
+  }
+  peer1.StopAndWaitForThreads();
+}
+
 int main() {
   peer_udp_broadcast_discovery();
   peer_udp_multicast_discovery();
+  peer_unicast_targets();
   peer_change_user_data();
+  peer_user_data_propagation(udpdiscovery::PeerParameters::kEngineThreads);
+  peer_user_data_propagation(udpdiscovery::PeerParameters::kEngineEventLoop);
   peer_disappear();
   peer_V0_V1_discover();
+  peer_V1_V2_discover();
+  peer_reactor_V2_compressed();
+  peer_event_loop_engine();
+  peer_external_engine();
+  peer_external_engine_stall();
+  peer_reactor();
+  peer_reactor_application_ids();
+  peer_receive_workers();
+  peer_all_interfaces(/* use_multicast= */ false);
+  peer_all_interfaces(/* use_multicast= */ true);
+  peer_announcement_budget();
+  peer_send_jitter();
+  peer_probe_on_start();
+  peer_probe_discoverable_only();
+  peer_heartbeats();
+  peer_socket_filter();
+  peer_stats();
+  peer_observer(udpdiscovery::PeerParameters::kObserverDispatchInline);
+  peer_observer(udpdiscovery::PeerParameters::kObserverDispatchThread);
+  peer_observer_queue_overflow();
   return 0;
 }
@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 
+#include <vector>
+
+#include "udp_discovery_ip_port.hpp"
 #include "udp_discovery_protocol_version.hpp"
 
 namespace udpdiscovery {
@@ -13,6 +16,27 @@ namespace udpdiscovery {
       kSamePeerIpAndPort,
     };
 
+    enum ObserverDispatchMode {
+      // PeerObserver is called by the thread that detected the change.
+      kObserverDispatchInline,
+      // PeerObserver is called by a dedicated dispatching thread. Events are
+      // queued, when the queue is full new events are dropped and counted in
+      // PeerStats::dropped_events().
+      kObserverDispatchThread,
+    };
+
+    enum EngineMode {
+      // Separate threads for sending and receiving. The receiving thread
+      // checks for Stop() once a second.
+      kEngineThreads,
+      // One thread waits for datagrams, timers and Stop() in one poll loop.
+      kEngineEventLoop,
+      // No threads. The user waits for Peer::ReceiveSocket() and
+      // Peer::NextDeadline() in its own loop and calls Peer::Poll().
+      // PeerObserver is always called from Poll().
+      kEngineExternal,
+    };
+
    public:
     PeerParameters()
         : min_supported_protocol_version_(kProtocolVersionCurrent),
@@ -20,21 +44,35 @@ namespace udpdiscovery {
           application_id_(0),
           can_use_broadcast_(true),
           can_use_multicast_(false),
+          use_all_interfaces_(false),
+          use_socket_filter_(false),
           port_(0),
           multicast_group_address_(0),
           send_timeout_ms_(5000),
           discovered_peer_ttl_ms_(10000),
+          user_data_send_interval_ms_(100),
+          announcement_budget_per_second_(0),
+          send_jitter_percent_(0),
+          send_probe_on_start_(false),
+          probe_response_delay_ms_(10),
+          full_announcement_interval_ms_(0),
           can_be_discovered_(false),
           can_discover_(false),
           discover_self_(false),
-          same_peer_mode_(kSamePeerIpAndPort) {
+          same_peer_mode_(kSamePeerIpAndPort),
+          observer_dispatch_mode_(kObserverDispatchInline),
+          observer_queue_size_(1024),
+          changes_log_size_(1024),
+          receive_batch_size_(16),
+          engine_mode_(kEngineThreads),
+          num_receive_workers_(1) {
     }
 
-    ProtocolVersion min_supported_protocol_version() {
+    ProtocolVersion min_supported_protocol_version() const {
       return min_supported_protocol_version_;
     }
 
-    ProtocolVersion max_supported_protocol_version() {
+    ProtocolVersion max_supported_protocol_version() const {
       return max_supported_protocol_version_;
     }
 
@@ -72,6 +110,32 @@ namespace udpdiscovery {
       can_use_multicast_ = can_use_multicast;
     }
 
+    // Broadcast and multicast announcements are sent on every network
+    // interface that is up instead of the one chosen by the routing table:
+    // broadcast to the broadcast address of each interface and multicast
+    // through each interface. The multicast group is joined on each interface.
+    // Interfaces are listed once in Peer::Start().
+    bool use_all_interfaces() const {
+      return use_all_interfaces_;
+    }
+
+    void set_use_all_interfaces(bool use_all_interfaces) {
+      use_all_interfaces_ = use_all_interfaces;
+    }
+
+    // Attaches a classic BPF filter to the binding sockets that drops
+    // datagrams of other protocols, unsupported versions, other application
+    // ids and own packets, unless discover_self() is set, in the kernel.
+    // Linux only, ignored elsewhere and for binding sockets that a reactor
+    // shares between application ids.
+    bool use_socket_filter() const {
+      return use_socket_filter_;
+    }
+
+    void set_use_socket_filter(bool use_socket_filter) {
+      use_socket_filter_ = use_socket_filter;
+    }
+
     int port() const {
       return port_;
     }
@@ -88,6 +152,20 @@ namespace udpdiscovery {
       multicast_group_address_ = group_address;
     }
 
+    // Peers that receive announcements by unicast in addition to broadcast and
+    // multicast. Targets with port 0 use port().
+    const std::vector<IpPort>& unicast_targets() const {
+      return unicast_targets_;
+    }
+
+    void set_unicast_targets(const std::vector<IpPort>& unicast_targets) {
+      unicast_targets_ = unicast_targets;
+    }
+
+    void add_unicast_target(const IpPort& unicast_target) {
+      unicast_targets_.push_back(unicast_target);
+    }
+
     long send_timeout_ms() const {
       return send_timeout_ms_;
     }
@@ -108,6 +186,97 @@ namespace udpdiscovery {
       discovered_peer_ttl_ms_ = discovered_peer_ttl_ms;
     }
 
+    // Changed user data is announced immediately but not more often than
+    // once per this interval. Changes made within the interval are sent in
+    // one announcement.
+    long user_data_send_interval_ms() const {
+      return user_data_send_interval_ms_;
+    }
+
+    void set_user_data_send_interval_ms(long user_data_send_interval_ms) {
+      if (user_data_send_interval_ms < 0)
+        return;
+      user_data_send_interval_ms_ = user_data_send_interval_ms;
+    }
+
+    // If positive the interval between announcements grows with the number
+    // of discovered peers, so that the whole group sends about this many
+    // announcements per second, but is never shorter than send_timeout_ms().
+    // The ttl of discovered peers is widened in proportion to the interval.
+    // All peers of the application should use the same budget. 0 disables
+    // the adaptation.
+    int announcement_budget_per_second() const {
+      return announcement_budget_per_second_;
+    }
+
+    void set_announcement_budget_per_second(
+        int announcement_budget_per_second) {
+      if (announcement_budget_per_second < 0)
+        return;
+      announcement_budget_per_second_ = announcement_budget_per_second;
+    }
+
+    // If positive every interval between announcements is changed by a
+    // random value of up to this percent of it in both directions, so peers
+    // started together don't announce at the same moments. Announcements of
+    // different protocol versions are then sent with random delays within
+    // the same percent of the interval instead of at once.
+    int send_jitter_percent() const {
+      return send_jitter_percent_;
+    }
+
+    void set_send_jitter_percent(int send_jitter_percent) {
+      if (send_jitter_percent < 0 || send_jitter_percent > 100)
+        return;
+      send_jitter_percent_ = send_jitter_percent;
+    }
+
+    // A discovering peer sends kPacketProbe to its destinations when it
+    // starts. Discoverable peers that receive it answer with kPacketIAmHere
+    // sent to port() of the prober, so it doesn't wait for their next
+    // announcements. Peers that only can be discovered listen on port() for
+    // probes if this or full_announcement_interval_ms() is set. Off by
+    // default, so peers send nothing but announcements unless asked to.
+    bool send_probe_on_start() const {
+      return send_probe_on_start_;
+    }
+
+    void set_send_probe_on_start(bool send_probe_on_start) {
+      send_probe_on_start_ = send_probe_on_start;
+    }
+
+    // Answers to a probe are delayed by a random time of up to this value per
+    // discovered peer, but not longer than the interval between
+    // announcements.
+    long probe_response_delay_ms() const {
+      return probe_response_delay_ms_;
+    }
+
+    void set_probe_response_delay_ms(long probe_response_delay_ms) {
+      if (probe_response_delay_ms < 0)
+        return;
+      probe_response_delay_ms_ = probe_response_delay_ms;
+    }
+
+    // If positive regular announcements carry user data only once per this
+    // interval, the others are small kPacketHeartbeat packets with a tag of
+    // user data. Changed user data is still announced at once. A discovering
+    // peer that receives a heartbeat of an unknown peer or with a tag of
+    // other user data asks that peer for a full announcement with a probe.
+    // Peers of versions without heartbeats drop them, so at least two full
+    // announcements are sent per discovered_peer_ttl_ms(): the interval is
+    // clamped to half of the ttl. 0 sends user data in every announcement.
+    long full_announcement_interval_ms() const {
+      return full_announcement_interval_ms_;
+    }
+
+    void set_full_announcement_interval_ms(
+        long full_announcement_interval_ms) {
+      if (full_announcement_interval_ms < 0)
+        return;
+      full_announcement_interval_ms_ = full_announcement_interval_ms;
+    }
+
     bool can_be_discovered() const {
       return can_be_discovered_;
     }
@@ -140,20 +309,102 @@ namespace udpdiscovery {
       same_peer_mode_ = same_peer_mode;
     }
 
+    ObserverDispatchMode observer_dispatch_mode() const {
+      return observer_dispatch_mode_;
+    }
+
+    void set_observer_dispatch_mode(ObserverDispatchMode observer_dispatch_mode) {
+      observer_dispatch_mode_ = observer_dispatch_mode;
+    }
+
+    int observer_queue_size() const {
+      return observer_queue_size_;
+    }
+
+    void set_observer_queue_size(int observer_queue_size) {
+      if (observer_queue_size <= 0)
+        return;
+      observer_queue_size_ = observer_queue_size;
+    }
+
+    // Number of latest changes of discovered peers kept for
+    // Peer::ListChangesSince.
+    int changes_log_size() const {
+      return changes_log_size_;
+    }
+
+    void set_changes_log_size(int changes_log_size) {
+      if (changes_log_size <= 0)
+        return;
+      changes_log_size_ = changes_log_size;
+    }
+
+    // Maximum number of datagrams received and applied to discovered peers at
+    // once. On Linux datagrams are received with one recvmmsg call. Each
+    // datagram of the batch uses a receive buffer of the largest packet of
+    // the supported protocol versions: about 4 KiB with version 1 only and
+    // 32 KiB with version 0 or 2.
+    int receive_batch_size() const {
+      return receive_batch_size_;
+    }
+
+    void set_receive_batch_size(int receive_batch_size) {
+      if (receive_batch_size <= 0)
+        return;
+      receive_batch_size_ = receive_batch_size;
+    }
+
+    EngineMode engine_mode() const {
+      return engine_mode_;
+    }
+
+    void set_engine_mode(EngineMode engine_mode) {
+      engine_mode_ = engine_mode;
+    }
+
+    // Number of receiving threads of kEngineThreads. Each worker receives
+    // from its own socket, the sockets share port() as a SO_REUSEPORT group.
+    // Discovered peers are split into the same number of shards by address,
+    // so workers that refresh known peers don't wait for each other.
+    int num_receive_workers() const {
+      return num_receive_workers_;
+    }
+
+    void set_num_receive_workers(int num_receive_workers) {
+      if (num_receive_workers <= 0)
+        return;
+      num_receive_workers_ = num_receive_workers;
+    }
+
    private:
     ProtocolVersion min_supported_protocol_version_;
     ProtocolVersion max_supported_protocol_version_;
     uint32_t application_id_;
     bool can_use_broadcast_;
     bool can_use_multicast_;
+    bool use_all_interfaces_;
+    bool use_socket_filter_;
     int port_;
     unsigned int multicast_group_address_;
+    std::vector<IpPort> unicast_targets_;
     long send_timeout_ms_;
     long discovered_peer_ttl_ms_;
+    long user_data_send_interval_ms_;
+    int announcement_budget_per_second_;
+    int send_jitter_percent_;
+    bool send_probe_on_start_;
+    long probe_response_delay_ms_;
+    long full_announcement_interval_ms_;
     bool can_be_discovered_;
     bool can_discover_;
     bool discover_self_;
     SamePeerMode same_peer_mode_;
+    ObserverDispatchMode observer_dispatch_mode_;
+    int observer_queue_size_;
+    int changes_log_size_;
+    int receive_batch_size_;
+    EngineMode engine_mode_;
+    int num_receive_workers_;
   };
 }
 
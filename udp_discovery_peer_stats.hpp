@@ -0,0 +1,228 @@
+#ifndef __UDP_DISCOVERY_PEER_STATS_H_
+#define __UDP_DISCOVERY_PEER_STATS_H_
+
+#include <stdint.h>
+
+#include "udp_discovery_ip_port.hpp"
+
+namespace udpdiscovery {
+  class DestinationStats {
+   public:
+    DestinationStats()
+        : interface_address_(0), packets_sent_(0), send_errors_(0) {
+    }
+
+    // Address the peer sends announcements to (broadcast, multicast group or
+    // unicast target).
+    IpPort destination() const {
+      return destination_;
+    }
+
+    void set_destination(const IpPort& destination) {
+      destination_ = destination;
+    }
+
+    // Address of the interface multicast packets are sent from, 0 if the
+    // interface is chosen by the routing table.
+    unsigned int interface_address() const {
+      return interface_address_;
+    }
+
+    void set_interface_address(unsigned int interface_address) {
+      interface_address_ = interface_address;
+    }
+
+    uint64_t packets_sent() const {
+      return packets_sent_;
+    }
+
+    void set_packets_sent(uint64_t packets_sent) {
+      packets_sent_ = packets_sent;
+    }
+
+    uint64_t send_errors() const {
+      return send_errors_;
+    }
+
+    void set_send_errors(uint64_t send_errors) {
+      send_errors_ = send_errors;
+    }
+
+   private:
+    IpPort destination_;
+    unsigned int interface_address_;
+    uint64_t packets_sent_;
+    uint64_t send_errors_;
+  };
+
+  // Snapshot of counters of a peer, see Peer::GetStats(). Counters are
+  // updated without locks and read one by one, so the snapshot is not
+  // atomic as a whole.
+  class PeerStats {
+   public:
+    PeerStats()
+        : datagrams_received_(0),
+          parse_errors_(0),
+          unsupported_version_(0),
+          other_application_id_(0),
+          own_packets_(0),
+          packets_sent_(0),
+          send_errors_(0),
+          peers_added_(0),
+          peers_updated_(0),
+          peers_left_(0),
+          peers_expired_(0),
+          num_discovered_peers_(0),
+          user_data_bytes_(0),
+          dropped_events_(0) {
+    }
+
+    // Datagrams received by the peer. With a PeerReactor only those of the
+    // application id of the peer are counted, the counters below of
+    // datagrams that fail to parse or have other application ids stay 0.
+    uint64_t datagrams_received() const {
+      return datagrams_received_;
+    }
+
+    void set_datagrams_received(uint64_t datagrams_received) {
+      datagrams_received_ = datagrams_received;
+    }
+
+    // Datagrams that failed Packet::Parse(), including unknown protocols.
+    uint64_t parse_errors() const {
+      return parse_errors_;
+    }
+
+    void set_parse_errors(uint64_t parse_errors) {
+      parse_errors_ = parse_errors;
+    }
+
+    // Packets of protocol versions the peer doesn't support.
+    uint64_t unsupported_version() const {
+      return unsupported_version_;
+    }
+
+    void set_unsupported_version(uint64_t unsupported_version) {
+      unsupported_version_ = unsupported_version;
+    }
+
+    // Packets of other application ids.
+    uint64_t other_application_id() const {
+      return other_application_id_;
+    }
+
+    void set_other_application_id(uint64_t other_application_id) {
+      other_application_id_ = other_application_id;
+    }
+
+    // Own packets of the peer dropped when discover_self() is false.
+    uint64_t own_packets() const {
+      return own_packets_;
+    }
+
+    void set_own_packets(uint64_t own_packets) {
+      own_packets_ = own_packets;
+    }
+
+    // Datagrams sent: announcements to all destinations and unicast answers.
+    uint64_t packets_sent() const {
+      return packets_sent_;
+    }
+
+    void set_packets_sent(uint64_t packets_sent) {
+      packets_sent_ = packets_sent;
+    }
+
+    // Failed sends to destinations of announcements.
+    uint64_t send_errors() const {
+      return send_errors_;
+    }
+
+    void set_send_errors(uint64_t send_errors) {
+      send_errors_ = send_errors;
+    }
+
+    // Discovered peers added to the table.
+    uint64_t peers_added() const {
+      return peers_added_;
+    }
+
+    void set_peers_added(uint64_t peers_added) {
+      peers_added_ = peers_added;
+    }
+
+    // Changes of user data of discovered peers.
+    uint64_t peers_updated() const {
+      return peers_updated_;
+    }
+
+    void set_peers_updated(uint64_t peers_updated) {
+      peers_updated_ = peers_updated;
+    }
+
+    // Discovered peers removed by their kPacketIAmOutOfHere.
+    uint64_t peers_left() const {
+      return peers_left_;
+    }
+
+    void set_peers_left(uint64_t peers_left) {
+      peers_left_ = peers_left;
+    }
+
+    // Discovered peers removed after the ttl.
+    uint64_t peers_expired() const {
+      return peers_expired_;
+    }
+
+    void set_peers_expired(uint64_t peers_expired) {
+      peers_expired_ = peers_expired;
+    }
+
+    // Gauge: discovered peers in the table.
+    uint64_t num_discovered_peers() const {
+      return num_discovered_peers_;
+    }
+
+    void set_num_discovered_peers(uint64_t num_discovered_peers) {
+      num_discovered_peers_ = num_discovered_peers;
+    }
+
+    // Gauge: bytes of user data of discovered peers in the table.
+    uint64_t user_data_bytes() const {
+      return user_data_bytes_;
+    }
+
+    void set_user_data_bytes(uint64_t user_data_bytes) {
+      user_data_bytes_ = user_data_bytes;
+    }
+
+    // Events for the observer dropped because the queue of the dispatching
+    // thread was full. After a drop the observer's view may differ from
+    // Peer::ListDiscovered().
+    uint64_t dropped_events() const {
+      return dropped_events_;
+    }
+
+    void set_dropped_events(uint64_t dropped_events) {
+      dropped_events_ = dropped_events;
+    }
+
+   private:
+    uint64_t datagrams_received_;
+    uint64_t parse_errors_;
+    uint64_t unsupported_version_;
+    uint64_t other_application_id_;
+    uint64_t own_packets_;
+    uint64_t packets_sent_;
+    uint64_t send_errors_;
+    uint64_t peers_added_;
+    uint64_t peers_updated_;
+    uint64_t peers_left_;
+    uint64_t peers_expired_;
+    uint64_t num_discovered_peers_;
+    uint64_t user_data_bytes_;
+    uint64_t dropped_events_;
+  };
+}
+
+#endif
@@ -0,0 +1,149 @@
+#include "udp_discovery_peers_table.hpp"
+
+namespace udpdiscovery {
+namespace impl {
+DiscoveredPeersTable::DiscoveredPeersTable()
+    : same_peer_mode_(PeerParameters::kSamePeerIpAndPort) {}
+
+DiscoveredPeersTable::DiscoveredPeersTable(
+    PeerParameters::SamePeerMode same_peer_mode)
+    : same_peer_mode_(same_peer_mode) {}
+
+DiscoveredPeersTable::Iterator DiscoveredPeersTable::Find(
+    const IpPort& ip_port) {
+  Iterator* found = index_.Find(makeKey(ip_port));
+  if (!found) {
+    return peers_.end();
+  }
+  return *found;
+}
+
+DiscoveredPeersTable::ConstIterator DiscoveredPeersTable::Find(
+    const IpPort& ip_port) const {
+  const Iterator* found = index_.Find(makeKey(ip_port));
+  if (!found) {
+    return peers_.end();
+  }
+  return *found;
+}
+
+DiscoveredPeersTable::Iterator DiscoveredPeersTable::Add(
+    const IpPort& ip_port) {
+  IpPort key = makeKey(ip_port);
+
+  Iterator* found = index_.Find(key);
+  if (found) {
+    return *found;
+  }
+
+  peers_.push_back(DiscoveredPeer());
+  Iterator it = peers_.end();
+  --it;
+  (*it).set_ip_port(ip_port);
+
+  index_.Insert(key, it);
+
+  return it;
+}
+
+bool DiscoveredPeersTable::Remove(const IpPort& ip_port) {
+  Iterator it = Find(ip_port);
+  if (it == peers_.end()) {
+    return false;
+  }
+
+  Remove(it);
+  return true;
+}
+
+DiscoveredPeersTable::Iterator DiscoveredPeersTable::Remove(Iterator it) {
+  index_.Erase(makeKey((*it).ip_port()));
+  return peers_.erase(it);
+}
+
+void DiscoveredPeersTable::Touch(Iterator it, long cur_time_ms) {
+  (*it).set_last_updated(cur_time_ms);
+
+  Iterator next = it;
+  ++next;
+  if (next != peers_.end()) {
+    // Splicing keeps iterators stored in the index valid.
+    peers_.splice(peers_.end(), peers_, it);
+  }
+}
+
+size_t DiscoveredPeersTable::RemoveExpired(
+    long cur_time_ms, long ttl_ms, std::list<DiscoveredPeer>* removed_out) {
+  size_t num_removed = 0;
+  while (!peers_.empty()) {
+    Iterator it = peers_.begin();
+    if (cur_time_ms - (*it).last_updated() <= ttl_ms) {
+      break;
+    }
+
+    if (removed_out) {
+      removed_out->push_back(*it);
+    }
+    Remove(it);
+    ++num_removed;
+  }
+  return num_removed;
+}
+
+bool DiscoveredPeersTable::NextExpirationTime(long ttl_ms,
+                                              long& expiration_time_out) const {
+  if (peers_.empty()) {
+    return false;
+  }
+
+  // Peers are removed when more than ttl_ms passed.
+  expiration_time_out = peers_.front().last_updated() + ttl_ms + 1;
+  return true;
+}
+
+void DiscoveredPeersTable::Clear() {
+  index_.Clear();
+  peers_.clear();
+}
+
+IpPort DiscoveredPeersTable::makeKey(const IpPort& ip_port) const {
+  switch (same_peer_mode_) {
+    case PeerParameters::kSamePeerIp:
+      return IpPort(ip_port.ip(), 0);
+
+    case PeerParameters::kSamePeerIpAndPort:
+      return ip_port;
+  }
+
+  return ip_port;
+}
+
+DiscoveredPeersChangeLog::DiscoveredPeersChangeLog(size_t capacity)
+    : changes_(capacity > 0 ? capacity : 1), generation_(0) {}
+
+const DiscoveredPeerChange& DiscoveredPeersChangeLog::Add(
+    DiscoveredPeerChange::Type type, const DiscoveredPeer& peer) {
+  ++generation_;
+
+  DiscoveredPeerChange& change = changes_[generation_ % changes_.size()];
+  change = DiscoveredPeerChange(type, generation_, peer);
+  return change;
+}
+
+bool DiscoveredPeersChangeLog::ListChangesSince(
+    uint64_t generation, std::list<DiscoveredPeerChange>* changes_out) const {
+  if (generation > generation_) {
+    return false;
+  }
+
+  if (generation_ - generation > changes_.size()) {
+    return false;
+  }
+
+  for (uint64_t g = generation + 1; g <= generation_; ++g) {
+    changes_out->push_back(changes_[g % changes_.size()]);
+  }
+  return true;
+}
+}  // namespace impl
+}  // namespace udpdiscovery
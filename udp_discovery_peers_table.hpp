@@ -0,0 +1,126 @@
+#ifndef __UDP_DISCOVERY_PEERS_TABLE_H_
+#define __UDP_DISCOVERY_PEERS_TABLE_H_
+
+#include <stddef.h>
+
+#include <list>
+#include <vector>
+
+#include "udp_discovery_discovered_peer.hpp"
+#include "udp_discovery_hash_map.hpp"
+#include "udp_discovery_peer_parameters.hpp"
+
+namespace udpdiscovery {
+namespace impl {
+struct IpPortHash {
+  size_t operator()(const IpPort& ip_port) const {
+    uint32_t h = (uint32_t)ip_port.ip() * 0x9e3779b1u;
+    h ^= (uint32_t)ip_port.port() + 0x7f4a7c15u + (h << 6) + (h >> 2);
+    return (size_t)h;
+  }
+};
+
+// Table of discovered peers indexed by the ip/port of the peer according to
+// PeerParameters::SamePeerMode. Lookups, additions and removals are O(1).
+// The table is not thread safe, the owner should serialize access.
+//
+// Peers are kept ordered by last_updated(): Touch() moves the refreshed peer
+// to the end of the list. As every peer has the same ttl the front of the list
+// is always the next peer to expire, so refreshing is O(1) and expiration
+// costs O(1) per expired peer.
+class DiscoveredPeersTable {
+ public:
+  typedef std::list<DiscoveredPeer>::iterator Iterator;
+  typedef std::list<DiscoveredPeer>::const_iterator ConstIterator;
+
+  DiscoveredPeersTable();
+
+  explicit DiscoveredPeersTable(PeerParameters::SamePeerMode same_peer_mode);
+
+  PeerParameters::SamePeerMode same_peer_mode() const {
+    return same_peer_mode_;
+  }
+
+  size_t size() const { return peers_.size(); }
+
+  bool empty() const { return peers_.empty(); }
+
+  Iterator begin() { return peers_.begin(); }
+
+  Iterator end() { return peers_.end(); }
+
+  ConstIterator begin() const { return peers_.begin(); }
+
+  ConstIterator end() const { return peers_.end(); }
+
+  const std::list<DiscoveredPeer>& peers() const { return peers_; }
+
+  // Returns end() if there is no such peer.
+  Iterator Find(const IpPort& ip_port);
+
+  ConstIterator Find(const IpPort& ip_port) const;
+
+  // Adds a peer with the given ip/port or returns the existing one. New peers
+  // are added to the end of the list, Touch() them to set last_updated().
+  Iterator Add(const IpPort& ip_port);
+
+  // Sets last_updated() of the peer and moves it to the end of the expiration
+  // order. Callers should pass non-decreasing times.
+  void Touch(Iterator it, long cur_time_ms);
+
+  // Removes peers that were not updated for more than ttl_ms. Returns the
+  // number of removed peers. If removed_out is not null removed peers are
+  // appended to it.
+  size_t RemoveExpired(long cur_time_ms, long ttl_ms,
+                       std::list<DiscoveredPeer>* removed_out);
+
+  // Returns false if the table is empty. Otherwise returns the time when the
+  // first peer will expire.
+  bool NextExpirationTime(long ttl_ms, long& expiration_time_out) const;
+
+  bool Remove(const IpPort& ip_port);
+
+  // Returns the iterator following the removed one.
+  Iterator Remove(Iterator it);
+
+  void Clear();
+
+ private:
+  // The index holds iterators of peers_, a copy would point into the list of
+  // the original.
+  DiscoveredPeersTable(const DiscoveredPeersTable&);
+  DiscoveredPeersTable& operator=(const DiscoveredPeersTable&);
+
+  IpPort makeKey(const IpPort& ip_port) const;
+
+ private:
+  PeerParameters::SamePeerMode same_peer_mode_;
+  std::list<DiscoveredPeer> peers_;
+  HashMap<IpPort, Iterator, IpPortHash> index_;
+};
+
+// Bounded ring of the latest changes of the discovered peers table. Every
+// change gets the next generation number.
+class DiscoveredPeersChangeLog {
+ public:
+  explicit DiscoveredPeersChangeLog(size_t capacity);
+
+  uint64_t generation() const { return generation_; }
+
+  // Returns the added change.
+  const DiscoveredPeerChange& Add(DiscoveredPeerChange::Type type,
+                                  const DiscoveredPeer& peer);
+
+  // Appends changes made after the given generation. Returns false if some of
+  // these changes are not in the log anymore or if the generation is unknown.
+  bool ListChangesSince(uint64_t generation,
+                        std::list<DiscoveredPeerChange>* changes_out) const;
+
+ private:
+  std::vector<DiscoveredPeerChange> changes_;
+  uint64_t generation_;
+};
+}  // namespace impl
+}  // namespace udpdiscovery
+
+#endif
@@ -0,0 +1,153 @@
+#include "udp_discovery_peers_table.hpp"
+
+#undef NDEBUG
+#include <assert.h>
+
+void peersTable_Add_Find() {
+  udpdiscovery::impl::DiscoveredPeersTable table;
+
+  udpdiscovery::IpPort ip_port(0x7f000001, 12021);
+  assert(table.Find(ip_port) == table.end());
+
+  udpdiscovery::impl::DiscoveredPeersTable::Iterator it = table.Add(ip_port);
+  (*it).SetUserData("user data", 1);
+  assert(table.size() == 1);
+
+  udpdiscovery::impl::DiscoveredPeersTable::Iterator found =
+      table.Find(ip_port);
+  assert(found != table.end());
+  assert((*found).ip_port() == ip_port);
+  assert((*found).user_data() == "user data");
+
+  // Adding the same peer once more returns the existing entry.
+  assert(table.Add(ip_port) == found);
+  assert(table.size() == 1);
+
+  assert(table.Find(udpdiscovery::IpPort(0x7f000001, 12022)) == table.end());
+}
+
+void peersTable_SamePeerIp_ignoresPort() {
+  udpdiscovery::impl::DiscoveredPeersTable table(
+      udpdiscovery::PeerParameters::kSamePeerIp);
+
+  table.Add(udpdiscovery::IpPort(0x7f000001, 12021));
+  assert(table.Find(udpdiscovery::IpPort(0x7f000001, 5000)) != table.end());
+  assert(table.Find(udpdiscovery::IpPort(0x7f000002, 12021)) == table.end());
+
+  table.Add(udpdiscovery::IpPort(0x7f000001, 5000));
+  assert(table.size() == 1);
+}
+
+void peersTable_Remove() {
+  udpdiscovery::impl::DiscoveredPeersTable table;
+
+  for (unsigned int i = 0; i < 1000; ++i) {
+    table.Add(udpdiscovery::IpPort(0x0a000000 + i, 12021));
+  }
+  assert(table.size() == 1000);
+
+  for (unsigned int i = 0; i < 1000; i += 2) {
+    assert(table.Remove(udpdiscovery::IpPort(0x0a000000 + i, 12021)));
+  }
+  assert(table.size() == 500);
+  assert(!table.Remove(udpdiscovery::IpPort(0x0a000000, 12021)));
+
+  for (unsigned int i = 0; i < 1000; ++i) {
+    bool found = table.Find(udpdiscovery::IpPort(0x0a000000 + i, 12021)) !=
+                 table.end();
+    assert(found == (i % 2 == 1));
+  }
+
+  udpdiscovery::impl::DiscoveredPeersTable::Iterator it = table.begin();
+  while (it != table.end()) {
+    it = table.Remove(it);
+  }
+  assert(table.empty());
+  assert(table.Find(udpdiscovery::IpPort(0x0a000001, 12021)) == table.end());
+}
+
+void peersTable_Touch_RemoveExpired() {
+  udpdiscovery::impl::DiscoveredPeersTable table;
+
+  udpdiscovery::IpPort ip_port1(0x7f000001, 1);
+  udpdiscovery::IpPort ip_port2(0x7f000001, 2);
+  udpdiscovery::IpPort ip_port3(0x7f000001, 3);
+
+  table.Touch(table.Add(ip_port1), 100);
+  table.Touch(table.Add(ip_port2), 200);
+  table.Touch(table.Add(ip_port3), 300);
+
+  long expiration_time = 0;
+  assert(table.NextExpirationTime(1000, expiration_time));
+  assert(expiration_time == 1101);
+
+  // Refreshing the first peer makes the second one the next to expire.
+  table.Touch(table.Find(ip_port1), 400);
+  assert(table.NextExpirationTime(1000, expiration_time));
+  assert(expiration_time == 1201);
+
+  assert(table.RemoveExpired(1200, 1000, 0) == 0);
+
+  std::list<udpdiscovery::DiscoveredPeer> removed;
+  assert(table.RemoveExpired(1301, 1000, &removed) == 2);
+  assert(removed.size() == 2);
+  assert(removed.front().ip_port() == ip_port2);
+  assert(removed.back().ip_port() == ip_port3);
+
+  assert(table.size() == 1);
+  assert(table.Find(ip_port1) != table.end());
+
+  assert(table.RemoveExpired(1401, 1000, 0) == 1);
+  assert(table.empty());
+  assert(!table.NextExpirationTime(1000, expiration_time));
+}
+
+void changeLog_ListChangesSince() {
+  udpdiscovery::impl::DiscoveredPeersChangeLog log(4);
+  assert(log.generation() == 0);
+
+  std::list<udpdiscovery::DiscoveredPeerChange> changes;
+  assert(log.ListChangesSince(0, &changes));
+  assert(changes.empty());
+
+  udpdiscovery::DiscoveredPeer peer;
+  peer.set_ip_port(udpdiscovery::IpPort(0x7f000001, 1));
+  log.Add(udpdiscovery::DiscoveredPeerChange::kAdded, peer);
+  log.Add(udpdiscovery::DiscoveredPeerChange::kUserDataChanged, peer);
+  log.Add(udpdiscovery::DiscoveredPeerChange::kRemoved, peer);
+  assert(log.generation() == 3);
+
+  assert(log.ListChangesSince(1, &changes));
+  assert(changes.size() == 2);
+  assert(changes.front().type() ==
+         udpdiscovery::DiscoveredPeerChange::kUserDataChanged);
+  assert(changes.front().generation() == 2);
+  assert(changes.back().type() == udpdiscovery::DiscoveredPeerChange::kRemoved);
+  assert(changes.back().generation() == 3);
+
+  changes.clear();
+  assert(log.ListChangesSince(3, &changes));
+  assert(changes.empty());
+
+  // Unknown generation.
+  assert(!log.ListChangesSince(4, &changes));
+
+  log.Add(udpdiscovery::DiscoveredPeerChange::kAdded, peer);
+  log.Add(udpdiscovery::DiscoveredPeerChange::kRemoved, peer);
+  assert(log.generation() == 5);
+
+  // Changes 2..5 are still in the log, change 1 is overwritten.
+  assert(log.ListChangesSince(1, &changes));
+  assert(changes.size() == 4);
+  assert(changes.front().generation() == 2);
+  changes.clear();
+  assert(!log.ListChangesSince(0, &changes));
+}
+
+int main() {
+  peersTable_Add_Find();
+  peersTable_SamePeerIp_ignoresPort();
+  peersTable_Remove();
+  peersTable_Touch_RemoveExpired();
+  changeLog_ListChangesSince();
+}
@@ -24,11 +24,191 @@ bool SerializeString(SerializeDirection direction, std::string* value,
   return true;
 }
 
+static const size_t kMinMatchLength = 4;
+static const size_t kMaxMatchOffset = 65535;
+static const int kHashBits = 12;
+
+static uint32_t LoadNative32(const char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static void AppendLength(size_t length, std::string& out) {
+  while (length >= 255) {
+    out.push_back((char)255);
+    length -= 255;
+  }
+  out.push_back((char)length);
+}
+
+static size_t LengthSize(size_t length) { return length / 255 + 1; }
+
+// Size of the sequence appended by AppendSequence().
+static size_t SequenceSize(size_t num_literals, size_t match_length) {
+  size_t size = 1 + num_literals;
+  if (num_literals >= 15) {
+    size += LengthSize(num_literals - 15);
+  }
+  if (match_length) {
+    size += 2;
+    if (match_length - kMinMatchLength >= 15) {
+      size += LengthSize(match_length - kMinMatchLength - 15);
+    }
+  }
+  return size;
+}
+
+static void AppendSequence(const char* literals, size_t num_literals,
+                           size_t match_offset, size_t match_length,
+                           std::string& out) {
+  size_t match_code = match_length ? match_length - kMinMatchLength : 0;
+  uint8_t token = (uint8_t)(((num_literals < 15 ? num_literals : 15) << 4) |
+                            (match_code < 15 ? match_code : 15));
+  out.push_back((char)token);
+  if (num_literals >= 15) {
+    AppendLength(num_literals - 15, out);
+  }
+  out.append(literals, num_literals);
+
+  if (match_length == 0) {
+    return;
+  }
+  out.push_back((char)(match_offset & 0xff));
+  out.push_back((char)(match_offset >> 8));
+  if (match_code >= 15) {
+    AppendLength(match_code - 15, out);
+  }
+}
+
+bool CompressLz(const char* data, size_t size, size_t max_size,
+                std::string& out) {
+  size_t out_end = out.size() + max_size;
+  // Positions of the last 4-byte sequences by their hash. Stale or colliding
+  // positions are rejected by comparing the bytes.
+  uint32_t positions[1 << kHashBits];
+  memset(positions, 0, sizeof(positions));
+
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + kMinMatchLength <= size) {
+    uint32_t sequence = LoadNative32(data + pos);
+    uint32_t hash = (sequence * 2654435761u) >> (32 - kHashBits);
+    size_t candidate = positions[hash];
+    positions[hash] = (uint32_t)pos;
+
+    if (candidate < pos && pos - candidate <= kMaxMatchOffset &&
+        LoadNative32(data + candidate) == sequence) {
+      size_t match_length = kMinMatchLength;
+      while (pos + match_length < size &&
+             data[candidate + match_length] == data[pos + match_length]) {
+        ++match_length;
+      }
+
+      if (out.size() + SequenceSize(pos - anchor, match_length) > out_end) {
+        return false;
+      }
+      AppendSequence(data + anchor, pos - anchor, pos - candidate,
+                     match_length, out);
+      pos += match_length;
+      anchor = pos;
+    } else {
+      ++pos;
+    }
+  }
+
+  if (out.size() + SequenceSize(size - anchor, 0) > out_end) {
+    return false;
+  }
+  AppendSequence(data + anchor, size - anchor, 0, 0, out);
+  return true;
+}
+
+// Reads a length continued in the bytes after the token.
+static bool ReadLength(const uint8_t*& in, const uint8_t* in_end,
+                       size_t limit, size_t& length) {
+  while (true) {
+    if (in == in_end) {
+      return false;
+    }
+    uint8_t value = *in++;
+    length += value;
+    if (length > limit) {
+      return false;
+    }
+    if (value != 255) {
+      return true;
+    }
+  }
+}
+
+bool DecompressLz(const char* data, size_t size, char* out, size_t out_size) {
+  const uint8_t* in = (const uint8_t*)data;
+  const uint8_t* in_end = in + size;
+  size_t written = 0;
+
+  while (in < in_end) {
+    uint8_t token = *in++;
+
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 &&
+        !ReadLength(in, in_end, out_size, num_literals)) {
+      return false;
+    }
+    if (num_literals > (size_t)(in_end - in) ||
+        num_literals > out_size - written) {
+      return false;
+    }
+    memcpy(out + written, in, num_literals);
+    in += num_literals;
+    written += num_literals;
+
+    // The last sequence has only literals.
+    if (in == in_end) {
+      break;
+    }
+
+    if (in_end - in < 2) {
+      return false;
+    }
+    size_t match_offset = in[0] | ((size_t)in[1] << 8);
+    in += 2;
+    if (match_offset == 0 || match_offset > written) {
+      return false;
+    }
+
+    size_t match_length = token & 15;
+    if (match_length == 15 &&
+        !ReadLength(in, in_end, out_size, match_length)) {
+      return false;
+    }
+    match_length += kMinMatchLength;
+    if (match_length > out_size - written) {
+      return false;
+    }
+
+    // The match can overlap the bytes it produces.
+    const char* match = out + written - match_offset;
+    if (match_offset >= match_length) {
+      memcpy(out + written, match, match_length);
+    } else {
+      for (size_t i = 0; i < match_length; ++i) {
+        out[written + i] = match[i];
+      }
+    }
+    written += match_length;
+  }
+
+  return written == out_size;
+}
+
 ProtocolVersion GetProtocolVersion(uint8_t version) {
   if (version == kProtocolVersion0) {
     return kProtocolVersion0;
   } else if (version == kProtocolVersion1) {
     return kProtocolVersion1;
+  } else if (version == kProtocolVersion2) {
+    return kProtocolVersion2;
   }
   return kProtocolVersionUnknown;
 }
@@ -38,6 +218,10 @@ PacketType GetPacketType(uint8_t packet_type) {
     return kPacketIAmHere;
   } else if (packet_type == kPacketIAmOutOfHere) {
     return kPacketIAmOutOfHere;
+  } else if (packet_type == kPacketProbe) {
+    return kPacketProbe;
+  } else if (packet_type == kPacketHeartbeat) {
+    return kPacketHeartbeat;
   }
   return kPacketTypeUnknown;
 }
@@ -53,166 +237,245 @@ bool Packet::Serialize(ProtocolVersion protocol_version,
     if (user_data_.size() > kMaxUserDataSizeV1) {
       return false;
     }
+  } else if (protocol_version == kProtocolVersion2) {
+    if (user_data_.size() > kMaxUserDataSizeV2) {
+      return false;
+    }
   }
 
-  impl::BufferView buffer_view(&buffer_out);
-  return Serialize(protocol_version, impl::kSerialize, &buffer_view);
-}
+  char header[impl::kHeaderSizeV0];
+  size_t header_size = 0;
+  if (protocol_version == kProtocolVersion0) {
+    impl::StoreBigEndian32(impl::kMagicV0, header + impl::kHeaderMagicOffset);
+    header_size = impl::kHeaderSizeV0;
+  } else if (protocol_version == kProtocolVersion1 ||
+             protocol_version == kProtocolVersion2) {
+    impl::StoreBigEndian32(impl::kMagicV1, header + impl::kHeaderMagicOffset);
+    header_size = impl::kHeaderSizeV1;
+  } else {
+    return false;
+  }
 
-ProtocolVersion Packet::Parse(const std::string& buffer) {
-  impl::BufferView buffer_view(const_cast<std::string*>(&buffer));
+  header[impl::kHeaderVersionOffset] = (char)protocol_version;
+  header[impl::kHeaderVersionOffset + 1] = 0;
+  header[impl::kHeaderVersionOffset + 2] = 0;
+  header[impl::kHeaderVersionOffset + 3] = 0;
+  header[impl::kHeaderPacketTypeOffset] = (char)packet_type_;
+  impl::StoreBigEndian32(application_id_,
+                         header + impl::kHeaderApplicationIdOffset);
+  impl::StoreBigEndian32(peer_id_, header + impl::kHeaderPeerIdOffset);
+  impl::StoreBigEndian64(snapshot_index_,
+                         header + impl::kHeaderSnapshotIndexOffset);
+  impl::StoreBigEndian16((uint16_t)user_data_.size(),
+                         header + impl::kHeaderUserDataSizeOffset);
+  if (protocol_version == kProtocolVersion0) {
+    // Do not serialize padding even for protocol version 0.
+    impl::StoreBigEndian16(0, header + impl::kHeaderPaddingSizeOffsetV0);
+  }
 
-  uint8_t magic[4];
-  if (!impl::SerializeUnsignedIntegerBigEndian(impl::kParse, &magic[0],
-                                               &buffer_view)) {
-    return kProtocolVersionUnknown;
+  size_t header_begin = buffer_out.size();
+  buffer_out.append(header, header_size);
+
+  if (protocol_version == kProtocolVersion2 && !user_data_.empty()) {
+    size_t payload_begin = buffer_out.size();
+    char uncompressed_size[2];
+    impl::StoreBigEndian16((uint16_t)user_data_.size(), uncompressed_size);
+    buffer_out.append(uncompressed_size, sizeof(uncompressed_size));
+
+    // Compressed only if the payload with its size is smaller than user data.
+    size_t max_compressed_size =
+        user_data_.size() > 3 ? user_data_.size() - 3 : 0;
+    if (impl::CompressLz(user_data_.data(), user_data_.size(),
+                         max_compressed_size, buffer_out)) {
+      size_t payload_size = buffer_out.size() - payload_begin;
+      buffer_out[header_begin + impl::kHeaderFlagsOffsetV2] =
+          (char)impl::kFlagCompressedUserData;
+      impl::StoreBigEndian16(
+          (uint16_t)payload_size,
+          &buffer_out[header_begin + impl::kHeaderUserDataSizeOffset]);
+      return true;
+    }
+    buffer_out.resize(payload_begin);
   }
-  if (!impl::SerializeUnsignedIntegerBigEndian(impl::kParse, &magic[1],
-                                               &buffer_view)) {
-    return kProtocolVersionUnknown;
+
+  buffer_out.append(user_data_);
+  return true;
+}
+
+size_t MaxPacketSize(ProtocolVersion protocol_version) {
+  switch (protocol_version) {
+    case kProtocolVersion0:
+      return impl::kHeaderSizeV0 + kMaxUserDataSizeV0;
+    case kProtocolVersion1:
+      return impl::kHeaderSizeV1 + kMaxUserDataSizeV1;
+    case kProtocolVersion2:
+      return impl::kHeaderSizeV1 + kMaxUserDataSizeV2;
+    default:
+      return kMaxPacketSize;
   }
-  if (!impl::SerializeUnsignedIntegerBigEndian(impl::kParse, &magic[2],
-                                               &buffer_view)) {
-    return kProtocolVersionUnknown;
+}
+
+PacketView::PacketView(const PacketView& other)
+    : packet_type_(kPacketTypeUnknown),
+      application_id_(0),
+      peer_id_(0),
+      snapshot_index_(0),
+      user_data_(0),
+      user_data_size_(0) {
+  *this = other;
+}
+
+PacketView& PacketView::operator=(const PacketView& other) {
+  if (this == &other) {
+    return *this;
   }
-  if (!impl::SerializeUnsignedIntegerBigEndian(impl::kParse, &magic[3],
-                                               &buffer_view)) {
-    return kProtocolVersionUnknown;
+
+  packet_type_ = other.packet_type_;
+  application_id_ = other.application_id_;
+  peer_id_ = other.peer_id_;
+  snapshot_index_ = other.snapshot_index_;
+  user_data_size_ = other.user_data_size_;
+
+  // Decompressed user data lives in the buffer of the view, the copy points
+  // to its own copy of it instead of the buffer of other.
+  bool is_decompressed = !other.decompressed_user_data_.empty() &&
+                         other.user_data_ ==
+                             other.decompressed_user_data_.data();
+  if (is_decompressed) {
+    decompressed_user_data_ = other.decompressed_user_data_;
+    user_data_ = decompressed_user_data_.data();
+  } else {
+    user_data_ = other.user_data_;
+  }
+  return *this;
+}
+
+bool PacketView::UserDataEquals(const std::string& user_data) const {
+  if (user_data.size() != user_data_size_) {
+    return false;
   }
+  return user_data_size_ == 0 ||
+         memcmp(user_data.data(), user_data_, user_data_size_) == 0;
+}
 
-  uint8_t version = kProtocolVersion0;
-  if (!impl::SerializeUnsignedIntegerBigEndian(impl::kParse, &version,
-                                               &buffer_view)) {
+ProtocolVersion PacketView::Parse(const char* buffer, size_t size) {
+  // Both headers start with the same fields at the same offsets, so the header
+  // is read with a few word loads instead of field by field.
+  if (size < impl::kHeaderSizeV1) {
     return kProtocolVersionUnknown;
   }
 
   ProtocolVersion protocol_version = kProtocolVersionUnknown;
-  if (magic[0] == 'R' && magic[1] == 'N' && magic[2] == '6' &&
-      magic[3] == 'U') {
+  uint32_t magic = impl::LoadBigEndian32(buffer + impl::kHeaderMagicOffset);
+  if (magic == impl::kMagicV0) {
     protocol_version = kProtocolVersion0;
-  } else if (magic[0] == 'S' && magic[1] == 'O' && magic[2] == '7' &&
-             magic[3] == 'V') {
-    protocol_version = impl::GetProtocolVersion(version);
+  } else if (magic == impl::kMagicV1) {
+    protocol_version = impl::GetProtocolVersion(
+        (uint8_t)buffer[impl::kHeaderVersionOffset]);
     if (protocol_version == kProtocolVersionUnknown ||
         protocol_version == kProtocolVersion0) {
       return kProtocolVersionUnknown;
     }
-  }
-
-  if (protocol_version == kProtocolVersionUnknown) {
+  } else {
     return kProtocolVersionUnknown;
   }
 
-  if (!Serialize(protocol_version, impl::kParse, &buffer_view)) {
+  packet_type_ = (uint8_t)buffer[impl::kHeaderPacketTypeOffset];
+  if (impl::GetPacketType(packet_type_) == kPacketTypeUnknown) {
     return kProtocolVersionUnknown;
   }
 
-  return protocol_version;
-}
+  application_id_ =
+      impl::LoadBigEndian32(buffer + impl::kHeaderApplicationIdOffset);
+  peer_id_ = impl::LoadBigEndian32(buffer + impl::kHeaderPeerIdOffset);
+  snapshot_index_ =
+      impl::LoadBigEndian64(buffer + impl::kHeaderSnapshotIndexOffset);
+  uint16_t user_data_size =
+      impl::LoadBigEndian16(buffer + impl::kHeaderUserDataSizeOffset);
 
-bool Packet::Serialize(ProtocolVersion protocol_version,
-                       impl::SerializeDirection direction,
-                       impl::BufferView* buffer_view) {
-  if (direction == impl::kSerialize) {
-    if (protocol_version == kProtocolVersion0) {
-      buffer_view->push_back('R');
-      buffer_view->push_back('N');
-      buffer_view->push_back('6');
-      buffer_view->push_back('U');
-    } else if (protocol_version == kProtocolVersion1) {
-      buffer_view->push_back('S');
-      buffer_view->push_back('O');
-      buffer_view->push_back('7');
-      buffer_view->push_back('V');
-    } else {
-      return false;
+  size_t header_size = impl::kHeaderSizeV1;
+  uint16_t padding_size = 0;
+  uint8_t flags = 0;
+  if (protocol_version == kProtocolVersion0) {
+    if (user_data_size > kMaxUserDataSizeV0) {
+      return kProtocolVersionUnknown;
     }
 
-    uint8_t version = protocol_version;
-    impl::SerializeUnsignedIntegerBigEndian(impl::kSerialize, &version,
-                                            buffer_view);
-  }
-
-  uint8_t reserved = 0;
-  for (int i = 0; i < 3; ++i) {
-    if (!impl::SerializeUnsignedIntegerBigEndian(direction, &reserved,
-                                                 buffer_view)) {
-      return false;
+    header_size = impl::kHeaderSizeV0;
+    if (size < header_size) {
+      return kProtocolVersionUnknown;
     }
-  }
-
-  if (!impl::SerializeUnsignedIntegerBigEndian(direction, &packet_type_,
-                                               buffer_view)) {
-    return false;
-  }
 
-  if (direction == impl::kParse) {
-    if (impl::GetPacketType(packet_type_) == kPacketTypeUnknown) {
-      return false;
+    padding_size =
+        impl::LoadBigEndian16(buffer + impl::kHeaderPaddingSizeOffsetV0);
+    if (padding_size > kMaxPaddingSizeV0) {
+      return kProtocolVersionUnknown;
+    }
+  } else if (protocol_version == kProtocolVersion1) {
+    if (user_data_size > kMaxUserDataSizeV1) {
+      return kProtocolVersionUnknown;
+    }
+  } else if (protocol_version == kProtocolVersion2) {
+    if (user_data_size > kMaxUserDataSizeV2) {
+      return kProtocolVersionUnknown;
     }
-  }
-
-  if (!impl::SerializeUnsignedIntegerBigEndian(direction, &application_id_,
-                                               buffer_view)) {
-    return false;
-  }
 
-  if (!impl::SerializeUnsignedIntegerBigEndian(direction, &peer_id_,
-                                               buffer_view)) {
-    return false;
+    flags = (uint8_t)buffer[impl::kHeaderFlagsOffsetV2];
+    if ((flags & ~impl::kFlagCompressedUserData) != 0) {
+      return kProtocolVersionUnknown;
+    }
   }
 
-  if (!impl::SerializeUnsignedIntegerBigEndian(direction, &snapshot_index_,
-                                               buffer_view)) {
-    return false;
+  if (size - header_size != (size_t)user_data_size + padding_size) {
+    return kProtocolVersionUnknown;
   }
 
-  uint16_t user_data_size = (uint16_t)user_data_.size();
-  if (!impl::SerializeUnsignedIntegerBigEndian(direction, &user_data_size,
-                                               buffer_view)) {
-    return false;
-  }
+  user_data_ = buffer + header_size;
+  user_data_size_ = user_data_size;
 
-  if (direction == impl::kParse) {
-    if (protocol_version == kProtocolVersion0) {
-      if (user_data_size > kMaxUserDataSizeV0) {
-        return false;
-      }
-    } else if (protocol_version == kProtocolVersion1) {
-      if (user_data_size > kMaxUserDataSizeV1) {
-        return false;
-      }
+  if (flags & impl::kFlagCompressedUserData) {
+    if (user_data_size < 2) {
+      return kProtocolVersionUnknown;
     }
-  }
-
-  uint16_t padding_size = 0;
-  if (protocol_version == kProtocolVersion0) {
-    if (!impl::SerializeUnsignedIntegerBigEndian(direction, &padding_size,
-                                                 buffer_view)) {
-      return false;
+    uint16_t uncompressed_size = impl::LoadBigEndian16(user_data_);
+    if (uncompressed_size == 0 || uncompressed_size > kMaxUserDataSizeV2) {
+      return kProtocolVersionUnknown;
     }
 
-    if (padding_size > kMaxPaddingSizeV0) {
-      return false;
+    decompressed_user_data_.resize(uncompressed_size);
+    if (!impl::DecompressLz(user_data_ + 2, user_data_size - 2,
+                            &decompressed_user_data_[0], uncompressed_size)) {
+      return kProtocolVersionUnknown;
     }
+    user_data_ = decompressed_user_data_.data();
+    user_data_size_ = uncompressed_size;
   }
 
-  // End of serializing header.
-
-  if (direction == impl::kParse) {
-    if (buffer_view->LeftUnparsed() != user_data_size + padding_size) {
-      return false;
-    }
+  if (packet_type_ == kPacketHeartbeat &&
+      user_data_size_ != kHeartbeatUserDataSize) {
+    return kProtocolVersionUnknown;
   }
 
-  if (!impl::SerializeString(direction, &user_data_, user_data_size,
-                             buffer_view)) {
-    return false;
+  // Padding is ignored even for protocol version 0.
+
+  return protocol_version;
+}
+
+ProtocolVersion Packet::Parse(const std::string& buffer) {
+  PacketView packet_view;
+  ProtocolVersion protocol_version =
+      packet_view.Parse(buffer.data(), buffer.size());
+  if (protocol_version == kProtocolVersionUnknown) {
+    return kProtocolVersionUnknown;
   }
 
-  // Do not serialize padding even for protocol version 0.
+  packet_type_ = packet_view.packet_type();
+  application_id_ = packet_view.application_id();
+  peer_id_ = packet_view.peer_id();
+  snapshot_index_ = packet_view.snapshot_index();
+  user_data_.assign(packet_view.user_data(), packet_view.user_data_size());
 
-  return true;
+  return protocol_version;
 }
 
 }  // namespace udpdiscovery
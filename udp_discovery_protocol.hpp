@@ -2,6 +2,10 @@
 #define __UDP_DISCOVERY_PROTOCOL_H_
 
 #include <stdint.h>
+#include <string.h>
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#endif
 
 #include <string>
 
@@ -79,31 +83,225 @@ bool SerializeUnsignedIntegerBigEndian(SerializeDirection direction,
 
 bool SerializeString(SerializeDirection direction, std::string* value,
                      int value_size, BufferView* buffer_view);
+
+// Unaligned big endian loads and stores of whole words. Used by the fixed
+// layout header codec instead of reading and writing byte by byte.
+inline uint16_t ByteSwap16(uint16_t value) {
+  return (uint16_t)((value >> 8) | (value << 8));
+}
+
+inline uint32_t ByteSwap32(uint32_t value) {
+#if defined(_MSC_VER)
+  return _byteswap_ulong(value);
+#elif defined(__GNUC__)
+  return __builtin_bswap32(value);
+#else
+  return (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) |
+         (value << 24);
+#endif
+}
+
+inline uint64_t ByteSwap64(uint64_t value) {
+#if defined(_MSC_VER)
+  return _byteswap_uint64(value);
+#elif defined(__GNUC__)
+  return __builtin_bswap64(value);
+#else
+  return ((uint64_t)ByteSwap32((uint32_t)value) << 32) |
+         ByteSwap32((uint32_t)(value >> 32));
+#endif
+}
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && \
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define UDP_DISCOVERY_BIG_ENDIAN_HOST 1
+#endif
+
+inline uint16_t LoadBigEndian16(const char* p) {
+  uint16_t value;
+  memcpy(&value, p, sizeof(value));
+#if defined(UDP_DISCOVERY_BIG_ENDIAN_HOST)
+  return value;
+#else
+  return ByteSwap16(value);
+#endif
+}
+
+inline uint32_t LoadBigEndian32(const char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+#if defined(UDP_DISCOVERY_BIG_ENDIAN_HOST)
+  return value;
+#else
+  return ByteSwap32(value);
+#endif
+}
+
+inline uint64_t LoadBigEndian64(const char* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+#if defined(UDP_DISCOVERY_BIG_ENDIAN_HOST)
+  return value;
+#else
+  return ByteSwap64(value);
+#endif
+}
+
+inline void StoreBigEndian16(uint16_t value, char* p) {
+#if !defined(UDP_DISCOVERY_BIG_ENDIAN_HOST)
+  value = ByteSwap16(value);
+#endif
+  memcpy(p, &value, sizeof(value));
+}
+
+inline void StoreBigEndian32(uint32_t value, char* p) {
+#if !defined(UDP_DISCOVERY_BIG_ENDIAN_HOST)
+  value = ByteSwap32(value);
+#endif
+  memcpy(p, &value, sizeof(value));
+}
+
+inline void StoreBigEndian64(uint64_t value, char* p) {
+#if !defined(UDP_DISCOVERY_BIG_ENDIAN_HOST)
+  value = ByteSwap64(value);
+#endif
+  memcpy(p, &value, sizeof(value));
+}
+
+// Magic values of the packet header as big endian 32-bit words.
+const uint32_t kMagicV0 = 0x524e3655;  // "RN6U"
+const uint32_t kMagicV1 = 0x534f3756;  // "SO7V"
+
+// Offsets of the fields of the packet header. Protocol version 0 has the same
+// layout with the padding size after the user data size.
+const size_t kHeaderMagicOffset = 0;
+const size_t kHeaderVersionOffset = 4;
+const size_t kHeaderPacketTypeOffset = 8;
+const size_t kHeaderApplicationIdOffset = 9;
+const size_t kHeaderPeerIdOffset = 13;
+const size_t kHeaderSnapshotIndexOffset = 17;
+const size_t kHeaderUserDataSizeOffset = 25;
+const size_t kHeaderPaddingSizeOffsetV0 = 27;
+const size_t kHeaderSizeV0 = 29;
+const size_t kHeaderSizeV1 = 27;
+// Protocol version 2 has the layout of version 1 with flags in the first
+// reserved byte.
+const size_t kHeaderFlagsOffsetV2 = 5;
+
+// User data on the wire is the 16-bit big endian size of user data followed
+// by user data compressed with CompressLz.
+const uint8_t kFlagCompressedUserData = 1;
+
+// Appends data compressed with an LZ77 codec in the style of LZ4 blocks.
+// Every sequence is a token with the number of literals in the high nibble
+// and the match length minus 4 in the low nibble, longer lengths continue in
+// the next bytes that are added while equal to 255, the literals and the
+// 16-bit little endian offset of the match. The last sequence has only
+// literals. Returns false as soon as the compressed data would be longer than
+// max_size, out then ends with a part of it and never grows by more than
+// max_size bytes.
+bool CompressLz(const char* data, size_t size, size_t max_size,
+                std::string& out);
+
+// Decompresses exactly out_size bytes to out. Returns false if the data is
+// malformed or doesn't decompress to out_size bytes.
+bool DecompressLz(const char* data, size_t size, char* out, size_t out_size);
 }  // namespace impl
 
 const size_t kMaxUserDataSizeV0 = 32768;
 const size_t kMaxPaddingSizeV0 = 32768;
 const size_t kMaxUserDataSizeV1 = 4096;
-// Used for receiving buffer.
+// Limits both user data and its compressed form on the wire.
+const size_t kMaxUserDataSizeV2 = 32768;
+// Largest UDP datagram.
 const size_t kMaxPacketSize = 65536;
 
 namespace impl {
 ProtocolVersion GetProtocolVersion(uint8_t version);
 }  // namespace impl
 
+// Size of the largest valid packet of the protocol version, used to size
+// receive buffers. Padding of protocol version 0 is never sent and is not
+// counted.
+size_t MaxPacketSize(ProtocolVersion protocol_version);
+
 enum PacketType {
   kPacketIAmHere,
   kPacketIAmOutOfHere,
+  // Sent by a starting discoverer, discoverable peers answer with
+  // kPacketIAmHere to its address. Carries no user data.
+  kPacketProbe,
+  // Sent instead of kPacketIAmHere between full announcements. User data is
+  // the 32-bit big endian UserDataTag of the user data of the peer.
+  kPacketHeartbeat,
   kPacketTypeUnknown = 255
 };
 
+const size_t kHeartbeatUserDataSize = 4;
+
 namespace impl {
 PacketType GetPacketType(uint8_t packet_type);
+
+// 32-bit FNV-1a hash of user data that tags it in kPacketHeartbeat.
+inline uint32_t UserDataTag(const char* user_data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= (uint8_t)user_data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
 }  // namespace impl
 
+// Validates a received packet in place. Nothing is copied: user_data() points
+// into the parsed buffer, so the view is valid only while the buffer is alive
+// and unchanged. Compressed user data of protocol version 2 is decompressed
+// to the buffer of the view, a copy of the view gets its own copy of it.
+class PacketView {
+ public:
+  PacketView()
+      : packet_type_(kPacketTypeUnknown),
+        application_id_(0),
+        peer_id_(0),
+        snapshot_index_(0),
+        user_data_(0),
+        user_data_size_(0) {}
+
+  PacketView(const PacketView& other);
+
+  PacketView& operator=(const PacketView& other);
+
+  PacketType packet_type() const { return (PacketType)packet_type_; }
+
+  uint32_t application_id() const { return application_id_; }
+
+  uint32_t peer_id() const { return peer_id_; }
+
+  uint64_t snapshot_index() const { return snapshot_index_; }
+
+  const char* user_data() const { return user_data_; }
+
+  size_t user_data_size() const { return user_data_size_; }
+
+  bool UserDataEquals(const std::string& user_data) const;
+
+  // Parses the provided buffer and returns the detected protocol version. If
+  // parsing fails then kProtocolVersionUnknown is returned.
+  ProtocolVersion Parse(const char* buffer, size_t size);
+
+ private:
+  uint8_t packet_type_;
+  uint32_t application_id_;
+  uint32_t peer_id_;
+  uint64_t snapshot_index_;
+  const char* user_data_;
+  size_t user_data_size_;
+  std::string decompressed_user_data_;
+};
+
 class Packet {
  public:
-  PacketType packet_type() { return (PacketType)packet_type_; }
+  PacketType packet_type() const { return (PacketType)packet_type_; }
 
   void set_packet_type(PacketType packet_type) { packet_type_ = packet_type; }
 
@@ -135,18 +333,18 @@ class Packet {
   // to construct data on wire. This function should return false in the case
   // when it is not possible to convert the current packet representation to
   // the wire representation of the given version. The caller can reserve memory
-  // in the buffer_out and no memory will be allocated in this function.
+  // in the buffer_out and no memory will be allocated in this function. With
+  // protocol version 2 user data is compressed if that makes it smaller, the
+  // compressor writes to buffer_out directly and stops before it grows past
+  // the size of uncompressed user data, so reserving the header and the user
+  // data is enough. The only other memory it uses is a 16 KiB hash table on
+  // the stack.
   bool Serialize(ProtocolVersion protocol_version, std::string& buffer_out);
 
   // Parses the provided buffer and returns the detected protocol version. If
   // parsing fails then kProtocolVersionUnknown is returned.
   ProtocolVersion Parse(const std::string& buffer);
 
- private:
-  bool Serialize(ProtocolVersion protocol_version,
-                 impl::SerializeDirection direction,
-                 impl::BufferView* buffer_view);
-
  private:
   uint8_t packet_type_;
   uint32_t application_id_;
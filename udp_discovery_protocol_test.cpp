@@ -1,5 +1,9 @@
 #include "udp_discovery_protocol.hpp"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
 #undef NDEBUG
 #include <assert.h>
 
@@ -183,6 +187,483 @@ void protocol_Serialize_Parse_V1() {
   assert(packet.user_data() == user_data);
 }
 
+void protocol_PacketView_Parse_V1_pointsIntoBuffer() {
+  std::string user_data("user data");
+  std::string packet_buffer = CreatePacketV1(user_data);
+
+  udpdiscovery::PacketView packet_view;
+  assert(packet_view.Parse(packet_buffer.data(), packet_buffer.size()) ==
+         udpdiscovery::kProtocolVersion1);
+  assert(packet_view.packet_type() == udpdiscovery::kPacketIAmHere);
+  assert(packet_view.application_id() == kApplicationId);
+  assert(packet_view.peer_id() == kPeerId);
+  assert(packet_view.snapshot_index() == kSnapshotIndex);
+  assert(packet_view.user_data_size() == user_data.size());
+  assert(packet_view.user_data() ==
+         packet_buffer.data() + packet_buffer.size() - user_data.size());
+  assert(packet_view.UserDataEquals(user_data));
+  assert(!packet_view.UserDataEquals("user datA"));
+}
+
+void protocol_PacketView_Parse_withTruncatedPacket_fails() {
+  std::string packet_buffer = CreatePacketV1("user data");
+
+  udpdiscovery::PacketView packet_view;
+  for (size_t size = 0; size < packet_buffer.size(); ++size) {
+    assert(packet_view.Parse(packet_buffer.data(), size) ==
+           udpdiscovery::kProtocolVersionUnknown);
+  }
+}
+
+void protocol_Serialize_Parse_probe() {
+  udpdiscovery::Packet packet;
+  packet.set_packet_type(udpdiscovery::kPacketProbe);
+  packet.set_application_id(kApplicationId);
+  packet.set_peer_id(kPeerId);
+
+  for (int version = udpdiscovery::kProtocolVersion0;
+       version <= udpdiscovery::kProtocolVersion1; ++version) {
+    std::string buffer;
+    assert(packet.Serialize((udpdiscovery::ProtocolVersion)version, buffer));
+
+    udpdiscovery::PacketView packet_view;
+    assert(packet_view.Parse(buffer.data(), buffer.size()) == version);
+    assert(packet_view.packet_type() == udpdiscovery::kPacketProbe);
+    assert(packet_view.application_id() == kApplicationId);
+    assert(packet_view.peer_id() == kPeerId);
+    assert(packet_view.user_data_size() == 0);
+  }
+}
+
+void protocol_Serialize_Parse_heartbeat() {
+  std::string user_data("user data of the peer");
+  uint32_t tag = udpdiscovery::impl::UserDataTag(user_data.data(),
+                                                 user_data.size());
+  assert(tag != udpdiscovery::impl::UserDataTag("user data", 9));
+
+  char tag_data[udpdiscovery::kHeartbeatUserDataSize];
+  udpdiscovery::impl::StoreBigEndian32(tag, tag_data);
+
+  udpdiscovery::Packet packet;
+  packet.set_packet_type(udpdiscovery::kPacketHeartbeat);
+  packet.set_application_id(kApplicationId);
+  packet.set_peer_id(kPeerId);
+  packet.set_user_data(std::string(tag_data, sizeof(tag_data)));
+
+  for (int version = udpdiscovery::kProtocolVersion0;
+       version <= udpdiscovery::kProtocolVersion2; ++version) {
+    std::string buffer;
+    assert(packet.Serialize((udpdiscovery::ProtocolVersion)version, buffer));
+
+    udpdiscovery::PacketView packet_view;
+    assert(packet_view.Parse(buffer.data(), buffer.size()) == version);
+    assert(packet_view.packet_type() == udpdiscovery::kPacketHeartbeat);
+    assert(packet_view.peer_id() == kPeerId);
+    assert(packet_view.user_data_size() ==
+           udpdiscovery::kHeartbeatUserDataSize);
+    assert(udpdiscovery::impl::LoadBigEndian32(packet_view.user_data()) ==
+           tag);
+  }
+}
+
+void protocol_Parse_heartbeatWithoutTag_fails() {
+  udpdiscovery::Packet packet;
+  packet.set_packet_type(udpdiscovery::kPacketHeartbeat);
+  packet.set_application_id(kApplicationId);
+  packet.set_peer_id(kPeerId);
+  packet.set_user_data("user data of the peer");
+
+  std::string buffer;
+  assert(packet.Serialize(udpdiscovery::kProtocolVersion1, buffer));
+
+  udpdiscovery::PacketView packet_view;
+  assert(packet_view.Parse(buffer.data(), buffer.size()) ==
+         udpdiscovery::kProtocolVersionUnknown);
+}
+
+void protocol_MaxPacketSize_fitsLargestPacket() {
+  const size_t max_user_data_sizes[] = {udpdiscovery::kMaxUserDataSizeV0,
+                                        udpdiscovery::kMaxUserDataSizeV1,
+                                        udpdiscovery::kMaxUserDataSizeV2};
+  srand(3);
+  for (int version = udpdiscovery::kProtocolVersion0;
+       version <= udpdiscovery::kProtocolVersion2; ++version) {
+    // Random bytes, version 2 sends them uncompressed.
+    std::string user_data(max_user_data_sizes[version], 0);
+    for (size_t i = 0; i < user_data.size(); ++i) {
+      user_data[i] = (char)(rand() & 0xff);
+    }
+
+    udpdiscovery::Packet packet;
+    packet.set_packet_type(udpdiscovery::kPacketIAmHere);
+    packet.set_application_id(kApplicationId);
+    packet.set_peer_id(kPeerId);
+    packet.set_user_data(user_data);
+
+    std::string buffer;
+    assert(packet.Serialize((udpdiscovery::ProtocolVersion)version, buffer));
+    assert(buffer.size() ==
+           udpdiscovery::MaxPacketSize((udpdiscovery::ProtocolVersion)version));
+  }
+}
+
+// JSON-like service descriptor of about size bytes.
+std::string MakeDescriptor(size_t size) {
+  std::string result("{\"services\":[");
+  for (int i = 0; result.size() < size; ++i) {
+    char entry[128];
+    snprintf(entry, sizeof(entry),
+             "{\"name\":\"service-%d\",\"host\":\"10.0.%d.%d\","
+             "\"port\":%d,\"tags\":[\"http\",\"v2\"]},",
+             i, i / 250, i % 250, 8000 + i);
+    result += entry;
+  }
+  result += "]}";
+  return result;
+}
+
+void protocol_Lz_roundTrip() {
+  srand(2);
+  for (int i = 0; i < 2000; ++i) {
+    size_t size = rand() % 3000;
+    std::string data(size, 0);
+    // Random runs of few different bytes, both matches and literals.
+    int alphabet = 1 + rand() % 255;
+    for (size_t j = 0; j < size; ++j) {
+      data[j] = (char)(rand() % alphabet);
+    }
+
+    std::string compressed;
+    assert(udpdiscovery::impl::CompressLz(data.data(), data.size(),
+                                          2 * size + 16, compressed));
+
+    std::string decompressed(size, 0);
+    assert(udpdiscovery::impl::DecompressLz(
+        compressed.data(), compressed.size(),
+        size ? &decompressed[0] : 0, size));
+    assert(decompressed == data);
+  }
+}
+
+void protocol_Lz_withMaxSize_stops() {
+  srand(4);
+  std::string data(3000, 0);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = (char)(rand() & 0xff);
+  }
+
+  std::string compressed("prefix");
+  assert(!udpdiscovery::impl::CompressLz(data.data(), data.size(),
+                                         data.size(), compressed));
+  assert(compressed.size() <= 6 + data.size());
+  assert(compressed.compare(0, 6, "prefix") == 0);
+
+  std::string descriptor = MakeDescriptor(3000);
+  compressed.clear();
+  assert(udpdiscovery::impl::CompressLz(descriptor.data(), descriptor.size(),
+                                        descriptor.size() / 2, compressed));
+  assert(compressed.size() <= descriptor.size() / 2);
+}
+
+void protocol_Lz_withMalformedData_fails() {
+  std::string data = MakeDescriptor(2000);
+  std::string compressed;
+  assert(udpdiscovery::impl::CompressLz(data.data(), data.size(), data.size(),
+                                        compressed));
+
+  std::string out(data.size() + 100, 0);
+  assert(!udpdiscovery::impl::DecompressLz(compressed.data(),
+                                           compressed.size(), &out[0],
+                                           data.size() + 1));
+  assert(!udpdiscovery::impl::DecompressLz(compressed.data(),
+                                           compressed.size(), &out[0],
+                                           data.size() - 1));
+
+  // Truncated or damaged data never writes out of the output.
+  srand(3);
+  for (int i = 0; i < 10000; ++i) {
+    std::string damaged = compressed.substr(0, rand() % compressed.size());
+    if (!damaged.empty() && rand() % 2) {
+      damaged[rand() % damaged.size()] = (char)rand();
+    }
+    udpdiscovery::impl::DecompressLz(damaged.data(), damaged.size(), &out[0],
+                                     data.size());
+  }
+}
+
+void protocol_Serialize_Parse_V2_compressesUserData() {
+  std::string user_data = MakeDescriptor(8000);
+
+  udpdiscovery::Packet packet;
+  packet.set_packet_type(udpdiscovery::kPacketIAmHere);
+  packet.set_application_id(kApplicationId);
+  packet.set_peer_id(kPeerId);
+  packet.set_snapshot_index(kSnapshotIndex);
+  packet.set_user_data(user_data);
+
+  // Doesn't fit version 1.
+  std::string buffer;
+  assert(!packet.Serialize(udpdiscovery::kProtocolVersion1, buffer));
+
+  assert(packet.Serialize(udpdiscovery::kProtocolVersion2, buffer));
+  assert(buffer.size() < user_data.size() / 2);
+  assert(buffer[udpdiscovery::impl::kHeaderFlagsOffsetV2] ==
+         (char)udpdiscovery::impl::kFlagCompressedUserData);
+
+  udpdiscovery::Packet parsed;
+  assert(parsed.Parse(buffer) == udpdiscovery::kProtocolVersion2);
+  assert(parsed.packet_type() == udpdiscovery::kPacketIAmHere);
+  assert(parsed.application_id() == kApplicationId);
+  assert(parsed.peer_id() == kPeerId);
+  assert(parsed.snapshot_index() == kSnapshotIndex);
+  assert(parsed.user_data() == user_data);
+
+  udpdiscovery::PacketView packet_view;
+  assert(packet_view.Parse(buffer.data(), buffer.size()) ==
+         udpdiscovery::kProtocolVersion2);
+  assert(packet_view.UserDataEquals(user_data));
+
+  // Copies point to their own decompressed user data.
+  udpdiscovery::PacketView* original = new udpdiscovery::PacketView();
+  assert(original->Parse(buffer.data(), buffer.size()) ==
+         udpdiscovery::kProtocolVersion2);
+  udpdiscovery::PacketView copy(*original);
+  udpdiscovery::PacketView assigned;
+  assigned = *original;
+  delete original;
+  assert(copy.user_data_size() == user_data.size());
+  assert(copy.UserDataEquals(user_data));
+  assert(assigned.UserDataEquals(user_data));
+
+  // Unknown flags.
+  buffer[udpdiscovery::impl::kHeaderFlagsOffsetV2] = 2;
+  assert(packet_view.Parse(buffer.data(), buffer.size()) ==
+         udpdiscovery::kProtocolVersionUnknown);
+}
+
+void protocol_Serialize_V2_withIncompressibleUserData_sendsItAsIs() {
+  srand(4);
+  std::string user_data(1000, 0);
+  for (size_t i = 0; i < user_data.size(); ++i) {
+    user_data[i] = (char)rand();
+  }
+
+  udpdiscovery::Packet packet;
+  packet.set_packet_type(udpdiscovery::kPacketIAmHere);
+  packet.set_user_data(user_data);
+
+  std::string buffer_v1;
+  assert(packet.Serialize(udpdiscovery::kProtocolVersion1, buffer_v1));
+  std::string buffer_v2;
+  assert(packet.Serialize(udpdiscovery::kProtocolVersion2, buffer_v2));
+  assert(buffer_v2.size() == buffer_v1.size());
+  assert(buffer_v2[udpdiscovery::impl::kHeaderFlagsOffsetV2] == 0);
+
+  udpdiscovery::Packet parsed;
+  assert(parsed.Parse(buffer_v2) == udpdiscovery::kProtocolVersion2);
+  assert(parsed.user_data() == user_data);
+
+  // Trying to compress doesn't grow a buffer reserved for the header and user
+  // data.
+  std::string reserved;
+  reserved.reserve(udpdiscovery::impl::kHeaderSizeV1 + user_data.size());
+  const char* reserved_data = reserved.data();
+  size_t capacity = reserved.capacity();
+  assert(packet.Serialize(udpdiscovery::kProtocolVersion2, reserved));
+  assert(reserved.capacity() == capacity);
+  assert(reserved.data() == reserved_data);
+  assert(reserved == buffer_v2);
+}
+
+struct BytewiseHeader {
+  uint8_t magic[4];
+  uint8_t version;
+  uint8_t reserved[3];
+  uint8_t packet_type;
+  uint32_t application_id;
+  uint32_t peer_id;
+  uint64_t snapshot_index;
+  uint16_t user_data_size;
+};
+
+// Reads or writes the common header field by field through
+// SerializeUnsignedIntegerBigEndian. Reference for the fixed layout codec.
+bool SerializeHeaderBytewise(udpdiscovery::impl::SerializeDirection direction,
+                             BytewiseHeader* header,
+                             udpdiscovery::impl::BufferView* buffer_view) {
+  using udpdiscovery::impl::SerializeUnsignedIntegerBigEndian;
+
+  for (int i = 0; i < 4; ++i) {
+    if (!SerializeUnsignedIntegerBigEndian(direction, &header->magic[i],
+                                           buffer_view)) {
+      return false;
+    }
+  }
+  if (!SerializeUnsignedIntegerBigEndian(direction, &header->version,
+                                         buffer_view)) {
+    return false;
+  }
+  for (int i = 0; i < 3; ++i) {
+    if (!SerializeUnsignedIntegerBigEndian(direction, &header->reserved[i],
+                                           buffer_view)) {
+      return false;
+    }
+  }
+  return SerializeUnsignedIntegerBigEndian(direction, &header->packet_type,
+                                           buffer_view) &&
+         SerializeUnsignedIntegerBigEndian(direction, &header->application_id,
+                                           buffer_view) &&
+         SerializeUnsignedIntegerBigEndian(direction, &header->peer_id,
+                                           buffer_view) &&
+         SerializeUnsignedIntegerBigEndian(direction, &header->snapshot_index,
+                                           buffer_view) &&
+         SerializeUnsignedIntegerBigEndian(direction, &header->user_data_size,
+                                           buffer_view);
+}
+
+void protocol_Serialize_V1_matchesBytewiseHeader() {
+  srand(1);
+  for (int i = 0; i < 1000; ++i) {
+    std::string user_data(rand() % 100, (char)rand());
+
+    udpdiscovery::Packet packet;
+    packet.set_packet_type(rand() % 2 ? udpdiscovery::kPacketIAmHere
+                                      : udpdiscovery::kPacketIAmOutOfHere);
+    packet.set_application_id((uint32_t)rand() * 65599);
+    packet.set_peer_id((uint32_t)rand() * 31);
+    packet.set_snapshot_index(((uint64_t)rand() << 40) ^ (uint64_t)rand());
+    packet.set_user_data(user_data);
+
+    std::string buffer;
+    assert(packet.Serialize(udpdiscovery::kProtocolVersion1, buffer));
+
+    BytewiseHeader header;
+    header.magic[0] = 'S';
+    header.magic[1] = 'O';
+    header.magic[2] = '7';
+    header.magic[3] = 'V';
+    header.version = udpdiscovery::kProtocolVersion1;
+    header.reserved[0] = header.reserved[1] = header.reserved[2] = 0;
+    header.packet_type = packet.packet_type();
+    header.application_id = packet.application_id();
+    header.peer_id = packet.peer_id();
+    header.snapshot_index = packet.snapshot_index();
+    header.user_data_size = (uint16_t)user_data.size();
+
+    std::string expected;
+    udpdiscovery::impl::BufferView buffer_view(&expected);
+    SerializeHeaderBytewise(udpdiscovery::impl::kSerialize, &header,
+                            &buffer_view);
+    expected += user_data;
+
+    assert(buffer == expected);
+
+    udpdiscovery::PacketView packet_view;
+    assert(packet_view.Parse(buffer.data(), buffer.size()) ==
+           udpdiscovery::kProtocolVersion1);
+    assert(packet_view.packet_type() == packet.packet_type());
+    assert(packet_view.application_id() == packet.application_id());
+    assert(packet_view.peer_id() == packet.peer_id());
+    assert(packet_view.snapshot_index() == packet.snapshot_index());
+    assert(packet_view.UserDataEquals(user_data));
+  }
+}
+
+void protocol_Serialize_V0_matchesCreatePacketV0() {
+  std::string user_data("user data");
+
+  udpdiscovery::Packet packet;
+  packet.set_packet_type(udpdiscovery::kPacketIAmHere);
+  packet.set_application_id(kApplicationId);
+  packet.set_peer_id(kPeerId);
+  packet.set_snapshot_index(kSnapshotIndex);
+  packet.set_user_data(user_data);
+
+  std::string buffer;
+  assert(packet.Serialize(udpdiscovery::kProtocolVersion0, buffer));
+  assert(buffer == CreatePacketV0(user_data, 0));
+}
+
+// Prints how many packet headers per second are parsed by the byte by byte
+// reference and by PacketView.
+void protocol_benchmark_Parse() {
+  const int kNumIterations = 2000000;
+
+  std::string packet_buffer = CreatePacketV1(std::string(100, 'x'));
+
+  uint64_t checksum = 0;
+  clock_t start = clock();
+  for (int i = 0; i < kNumIterations; ++i) {
+    BytewiseHeader header;
+    udpdiscovery::impl::BufferView buffer_view(&packet_buffer);
+    SerializeHeaderBytewise(udpdiscovery::impl::kParse, &header, &buffer_view);
+    checksum += header.snapshot_index + header.peer_id;
+  }
+  double bytewise_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  start = clock();
+  for (int i = 0; i < kNumIterations; ++i) {
+    udpdiscovery::PacketView packet_view;
+    packet_view.Parse(packet_buffer.data(), packet_buffer.size());
+    checksum -= packet_view.snapshot_index() + packet_view.peer_id();
+  }
+  double packet_view_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  assert(checksum == 0);
+
+  printf("Parse: bytewise %.0f packets/s, PacketView %.0f packets/s\n",
+         kNumIterations / (bytewise_seconds > 0 ? bytewise_seconds : 1e-9),
+         kNumIterations /
+             (packet_view_seconds > 0 ? packet_view_seconds : 1e-9));
+}
+
+// Prints bytes on the wire of version 1 and version 2 and the cost of
+// compressing and decompressing user data.
+void protocol_benchmark_Compression() {
+  const size_t kSizes[] = {200, 1000, 4000, 16000};
+
+  printf("Compression\n");
+  printf("%10s %10s %10s %14s %14s\n", "user data", "wire V1", "wire V2",
+         "encode, MB/s", "decode, MB/s");
+
+  for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); ++i) {
+    std::string user_data = MakeDescriptor(kSizes[i]);
+    udpdiscovery::Packet packet;
+    packet.set_packet_type(udpdiscovery::kPacketIAmHere);
+    packet.set_user_data(user_data);
+
+    char wire_v1[16] = "-";
+    std::string buffer;
+    if (packet.Serialize(udpdiscovery::kProtocolVersion1, buffer)) {
+      snprintf(wire_v1, sizeof(wire_v1), "%d", (int)buffer.size());
+    }
+
+    int num_iterations = (int)(20000000 / user_data.size());
+    clock_t start = clock();
+    for (int j = 0; j < num_iterations; ++j) {
+      buffer.clear();
+      packet.Serialize(udpdiscovery::kProtocolVersion2, buffer);
+    }
+    double encode_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    size_t checksum = 0;
+    udpdiscovery::PacketView packet_view;
+    start = clock();
+    for (int j = 0; j < num_iterations; ++j) {
+      packet_view.Parse(buffer.data(), buffer.size());
+      checksum += packet_view.user_data_size();
+    }
+    double decode_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    assert(checksum == user_data.size() * num_iterations);
+
+    double megabytes = (double)user_data.size() * num_iterations / 1e6;
+    printf("%10d %10s %10d %14.0f %14.0f\n", (int)user_data.size(), wire_v1,
+           (int)buffer.size(),
+           megabytes / (encode_seconds > 0 ? encode_seconds : 1e-9),
+           megabytes / (decode_seconds > 0 ? decode_seconds : 1e-9));
+  }
+}
+
 int main() {
   protocol_SerializeUnsignedIntegerBigEndian_Serialize_8();
   protocol_SerializeUnsignedIntegerBigEndian_Parse_8();
@@ -194,4 +675,19 @@ int main() {
   protocol_Parse_withTooBigUserDataV0_failsToReadPacket();
   protocol_Parse_withTooBigPaddingV0_failsToReadPacket();
   protocol_Serialize_Parse_V1();
+  protocol_PacketView_Parse_V1_pointsIntoBuffer();
+  protocol_PacketView_Parse_withTruncatedPacket_fails();
+  protocol_Serialize_Parse_probe();
+  protocol_Serialize_Parse_heartbeat();
+  protocol_Parse_heartbeatWithoutTag_fails();
+  protocol_MaxPacketSize_fitsLargestPacket();
+  protocol_Lz_roundTrip();
+  protocol_Lz_withMaxSize_stops();
+  protocol_Lz_withMalformedData_fails();
+  protocol_Serialize_Parse_V2_compressesUserData();
+  protocol_Serialize_V2_withIncompressibleUserData_sendsItAsIs();
+  protocol_Serialize_V1_matchesBytewiseHeader();
+  protocol_Serialize_V0_matchesCreatePacketV0();
+  protocol_benchmark_Parse();
+  protocol_benchmark_Compression();
 }
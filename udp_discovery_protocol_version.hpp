@@ -5,6 +5,8 @@ namespace udpdiscovery {
 enum ProtocolVersion {
   kProtocolVersion0,
   kProtocolVersion1,
+  // Same header as version 1, user data can be compressed.
+  kProtocolVersion2,
   kProtocolVersionCurrent = kProtocolVersion1,
   kProtocolVersionUnknown = 255
 };